@@ -54,7 +54,7 @@ void lookup_items(uint32_t numoflookups, uint32_t range,
     }
 
     // Verify
-    assert(t.id == (uint32_t) k);
+    assert(t.id == (fb_key) k);
     assert(memcmp(&t.name, &str, 19) == 0);
     assert(t.name[19] == (char) k);
   }
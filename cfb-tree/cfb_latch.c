@@ -0,0 +1,87 @@
+#include "cfb_latch.h"
+
+#include <stdio.h>
+
+static pthread_rwlock_t *_fb_latch_get(fb_latches *latches, fb_pos pos)
+{
+	size_t c = pos / CFB_LATCH_CHUNK;
+	if (c >= CFB_LATCH_CHUNKS)
+	{
+		fprintf(stderr, "ERROR: too many blocks to latch\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_rwlock_t *chunk = __atomic_load_n(&latches->chunk[c], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+	{
+		pthread_mutex_lock(&latches->grow);
+		chunk = latches->chunk[c];
+		if (chunk == NULL)
+		{
+			chunk = malloc(CFB_LATCH_CHUNK * sizeof(pthread_rwlock_t));
+			if (chunk == NULL)
+			{
+				fprintf(stderr, "ERROR: cannot allocate latches\n");
+				exit(EXIT_FAILURE);
+			}
+			for (size_t l = 0; l < CFB_LATCH_CHUNK; ++l)
+			{
+				pthread_rwlock_init(chunk + l, NULL);
+			}
+			// publish the chunk only once its latches are usable
+			__atomic_store_n(&latches->chunk[c], chunk, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&latches->grow);
+	}
+	return chunk + pos % CFB_LATCH_CHUNK;
+}
+
+void fb_latch_init(fb_latches *latches)
+{
+	for (size_t c = 0; c < CFB_LATCH_CHUNKS; ++c)
+	{
+		latches->chunk[c] = NULL;
+	}
+	pthread_mutex_init(&latches->grow, NULL);
+	pthread_mutex_init(&latches->alloc, NULL);
+}
+
+void fb_latch_destr(fb_latches *latches)
+{
+	for (size_t c = 0; c < CFB_LATCH_CHUNKS; ++c)
+	{
+		if (latches->chunk[c] == NULL)
+		{
+			continue;
+		}
+		for (size_t l = 0; l < CFB_LATCH_CHUNK; ++l)
+		{
+			pthread_rwlock_destroy(latches->chunk[c] + l);
+		}
+		free(latches->chunk[c]);
+	}
+	pthread_mutex_destroy(&latches->grow);
+	pthread_mutex_destroy(&latches->alloc);
+}
+
+void fb_latch_acquire(
+		fb_latches *latches,
+		fb_pos pos,
+		bool exclusive)
+{
+	pthread_rwlock_t *latch = _fb_latch_get(latches, pos);
+	int err = exclusive ? pthread_rwlock_wrlock(latch) : pthread_rwlock_rdlock(latch);
+	if (err)
+	{
+		fprintf(stderr, "ERROR: cannot latch block\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void fb_latch_release(
+		fb_latches *latches,
+		fb_pos pos)
+{
+	pthread_rwlock_unlock(_fb_latch_get(latches, pos));
+}
+
@@ -0,0 +1,68 @@
+#ifndef CFB_LATCH_H
+#define CFB_LATCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cfb_tree.h"
+
+// latches allocated at once, for consecutive blocks
+#define CFB_LATCH_CHUNK (1024)
+
+// max number of chunks, bounds the number of blocks
+#define CFB_LATCH_CHUNKS (1 << 16)
+
+/**
+ * Reader/writer latches of the blocks of a tree, one per block,
+ * in a two-level table growing with the index file
+ */
+struct _fb_latches
+{
+	// chunks of latches, NULL until a block of the chunk is latched
+	pthread_rwlock_t *chunk[CFB_LATCH_CHUNKS];
+
+	// serializes the allocation of chunks
+	pthread_mutex_t grow;
+
+	// serializes the allocation and release of blocks
+	pthread_mutex_t alloc;
+};
+
+/**
+ * Initialize the latches of a tree
+ * @param[out] latches The latches being initialized
+ */
+void fb_latch_init(
+		fb_latches *latches);
+
+/**
+ * Release the latches, none may be held
+ * @param[in] latches The latches to destroy
+ */
+void fb_latch_destr(
+		fb_latches *latches);
+
+/**
+ * Latch a block, waiting for conflicting holders
+ * @param[in] latches The latches to use
+ * @param[in] pos The block to latch
+ * @param[in] exclusive Whether the block will be modified
+ */
+void fb_latch_acquire(
+		fb_latches *latches,
+		fb_pos pos,
+		bool exclusive);
+
+/**
+ * Release a latch previously acquired
+ * @param[in] latches The latches to use
+ * @param[in] pos The block to release
+ */
+void fb_latch_release(
+		fb_latches *latches,
+		fb_pos pos);
+
+#endif
+
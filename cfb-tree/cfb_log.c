@@ -0,0 +1,433 @@
+#include "cfb_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// largest record body read back, larger sizes come from a torn header
+#define CFB_LOG_MAX_RECORD ((size_t)1 << 30)
+
+/**
+ * FNV-1a, enough to tell a record cut short by a crash
+ */
+static uint64_t _fb_log_sum(uint64_t sum, const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		sum ^= bytes[i];
+		sum *= 1099511628211ull;
+	}
+	return sum;
+}
+
+static uint64_t _fb_log_rec_sum(
+		uint8_t type,
+		uint32_t size,
+		const void *head,
+		size_t head_size,
+		const void *body,
+		size_t body_size)
+{
+	uint64_t sum = 14695981039346656037ull;
+	sum = _fb_log_sum(sum, &type, sizeof(type));
+	sum = _fb_log_sum(sum, &size, sizeof(size));
+	sum = _fb_log_sum(sum, head, head_size);
+	if (body != NULL)
+	{
+		sum = _fb_log_sum(sum, body, body_size);
+	}
+	return sum;
+}
+
+static void _fb_log_write(int fd, const void *data, size_t size, size_t off)
+{
+	const char *bytes = data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, size, off);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written <= 0)
+		{
+			fprintf(stderr, "ERROR: cannot write log\n");
+			exit(EXIT_FAILURE);
+		}
+		bytes += written;
+		size -= written;
+		off += written;
+	}
+}
+
+/**
+ * Empty the log file, leaving only its header
+ */
+static void _fb_log_start(fb_log *log)
+{
+	fb_log_h head;
+	memset(&head, 0, sizeof(fb_log_h));
+	head.magic = CFB_LOG_MAGIC;
+	head.version = CFB_LOG_VERSION;
+	head.epoch = log->epoch;
+	head.block_size = log->block_size;
+
+	if (ftruncate(log->fd, 0))
+	{
+		fprintf(stderr, "ERROR: cannot truncate log\n");
+		exit(EXIT_FAILURE);
+	}
+	_fb_log_write(log->fd, &head, sizeof(fb_log_h), 0);
+	fdatasync(log->fd);
+	log->size = sizeof(fb_log_h);
+}
+
+static void _fb_log_track(fb_log *log, size_t blocks)
+{
+	free(log->imaged);
+	log->blocks = blocks;
+	log->imaged = calloc((blocks + 7) / 8 + 1, 1);
+	if (log->imaged == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate log image map\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Copy a record to the active buffer, with the lock held
+ * @return The sequence number the record is durable at
+ */
+static uint64_t _fb_log_put(
+		fb_log *log,
+		const fb_log_rec *rec,
+		const void *head,
+		size_t head_size,
+		const void *body,
+		size_t body_size)
+{
+	size_t size = sizeof(fb_log_rec) + rec->size;
+	int i = log->active;
+	if (log->buf_used + size > log->buf_size[i])
+	{
+		size_t grown = 2 * log->buf_size[i];
+		grown = grown > log->buf_used + size ? grown : log->buf_used + size;
+		char *buf = realloc(log->buf[i], grown);
+		if (buf == NULL)
+		{
+			fprintf(stderr, "ERROR: cannot grow log buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		log->buf[i] = buf;
+		log->buf_size[i] = grown;
+	}
+
+	if (log->buf_used == 0)
+	{
+		// the latency runs from the oldest record waiting
+		clock_gettime(CLOCK_REALTIME, &log->pending);
+		pthread_cond_signal(&log->wake);
+	}
+	char *dst = log->buf[i] + log->buf_used;
+	memcpy(dst, rec, sizeof(fb_log_rec));
+	memcpy(dst + sizeof(fb_log_rec), head, head_size);
+	if (body != NULL)
+	{
+		memcpy(dst + sizeof(fb_log_rec) + head_size, body, body_size);
+	}
+	log->buf_used += size;
+	log->appended += size;
+	return log->appended;
+}
+
+/**
+ * Wait for a sequence number to be durable
+ * @param[in] hurry Whether to write now rather than within the latency
+ */
+static void _fb_log_wait(fb_log *log, uint64_t lsn, bool hurry)
+{
+	pthread_mutex_lock(&log->lock);
+	while (log->durable < lsn)
+	{
+		if (hurry && !log->hurry)
+		{
+			log->hurry = true;
+			pthread_cond_signal(&log->wake);
+		}
+		pthread_cond_wait(&log->flushed, &log->lock);
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * Write and sync the records in groups, each record waiting
+ * at most the latency of the log for others to join it
+ */
+static void *_fb_log_flusher(void *arg)
+{
+	fb_log *log = arg;
+	pthread_mutex_lock(&log->lock);
+	while (true)
+	{
+		if (log->buf_used == 0)
+		{
+			if (log->stop)
+			{
+				break;
+			}
+			pthread_cond_wait(&log->wake, &log->lock);
+			continue;
+		}
+		if (!log->hurry && !log->stop)
+		{
+			struct timespec deadline = log->pending;
+			deadline.tv_sec += log->latency / 1000000;
+			deadline.tv_nsec += (long)(log->latency % 1000000) * 1000;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			if (pthread_cond_timedwait(&log->wake, &log->lock, &deadline) != ETIMEDOUT)
+			{
+				continue;
+			}
+		}
+
+		// appenders move on to the other buffer meanwhile
+		int i = log->active;
+		size_t used = log->buf_used;
+		size_t off = log->size;
+		uint64_t target = log->appended;
+		log->active = 1 - i;
+		log->buf_used = 0;
+		log->size += used;
+		log->hurry = false;
+		log->flushing = true;
+		pthread_mutex_unlock(&log->lock);
+
+		_fb_log_write(log->fd, log->buf[i], used, off);
+		fdatasync(log->fd);
+
+		pthread_mutex_lock(&log->lock);
+		log->flushing = false;
+		__atomic_store_n(&log->durable, target, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&log->flushed);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+void fb_log_init(
+		fb_log *log,
+		int fd,
+		size_t size,
+		uint64_t epoch,
+		size_t block_size,
+		size_t blocks,
+		size_t latency)
+{
+	log->fd = fd;
+	log->block_size = block_size;
+	log->epoch = epoch;
+	log->latency = latency;
+	log->imaged = NULL;
+	_fb_log_track(log, blocks);
+
+	if (size == 0)
+	{
+		_fb_log_start(log);
+	}
+	else
+	{
+		// drop a torn tail, new records follow the valid ones
+		if (ftruncate(fd, size))
+		{
+			fprintf(stderr, "ERROR: cannot truncate log\n");
+			exit(EXIT_FAILURE);
+		}
+		log->size = size;
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		log->buf_size[i] = CFB_LOG_BUFFER;
+		log->buf[i] = malloc(CFB_LOG_BUFFER);
+		if (log->buf[i] == NULL)
+		{
+			fprintf(stderr, "ERROR: cannot allocate log buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	log->buf_used = 0;
+	log->active = 0;
+	log->appended = 0;
+	log->durable = 0;
+	log->image_lsn = 0;
+	log->hurry = false;
+	log->flushing = false;
+	log->stop = false;
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->wake, NULL);
+	pthread_cond_init(&log->flushed, NULL);
+	if (pthread_create(&log->flusher, NULL, _fb_log_flusher, log))
+	{
+		fprintf(stderr, "ERROR: cannot start log flusher\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void fb_log_destr(fb_log *log)
+{
+	pthread_mutex_lock(&log->lock);
+	log->stop = true;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->flusher, NULL);
+
+	pthread_cond_destroy(&log->flushed);
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->lock);
+	free(log->buf[0]);
+	free(log->buf[1]);
+	free(log->imaged);
+}
+
+uint64_t fb_log_append(
+		fb_log *log,
+		uint8_t type,
+		const void *head,
+		size_t head_size,
+		const void *body,
+		size_t body_size)
+{
+	fb_log_rec rec;
+	rec.type = type;
+	rec.size = head_size + (body != NULL ? body_size : 0);
+	rec.sum = _fb_log_rec_sum(type, rec.size, head, head_size, body, body_size);
+
+	pthread_mutex_lock(&log->lock);
+	uint64_t lsn = _fb_log_put(log, &rec, head, head_size, body, body_size);
+	pthread_mutex_unlock(&log->lock);
+	return lsn;
+}
+
+void fb_log_image(
+		fb_log *log,
+		fb_pos pos,
+		const void *block)
+{
+	if (pos >= log->blocks)
+	{
+		// the block is newer than the checkpoint, recovery cuts it off
+		return;
+	}
+
+	uint8_t *byte = log->imaged + pos / 8;
+	uint8_t bit = 1u << (pos % 8);
+	uint64_t lsn;
+	if (__atomic_load_n(byte, __ATOMIC_ACQUIRE) & bit)
+	{
+		lsn = __atomic_load_n(&log->image_lsn, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&log->durable, __ATOMIC_ACQUIRE) >= lsn)
+		{
+			return;
+		}
+	}
+	else
+	{
+		fb_log_rec rec;
+		rec.type = CFB_LOG_IMAGE;
+		rec.size = sizeof(fb_pos) + log->block_size;
+
+		pthread_mutex_lock(&log->lock);
+		if (!(*byte & bit))
+		{
+			// copied under the lock, before anyone may change the block
+			rec.sum = _fb_log_rec_sum(rec.type, rec.size,
+					&pos, sizeof(fb_pos), block, log->block_size);
+			log->image_lsn = _fb_log_put(log, &rec,
+					&pos, sizeof(fb_pos), block, log->block_size);
+			__atomic_store_n(byte, *byte | bit, __ATOMIC_RELEASE);
+		}
+		lsn = log->image_lsn;
+		pthread_mutex_unlock(&log->lock);
+	}
+
+	// the block must not reach the index file before its image
+	_fb_log_wait(log, lsn, true);
+}
+
+void fb_log_imaged(
+		fb_log *log,
+		fb_pos pos)
+{
+	if (pos < log->blocks)
+	{
+		log->imaged[pos / 8] |= 1u << (pos % 8);
+	}
+}
+
+void fb_log_commit(fb_log *log)
+{
+	_fb_log_wait(log, fb_log_mark(log), false);
+}
+
+uint64_t fb_log_mark(fb_log *log)
+{
+	pthread_mutex_lock(&log->lock);
+	uint64_t lsn = log->appended;
+	pthread_mutex_unlock(&log->lock);
+	return lsn;
+}
+
+void fb_log_wait(fb_log *log, uint64_t lsn)
+{
+	_fb_log_wait(log, lsn, false);
+}
+
+void fb_log_reset(
+		fb_log *log,
+		uint64_t epoch,
+		size_t blocks)
+{
+	pthread_mutex_lock(&log->lock);
+	while (log->buf_used > 0 || log->flushing)
+	{
+		log->hurry = true;
+		pthread_cond_signal(&log->wake);
+		pthread_cond_wait(&log->flushed, &log->lock);
+	}
+	log->epoch = epoch;
+	_fb_log_start(log);
+	_fb_log_track(log, blocks);
+	pthread_mutex_unlock(&log->lock);
+}
+
+void *fb_log_read(
+		int fd,
+		size_t off,
+		fb_log_rec *rec)
+{
+	if (pread(fd, rec, sizeof(fb_log_rec), off) != sizeof(fb_log_rec)
+			|| rec->type < CFB_LOG_IMAGE || rec->type > CFB_LOG_DATA
+			|| rec->size > CFB_LOG_MAX_RECORD)
+	{
+		return NULL;
+	}
+
+	char *body = malloc(rec->size + 1);
+	if (body == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate log record\n");
+		exit(EXIT_FAILURE);
+	}
+	if (pread(fd, body, rec->size, off + sizeof(fb_log_rec)) != (ssize_t)rec->size
+			|| _fb_log_rec_sum(rec->type, rec->size, body, rec->size, NULL, 0) != rec->sum)
+	{
+		free(body);
+		return NULL;
+	}
+	return body;
+}
+
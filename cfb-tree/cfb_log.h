@@ -0,0 +1,241 @@
+#ifndef CFB_LOG_H
+#define CFB_LOG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cfb_tree.h"
+
+// identifies a log file, and the version of its layout
+#define CFB_LOG_MAGIC (0x474c4643)
+#define CFB_LOG_VERSION (1)
+
+// the content of a block before its first change since the checkpoint
+#define CFB_LOG_IMAGE (1)
+
+// a key inserted in the tree, or its value replaced
+#define CFB_LOG_INSERT (2)
+
+// a key removed from the tree
+#define CFB_LOG_DELETE (3)
+
+// opaque data of the user of the tree, handed back on replay
+#define CFB_LOG_DATA (4)
+
+// initial size of the buffers of records waiting to be written
+#define CFB_LOG_BUFFER (1 << 16)
+
+/**
+ * The header of a log file
+ */
+typedef struct _fb_log_h fb_log_h;
+struct _fb_log_h
+{
+	uint32_t magic;
+	uint32_t version;
+
+	// the checkpoint of the tree the log starts from
+	uint64_t epoch;
+
+	uint64_t block_size;
+}
+__attribute__((packed));
+
+/**
+ * The header of a record, its body follows
+ */
+typedef struct _fb_log_rec fb_log_rec;
+struct _fb_log_rec
+{
+	uint8_t type;
+
+	// the size of the body
+	uint32_t size;
+
+	// checksum of the type, size and body, to find a torn tail
+	uint64_t sum;
+}
+__attribute__((packed));
+
+/**
+ * A write-ahead log, with its records written and synced
+ * by a flusher thread in groups
+ */
+struct _fb_log
+{
+	// the descriptor of the log file
+	int fd;
+
+	// the size of a block image
+	size_t block_size;
+
+	// the checkpoint of the tree the log starts from
+	uint64_t epoch;
+
+	// bytes of the log file written so far
+	size_t size;
+
+	// records appended and not written yet, in the active buffer;
+	// the flusher writes the other one
+	char *buf[2];
+	size_t buf_size[2];
+	size_t buf_used;
+	int active;
+
+	// bytes of records appended, and durable, since the log was opened
+	uint64_t appended;
+	uint64_t durable;
+
+	// the last block image appended, changes wait for it to be durable
+	uint64_t image_lsn;
+
+	// when the oldest record of the active buffer was appended
+	struct timespec pending;
+
+	// the longest a record waits to be written, in microseconds
+	size_t latency;
+
+	// blocks of the checkpoint, and which ones have an image in the log
+	size_t blocks;
+	uint8_t *imaged;
+
+	// whether a writer waits for the records to be written now
+	bool hurry;
+
+	// whether the flusher is writing the other buffer
+	bool flushing;
+
+	bool stop;
+
+	pthread_mutex_t lock;
+
+	// signals the flusher of new records
+	pthread_cond_t wake;
+
+	// signals the waiters of durable records
+	pthread_cond_t flushed;
+
+	pthread_t flusher;
+};
+
+/**
+ * Initialize a log over an open log file, starting its flusher
+ * @param[out] log The log being initialized
+ * @param[in] fd The descriptor of the log file
+ * @param[in] size The bytes of valid records in the file,
+ *            0 to start it over
+ * @param[in] epoch The checkpoint the log starts from
+ * @param[in] block_size The size of a block image
+ * @param[in] blocks The number of blocks of the checkpoint
+ * @param[in] latency The longest a record waits to be written,
+ *            in microseconds
+ */
+void fb_log_init(
+		fb_log *log,
+		int fd,
+		size_t size,
+		uint64_t epoch,
+		size_t block_size,
+		size_t blocks,
+		size_t latency);
+
+/**
+ * Write all records, stop the flusher and release the log
+ * @param[in] log The log to destroy
+ */
+void fb_log_destr(
+		fb_log *log);
+
+/**
+ * Append a record, to be written within the latency of the log
+ * @param[in] log The log to use
+ * @param[in] type The type of the record
+ * @param[in] head The first part of the body
+ * @param[in] head_size The size of the first part
+ * @param[in] body The second part of the body, may be NULL
+ * @param[in] body_size The size of the second part
+ * @return The sequence number the record is durable at
+ */
+uint64_t fb_log_append(
+		fb_log *log,
+		uint8_t type,
+		const void *head,
+		size_t head_size,
+		const void *body,
+		size_t body_size);
+
+/**
+ * Log the image of a block about to change, the first time
+ * since the checkpoint, and wait for it to be durable
+ * @param[in] log The log to use
+ * @param[in] pos The block about to change
+ * @param[in] block The current content of the block
+ */
+void fb_log_image(
+		fb_log *log,
+		fb_pos pos,
+		const void *block);
+
+/**
+ * Mark a block as having its image in the log, while reading it back
+ * @param[in] log The log to use
+ * @param[in] pos The block
+ */
+void fb_log_imaged(
+		fb_log *log,
+		fb_pos pos);
+
+/**
+ * Wait for the records appended so far to be durable,
+ * sharing the sync with the other waiters
+ * @param[in] log The log to use
+ */
+void fb_log_commit(
+		fb_log *log);
+
+/**
+ * @param[in] log The log to use
+ * @return The sequence number the records appended so far are durable at
+ */
+uint64_t fb_log_mark(
+		fb_log *log);
+
+/**
+ * Wait for a sequence number to be durable,
+ * sharing the sync with the other waiters
+ * @param[in] log The log to use
+ * @param[in] lsn The sequence number to wait for
+ */
+void fb_log_wait(
+		fb_log *log,
+		uint64_t lsn);
+
+/**
+ * Start the log over after a checkpoint, no record may be appended meanwhile
+ * @param[in] log The log to reset
+ * @param[in] epoch The new checkpoint
+ * @param[in] blocks The number of blocks of the new checkpoint
+ */
+void fb_log_reset(
+		fb_log *log,
+		uint64_t epoch,
+		size_t blocks);
+
+/**
+ * Read the record at an offset of a log file
+ * @param[in] fd The descriptor of the log file
+ * @param[in] off The offset of the record
+ * @param[out] rec The header of the record
+ * @return The body of the record, to free, or NULL at the end of the
+ *         valid records
+ */
+void *fb_log_read(
+		int fd,
+		size_t off,
+		fb_log_rec *rec);
+
+#endif
+
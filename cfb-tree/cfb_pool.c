@@ -0,0 +1,324 @@
+#include "cfb_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static inline size_t _fb_pool_hash(fb_pool *pool, fb_pos pos)
+{
+	return (((uint64_t)pos * 0x9e3779b97f4a7c15ull) >> 32) & pool->table_mask;
+}
+
+/**
+ * @return The index of the table entry for pos, or of the
+ *         empty entry where it should be inserted
+ */
+static inline size_t _fb_pool_find(fb_pool *pool, fb_pos pos)
+{
+	size_t i = _fb_pool_hash(pool, pos);
+	while (pool->table[i] != 0 && pool->frame[pool->table[i] - 1].pos != pos)
+	{
+		i = (i + 1) & pool->table_mask;
+	}
+	return i;
+}
+
+static inline void _fb_pool_lock(fb_pool *pool)
+{
+	if (pool->shared)
+	{
+		pthread_mutex_lock(&pool->lock);
+	}
+}
+
+static inline void _fb_pool_unlock(fb_pool *pool)
+{
+	if (pool->shared)
+	{
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/**
+ * Wait with the lock held for the I/O of a busy frame to end,
+ * only another thread can have started it
+ */
+static inline void _fb_pool_wait(fb_pool *pool)
+{
+	if (pool->shared)
+	{
+		pthread_cond_wait(&pool->ready, &pool->lock);
+	}
+}
+
+static inline void _fb_pool_signal(fb_pool *pool)
+{
+	if (pool->shared)
+	{
+		pthread_cond_broadcast(&pool->ready);
+	}
+}
+
+static void _fb_pool_forget(fb_pool *pool, fb_pos pos)
+{
+	size_t i = _fb_pool_find(pool, pos);
+	pool->table[i] = 0;
+
+	// shift back the entries following the hole
+	size_t j = i;
+	while (true)
+	{
+		j = (j + 1) & pool->table_mask;
+		if (pool->table[j] == 0)
+		{
+			return;
+		}
+		size_t home = _fb_pool_hash(pool, pool->frame[pool->table[j] - 1].pos);
+		// move the entry if its home is not cyclically in (i, j]
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+		{
+			pool->table[i] = pool->table[j];
+			pool->table[j] = 0;
+			i = j;
+		}
+	}
+}
+
+static void _fb_pool_write(fb_pool *pool, fb_frame *frame)
+{
+	off_t off = (off_t)frame->pos * pool->block_size;
+	if (pwrite(pool->fd, frame->data, pool->block_size, off) != (ssize_t)pool->block_size)
+	{
+		fprintf(stderr, "ERROR: cannot write back block\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void _fb_pool_read(fb_pool *pool, fb_frame *frame)
+{
+	off_t off = (off_t)frame->pos * pool->block_size;
+	ssize_t got = pread(pool->fd, frame->data, pool->block_size, off);
+	if (got < 0)
+	{
+		fprintf(stderr, "ERROR: cannot read block\n");
+		exit(EXIT_FAILURE);
+	}
+	// freshly extended file regions read as zeroes
+	memset(frame->data + got, 0, pool->block_size - got);
+}
+
+/**
+ * Sweep the clock hand until an unpinned frame with no usage left,
+ * busy frames are pinned by the thread doing their I/O
+ */
+static fb_frame *_fb_pool_victim(fb_pool *pool)
+{
+	// every frame is visited at most CFB_POOL_MAX_USAGE + 1 times
+	for (size_t n = 0; n < pool->frames * (CFB_POOL_MAX_USAGE + 1); ++n)
+	{
+		fb_frame *frame = pool->frame + pool->hand;
+		pool->hand = (pool->hand + 1) % pool->frames;
+		if (frame->pins > 0)
+		{
+			continue;
+		}
+		if (frame->used && frame->usage > 0)
+		{
+			--frame->usage;
+			continue;
+		}
+		return frame;
+	}
+	fprintf(stderr, "ERROR: all frames of the buffer pool are pinned\n");
+	exit(EXIT_FAILURE);
+}
+
+void fb_pool_init(
+		fb_pool *pool,
+		int fd,
+		size_t block_size,
+		size_t budget)
+{
+	pool->fd = fd;
+	pool->block_size = block_size;
+	pool->frames = budget / block_size;
+	if (pool->frames < CFB_POOL_MIN_FRAMES)
+	{
+		pool->frames = CFB_POOL_MIN_FRAMES;
+	}
+
+	size_t table_size = 1;
+	while (table_size < 2 * pool->frames)
+	{
+		table_size <<= 1;
+	}
+	pool->table_mask = table_size - 1;
+
+	pool->frame = calloc(pool->frames, sizeof(fb_frame));
+	pool->table = calloc(table_size, sizeof(uint32_t));
+	pool->memory = NULL;
+	if (pool->frame == NULL || pool->table == NULL
+			|| posix_memalign((void **)&pool->memory, sysconf(_SC_PAGESIZE), pool->frames * block_size))
+	{
+		fprintf(stderr, "ERROR: cannot allocate buffer pool\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t f = 0; f < pool->frames; ++f)
+	{
+		pool->frame[f].data = pool->memory + f * block_size;
+	}
+
+	pool->hand = 0;
+	memset(&pool->stats, 0, sizeof(fb_pool_stats));
+	pool->stats.frames = pool->frames;
+
+	pool->shared = false;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+}
+
+void fb_pool_destr(fb_pool *pool)
+{
+	fb_pool_flush(pool);
+	pthread_cond_destroy(&pool->ready);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->memory);
+	free(pool->table);
+	free(pool->frame);
+}
+
+void fb_pool_share(fb_pool *pool)
+{
+	pool->shared = true;
+}
+
+fb_frame *fb_pool_pin(
+		fb_pool *pool,
+		fb_pos pos,
+		bool write)
+{
+	_fb_pool_lock(pool);
+	fb_frame *frame;
+	while (true)
+	{
+		size_t i = _fb_pool_find(pool, pos);
+		if (pool->table[i] != 0)
+		{
+			frame = pool->frame + pool->table[i] - 1;
+			if (frame->usage < CFB_POOL_MAX_USAGE)
+			{
+				++frame->usage;
+			}
+			++pool->stats.hits;
+
+			// the pin keeps the frame on the block while its I/O ends
+			++frame->pins;
+			while (frame->busy)
+			{
+				_fb_pool_wait(pool);
+			}
+			break;
+		}
+
+		frame = _fb_pool_victim(pool);
+		if (frame->used && frame->dirty)
+		{
+			// write the victim back without the lock, then sweep again
+			// since the block may have been pinned meanwhile
+			++frame->pins;
+			frame->busy = true;
+			_fb_pool_unlock(pool);
+			_fb_pool_write(pool, frame);
+			_fb_pool_lock(pool);
+			frame->busy = false;
+			frame->dirty = false;
+			--frame->pins;
+			++pool->stats.writebacks;
+			_fb_pool_signal(pool);
+			continue;
+		}
+		if (frame->used)
+		{
+			_fb_pool_forget(pool, frame->pos);
+			++pool->stats.evictions;
+			--pool->stats.resident;
+		}
+
+		// the block is found in the table before it is read,
+		// other pinners wait for the read to end
+		frame->pos = pos;
+		frame->used = true;
+		frame->dirty = false;
+		frame->usage = 1;
+		frame->pins = 1;
+		frame->busy = true;
+		pool->table[_fb_pool_find(pool, pos)] = frame - pool->frame + 1;
+		++pool->stats.misses;
+		++pool->stats.resident;
+		_fb_pool_unlock(pool);
+		_fb_pool_read(pool, frame);
+		_fb_pool_lock(pool);
+		frame->busy = false;
+		_fb_pool_signal(pool);
+		break;
+	}
+
+	frame->dirty |= write;
+	_fb_pool_unlock(pool);
+	return frame;
+}
+
+void fb_pool_unpin(
+		fb_pool *pool,
+		fb_frame *frame)
+{
+	_fb_pool_lock(pool);
+	if (frame->pins == 0)
+	{
+		fprintf(stderr, "ERROR: unpinning a frame not pinned\n");
+		exit(EXIT_FAILURE);
+	}
+	--frame->pins;
+	_fb_pool_unlock(pool);
+}
+
+void fb_pool_dirty(
+		fb_pool *pool,
+		fb_frame *frame)
+{
+	_fb_pool_lock(pool);
+	frame->dirty = true;
+	_fb_pool_unlock(pool);
+}
+
+void fb_pool_keep(
+		fb_pool *pool,
+		fb_frame *frame)
+{
+	_fb_pool_lock(pool);
+	frame->usage = CFB_POOL_MAX_USAGE;
+	_fb_pool_unlock(pool);
+}
+
+void fb_pool_flush(fb_pool *pool)
+{
+	_fb_pool_lock(pool);
+	for (size_t f = 0; f < pool->frames; ++f)
+	{
+		if (pool->frame[f].used && pool->frame[f].dirty)
+		{
+			_fb_pool_write(pool, pool->frame + f);
+			pool->frame[f].dirty = false;
+			++pool->stats.writebacks;
+		}
+	}
+	_fb_pool_unlock(pool);
+}
+
+void fb_pool_get_stats(
+		const fb_pool *pool,
+		fb_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
+
@@ -0,0 +1,189 @@
+#ifndef CFB_POOL_H
+#define CFB_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cfb_tree.h"
+
+// the least number of frames a pool can work with:
+// a split cascade keeps a few blocks pinned on each level
+#define CFB_POOL_MIN_FRAMES (32)
+
+// highest usage count of a frame, inner blocks start there
+#define CFB_POOL_MAX_USAGE (3)
+
+/**
+ * A frame of the pool, holding one block
+ */
+struct _fb_frame
+{
+	// the block held by the frame
+	fb_pos pos;
+
+	// number of users currently holding the frame
+	uint32_t pins;
+
+	// clock usage count, decremented by each sweep of the hand
+	uint8_t usage;
+
+	// whether the frame holds a block
+	bool used;
+
+	// whether the frame must be written back before eviction
+	bool dirty;
+
+	// whether the block is being read or written back without
+	// the lock of the pool, its pinners wait for the I/O to end
+	bool busy;
+
+	// the content of the block
+	char *data;
+};
+
+/**
+ * Counters of a pool, to size its budget
+ */
+typedef struct _fb_pool_stats fb_pool_stats;
+struct _fb_pool_stats
+{
+	// pins served by a resident frame
+	uint64_t hits;
+
+	// pins that had to read the block from the index file
+	uint64_t misses;
+
+	// blocks dropped to make room for others
+	uint64_t evictions;
+
+	// dirty blocks written back to the index file
+	uint64_t writebacks;
+
+	// frames in the pool
+	size_t frames;
+
+	// frames currently holding a block
+	size_t resident;
+};
+
+/**
+ * A fixed set of block frames replaced with CLOCK
+ */
+struct _fb_pool
+{
+	// the descriptor of the index file
+	int fd;
+
+	// the size of a block, and of a frame
+	size_t block_size;
+
+	// number of frames
+	size_t frames;
+
+	// the frames and their memory
+	fb_frame *frame;
+	char *memory;
+
+	// open addressing table from block position to frame index + 1
+	uint32_t *table;
+	size_t table_mask;
+
+	// position of the clock hand
+	size_t hand;
+
+	fb_pool_stats stats;
+
+	// whether several threads use the pool, serialized by lock
+	bool shared;
+	pthread_mutex_t lock;
+
+	// signals the end of the I/O of a busy frame
+	pthread_cond_t ready;
+};
+
+/**
+ * Initialize a pool of frames over an index file
+ * @param[out] pool The pool being initialized
+ * @param[in] fd The descriptor of the index file
+ * @param[in] block_size The size of a block
+ * @param[in] budget The memory to use for frames, in bytes
+ */
+void fb_pool_init(
+		fb_pool *pool,
+		int fd,
+		size_t block_size,
+		size_t budget);
+
+/**
+ * Write back all dirty frames and release the pool
+ * @param[in] pool The pool to destroy
+ */
+void fb_pool_destr(
+		fb_pool *pool);
+
+/**
+ * Let several threads pin and unpin frames of the pool
+ * @param[in] pool The pool to share
+ */
+void fb_pool_share(
+		fb_pool *pool);
+
+/**
+ * Pin a block in a frame, reading it if not resident
+ * @param[in] pool The pool to use
+ * @param[in] pos The block to pin
+ * @param[in] write Whether the block will be modified
+ * @return The frame holding the block, valid until unpinned
+ */
+fb_frame *fb_pool_pin(
+		fb_pool *pool,
+		fb_pos pos,
+		bool write);
+
+/**
+ * Release a frame previously pinned
+ * @param[in] pool The pool to use
+ * @param[in] frame The frame to release
+ */
+void fb_pool_unpin(
+		fb_pool *pool,
+		fb_frame *frame);
+
+/**
+ * Mark a pinned frame as modified, as if it had been pinned to write
+ * @param[in] pool The pool to use
+ * @param[in] frame The frame about to be modified
+ */
+void fb_pool_dirty(
+		fb_pool *pool,
+		fb_frame *frame);
+
+/**
+ * Make a pinned frame the last one to be evicted
+ * @param[in] pool The pool to use
+ * @param[in] frame The frame to keep
+ */
+void fb_pool_keep(
+		fb_pool *pool,
+		fb_frame *frame);
+
+/**
+ * Write back all dirty frames, keeping them resident
+ * @param[in] pool The pool to flush
+ */
+void fb_pool_flush(
+		fb_pool *pool);
+
+/**
+ * Read the counters of a pool
+ * @param[in] pool The pool to query
+ * @param[out] stats The counters of the pool
+ */
+void fb_pool_get_stats(
+		const fb_pool *pool,
+		fb_pool_stats *stats);
+
+#endif
+
@@ -0,0 +1,281 @@
+#include "cfb_search.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CFB_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#ifdef CFB_SEARCH_X86
+
+// the vector operations on lanes as wide as the keys
+#if CFB_KEY_BITS == 64
+#define CFB_SSE_LANES (2)
+#define CFB_AVX2_LANES (4)
+#define _fb_sse_set1(k) _mm_set1_epi64x((long long)(k))
+#define _fb_sse_cmpgt _mm_cmpgt_epi64
+#define _fb_sse_mask(v) _mm_movemask_pd(_mm_castsi128_pd(v))
+#define _fb_avx2_set1(k) _mm256_set1_epi64x((long long)(k))
+#define _fb_avx2_cmpgt _mm256_cmpgt_epi64
+#define _fb_avx2_mask(v) _mm256_movemask_pd(_mm256_castsi256_pd(v))
+#else
+#define CFB_SSE_LANES (4)
+#define CFB_AVX2_LANES (8)
+#define _fb_sse_set1(k) _mm_set1_epi32((int)(k))
+#define _fb_sse_cmpgt _mm_cmpgt_epi32
+#define _fb_sse_mask(v) _mm_movemask_ps(_mm_castsi128_ps(v))
+#define _fb_avx2_set1(k) _mm256_set1_epi32((int)(k))
+#define _fb_avx2_cmpgt _mm256_cmpgt_epi32
+#define _fb_avx2_mask(v) _mm256_movemask_ps(_mm256_castsi256_ps(v))
+#endif
+
+// the sign bit of a key
+#define CFB_KEY_SIGN ((fb_key)1 << (CFB_KEY_BITS - 1))
+
+// the vector operations on lanes as wide as the deltas
+#if CFB_KEY_DELTA_BITS == 16
+#define CFB_DELTA_SSE_LANES (8)
+#define CFB_DELTA_AVX2_LANES (16)
+#define _fb_delta_sse_set1(d) _mm_set1_epi16((short)(d))
+#define _fb_delta_sse_cmpgt _mm_cmpgt_epi16
+#define _fb_delta_avx2_set1(d) _mm256_set1_epi16((short)(d))
+#define _fb_delta_avx2_cmpgt _mm256_cmpgt_epi16
+#elif CFB_KEY_DELTA_BITS == 8
+#define CFB_DELTA_SSE_LANES (16)
+#define CFB_DELTA_AVX2_LANES (32)
+#define _fb_delta_sse_set1(d) _mm_set1_epi8((char)(d))
+#define _fb_delta_sse_cmpgt _mm_cmpgt_epi8
+#define _fb_delta_avx2_set1(d) _mm256_set1_epi8((char)(d))
+#define _fb_delta_avx2_cmpgt _mm256_cmpgt_epi8
+#endif
+
+#if CFB_KEY_DELTA_BITS
+// the sign bit of a delta
+#define CFB_DELTA_SIGN ((fb_delta)1 << (CFB_KEY_DELTA_BITS - 1))
+#endif
+
+#endif
+
+fb_search_fn fb_search_keys = fb_search_branchless;
+#if CFB_KEY_DELTA_BITS
+fb_search_delta_fn fb_search_deltas = fb_search_delta_branchless;
+#endif
+
+size_t fb_search_linear(const fb_key *keys, size_t cont, fb_key key)
+{
+	for (size_t i = 0; i < cont; ++i)
+	{
+		if (key < keys[i])
+		{
+			return i;
+		}
+	}
+	return cont;
+}
+
+size_t fb_search_branchless(const fb_key *keys, size_t cont, fb_key key)
+{
+	const fb_key *base = keys;
+	size_t len = cont;
+	while (len > 1)
+	{
+		size_t half = len / 2;
+		// compiles to a conditional move
+		base += (base[half - 1] <= key) ? half : 0;
+		len -= half;
+	}
+	return (base - keys) + (len == 1 && *base <= key);
+}
+
+#ifdef CFB_SEARCH_X86
+
+/**
+ * Count the tail of keys that does not fill a vector
+ */
+static inline size_t _fb_search_tail(const fb_key *keys, size_t from, size_t cont, fb_key key)
+{
+	size_t count = 0;
+	for (size_t i = from; i < cont; ++i)
+	{
+		count += keys[i] <= key;
+	}
+	return count;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+size_t fb_search_sse(const fb_key *keys, size_t cont, fb_key key)
+{
+	// keys are unsigned, flip the sign bit to compare them as signed
+	const __m128i flip = _fb_sse_set1(CFB_KEY_SIGN);
+	const __m128i pivot = _mm_xor_si128(_fb_sse_set1(key), flip);
+
+	size_t greater = 0;
+	size_t i = 0;
+	for (; i + CFB_SSE_LANES <= cont; i += CFB_SSE_LANES)
+	{
+		__m128i run = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), flip);
+		__m128i gt = _fb_sse_cmpgt(run, pivot);
+		greater += __builtin_popcount(_fb_sse_mask(gt));
+	}
+	return (i - greater) + _fb_search_tail(keys, i, cont, key);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t fb_search_avx2(const fb_key *keys, size_t cont, fb_key key)
+{
+	const __m256i flip = _fb_avx2_set1(CFB_KEY_SIGN);
+	const __m256i pivot = _mm256_xor_si256(_fb_avx2_set1(key), flip);
+
+	size_t greater = 0;
+	size_t i = 0;
+	for (; i + CFB_AVX2_LANES <= cont; i += CFB_AVX2_LANES)
+	{
+		__m256i run = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), flip);
+		__m256i gt = _fb_avx2_cmpgt(run, pivot);
+		greater += __builtin_popcount(_fb_avx2_mask(gt));
+	}
+	if (i + CFB_SSE_LANES <= cont)
+	{
+		return (i - greater) + fb_search_sse(keys + i, cont - i, key);
+	}
+	return (i - greater) + _fb_search_tail(keys, i, cont, key);
+}
+
+#else
+
+size_t fb_search_sse(const fb_key *keys, size_t cont, fb_key key)
+{
+	return fb_search_branchless(keys, cont, key);
+}
+
+size_t fb_search_avx2(const fb_key *keys, size_t cont, fb_key key)
+{
+	return fb_search_branchless(keys, cont, key);
+}
+
+#endif
+
+#if CFB_KEY_DELTA_BITS
+
+size_t fb_search_delta_linear(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	for (size_t i = 0; i < cont; ++i)
+	{
+		if (delta < deltas[i])
+		{
+			return i;
+		}
+	}
+	return cont;
+}
+
+size_t fb_search_delta_branchless(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	const fb_delta *base = deltas;
+	size_t len = cont;
+	while (len > 1)
+	{
+		size_t half = len / 2;
+		base += (base[half - 1] <= delta) ? half : 0;
+		len -= half;
+	}
+	return (base - deltas) + (len == 1 && *base <= delta);
+}
+
+#ifdef CFB_SEARCH_X86
+
+static inline size_t _fb_search_delta_tail(const fb_delta *deltas, size_t from, size_t cont, fb_delta delta)
+{
+	size_t count = 0;
+	for (size_t i = from; i < cont; ++i)
+	{
+		count += deltas[i] <= delta;
+	}
+	return count;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+size_t fb_search_delta_sse(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	const __m128i flip = _fb_delta_sse_set1(CFB_DELTA_SIGN);
+	const __m128i pivot = _mm_xor_si128(_fb_delta_sse_set1(delta), flip);
+
+	// the byte mask has as many bits per lane as the deltas have bytes
+	size_t greater = 0;
+	size_t i = 0;
+	for (; i + CFB_DELTA_SSE_LANES <= cont; i += CFB_DELTA_SSE_LANES)
+	{
+		__m128i run = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(deltas + i)), flip);
+		__m128i gt = _fb_delta_sse_cmpgt(run, pivot);
+		greater += __builtin_popcount(_mm_movemask_epi8(gt));
+	}
+	return (i - greater / sizeof(fb_delta)) + _fb_search_delta_tail(deltas, i, cont, delta);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t fb_search_delta_avx2(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	const __m256i flip = _fb_delta_avx2_set1(CFB_DELTA_SIGN);
+	const __m256i pivot = _mm256_xor_si256(_fb_delta_avx2_set1(delta), flip);
+
+	size_t greater = 0;
+	size_t i = 0;
+	for (; i + CFB_DELTA_AVX2_LANES <= cont; i += CFB_DELTA_AVX2_LANES)
+	{
+		__m256i run = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(deltas + i)), flip);
+		__m256i gt = _fb_delta_avx2_cmpgt(run, pivot);
+		greater += __builtin_popcount((unsigned)_mm256_movemask_epi8(gt));
+	}
+	greater /= sizeof(fb_delta);
+	if (i + CFB_DELTA_SSE_LANES <= cont)
+	{
+		return (i - greater) + fb_search_delta_sse(deltas + i, cont - i, delta);
+	}
+	return (i - greater) + _fb_search_delta_tail(deltas, i, cont, delta);
+}
+
+#else
+
+size_t fb_search_delta_sse(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	return fb_search_delta_branchless(deltas, cont, delta);
+}
+
+size_t fb_search_delta_avx2(const fb_delta *deltas, size_t cont, fb_delta delta)
+{
+	return fb_search_delta_branchless(deltas, cont, delta);
+}
+
+#endif
+
+#endif
+
+const char *fb_search_select(void)
+{
+#ifdef CFB_SEARCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		fb_search_keys = fb_search_avx2;
+#if CFB_KEY_DELTA_BITS
+		fb_search_deltas = fb_search_delta_avx2;
+#endif
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		fb_search_keys = fb_search_sse;
+#if CFB_KEY_DELTA_BITS
+		fb_search_deltas = fb_search_delta_sse;
+#endif
+		return "sse";
+	}
+#endif
+	fb_search_keys = fb_search_branchless;
+#if CFB_KEY_DELTA_BITS
+	fb_search_deltas = fb_search_delta_branchless;
+#endif
+	return "branchless";
+}
+
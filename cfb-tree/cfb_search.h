@@ -0,0 +1,86 @@
+#ifndef CFB_SEARCH_H
+#define CFB_SEARCH_H
+
+#include <stdlib.h>
+
+#include "cfb_tree.h"
+
+/**
+ * A node search kernel
+ * @param[in] keys The sorted keys of a node
+ * @param[in] cont The number of keys
+ * @param[in] key The key being searched
+ * @return The number of keys smaller or equal to key,
+ *         i.e. the index of the child to follow
+ */
+typedef size_t (*fb_search_fn)(const fb_key *keys, size_t cont, fb_key key);
+
+/**
+ * Scan with early exit, the original kernel
+ */
+size_t fb_search_linear(const fb_key *keys, size_t cont, fb_key key);
+
+/**
+ * Binary search without data dependent branches
+ */
+size_t fb_search_branchless(const fb_key *keys, size_t cont, fb_key key);
+
+/**
+ * Compare 4 keys per instruction, 2 of 64 bits, needs SSE4.2
+ */
+size_t fb_search_sse(const fb_key *keys, size_t cont, fb_key key);
+
+/**
+ * Compare 8 keys per instruction, 4 of 64 bits, needs AVX2
+ */
+size_t fb_search_avx2(const fb_key *keys, size_t cont, fb_key key);
+
+/**
+ * The kernel used by the tree, picked by fb_search_select
+ */
+extern fb_search_fn fb_search_keys;
+
+#if CFB_KEY_DELTA_BITS
+/**
+ * A node search kernel on keys packed as deltas from the base of the node
+ * @param[in] deltas The sorted deltas of a node
+ * @param[in] cont The number of deltas
+ * @param[in] delta The delta of the key being searched, in reach of the node
+ * @return The number of deltas smaller or equal to delta
+ */
+typedef size_t (*fb_search_delta_fn)(const fb_delta *deltas, size_t cont, fb_delta delta);
+
+/**
+ * Scan with early exit
+ */
+size_t fb_search_delta_linear(const fb_delta *deltas, size_t cont, fb_delta delta);
+
+/**
+ * Binary search without data dependent branches
+ */
+size_t fb_search_delta_branchless(const fb_delta *deltas, size_t cont, fb_delta delta);
+
+/**
+ * Compare 8 deltas of 16 bits (16 of 8 bits) per instruction, needs SSE4.2
+ */
+size_t fb_search_delta_sse(const fb_delta *deltas, size_t cont, fb_delta delta);
+
+/**
+ * Compare 16 deltas of 16 bits (32 of 8 bits) per instruction, needs AVX2
+ */
+size_t fb_search_delta_avx2(const fb_delta *deltas, size_t cont, fb_delta delta);
+
+/**
+ * The delta kernel used by the tree, picked by fb_search_select
+ */
+extern fb_search_delta_fn fb_search_deltas;
+#endif
+
+/**
+ * Pick the fastest kernel supported by the CPU
+ * @return The name of the kernel picked
+ */
+const char *fb_search_select(void);
+
+#endif
+
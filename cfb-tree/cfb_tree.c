@@ -1,8 +1,14 @@
 #include "cfb_tree.h"
+#include "cfb_latch.h"
+#include "cfb_log.h"
+#include "cfb_pool.h"
+#include "cfb_search.h"
 
 #include <assert.h>
 #include <fcntl.h>
 #include <math.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -10,843 +16,4807 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if CFB_LAYOUT_ALIGNED
+// a value or a position as stored in a node of the aligned layout
+#if CFB_VALUE_BITS >= CFB_POS_BITS
+typedef fb_value fb_ref;
+#else
+typedef fb_pos fb_ref;
+#endif
+#endif
+
 typedef struct _fb_node_data fb_node_data;
 struct _fb_node_data
 {
 	fb_slot_h *slot;
+#if CFB_KEY_DELTA_BITS
+	// the keys, as deltas from a base not above any of them,
+	// or whole from the base on in a wide node
+	fb_key *base;
+	fb_delta *deltas;
+#else
 	fb_key *keys;
+#endif
+#if CFB_LAYOUT_ALIGNED
+	// the values, and their types in 2 bits each
+	fb_ref *refs;
+	uint8_t *tags;
+#else
 	fb_val *vals;
+#endif
 };
 
+/**
+ * @return The bytes the keys of a node take, ahead of its values
+ */
+static inline size_t _fb_keys_size(size_t kfactor)
+{
+#if CFB_KEY_DELTA_BITS
+	return sizeof(fb_key) + kfactor * sizeof(fb_delta);
+#else
+	return kfactor * sizeof(fb_key);
+#endif
+}
+
+/**
+ * @return The bytes a node takes in a slot, past the slot header
+ */
+static size_t _fb_node_size(size_t bfactor)
+{
+#if CFB_LAYOUT_ALIGNED
+	size_t refs_off = (_fb_keys_size(bfactor - 1) + sizeof(fb_ref) - 1) & ~(sizeof(fb_ref) - 1);
+	return refs_off + bfactor * sizeof(fb_ref) + (bfactor + 3) / 4;
+#else
+	return bfactor * sizeof(fb_val) + _fb_keys_size(bfactor - 1);
+#endif
+}
+
 static inline fb_node_data _fb_node_content(
 		fb_tree *tree,
 		fb_block_h *block,
 		fb_pos node_pos)
 {
 	fb_node_data data;
-	data.slot = (fb_slot_h *)(block->body + node_pos * tree->slot_size);
+	data.slot = (fb_slot_h *)((char *)block + tree->slots_off + node_pos * tree->slot_size);
+#if CFB_KEY_DELTA_BITS
+	data.base = (fb_key *)data.slot->body;
+	data.deltas = (fb_delta *)(data.base + 1);
+#else
 	data.keys = (fb_key *)data.slot->body;
-	data.vals = (fb_val *)(data.slot->body + tree->kfactor * sizeof(fb_key));
+#endif
+#if CFB_LAYOUT_ALIGNED
+	size_t refs_off = (_fb_keys_size(tree->kfactor) + sizeof(fb_ref) - 1) & ~(sizeof(fb_ref) - 1);
+	data.refs = (fb_ref *)(data.slot->body + refs_off);
+	data.tags = (uint8_t *)(data.refs + tree->bfactor);
+#else
+	data.vals = (fb_val *)(data.slot->body + _fb_keys_size(tree->kfactor));
+#endif
 	return data;
 }
 
+/**
+ * @return The number of whole keys the keys of a node leave room for
+ */
+static inline size_t _fb_wide_cap(fb_tree *tree)
+{
+	return _fb_keys_size(tree->kfactor) / sizeof(fb_key);
+}
 
-static inline fb_block_data _fb_load_block(
-		fb_tree *tree,
-		fb_pos block_pos,
-		bool write)
+/**
+ * @return The number of keys a node splits at
+ */
+static inline size_t _fb_node_cap(fb_tree *tree, fb_node_data node)
 {
-	fb_block_data block_data;
-	int prot = write ? PROT_READ | PROT_WRITE : PROT_READ;
-	int flags = write ? MAP_SHARED : MAP_PRIVATE;
-	long page_size = sysconf(_SC_PAGESIZE);
-	size_t file_offset = ((block_pos * tree->block_size) / page_size) * page_size;
-	size_t ptr_offset = block_pos * tree->block_size - file_offset;
+#if CFB_KEY_DELTA_BITS
+	if (node.slot->type & CFB_SLOT_WIDE)
+	{
+		return _fb_wide_cap(tree);
+	}
+#else
+	(void)node;
+#endif
+	return tree->kfactor;
+}
 
-	block_data.mptr = mmap(
-			NULL,
-			tree->block_size + ptr_offset,
-			prot,
-			flags, 
-			tree->index_fd,
-			file_offset);
-	if (block_data.mptr == MAP_FAILED)
+/**
+ * @return The i-th key of a node
+ */
+static inline fb_key _fb_key_at(fb_node_data node, size_t i)
+{
+#if CFB_KEY_DELTA_BITS
+	if (node.slot->type & CFB_SLOT_WIDE)
 	{
-		fprintf(stderr, "ERROR: cannot mmap block\n");
-		exit(EXIT_FAILURE);
+		return node.base[i];
 	}
-	block_data.block = (fb_block_h *)(block_data.mptr + ptr_offset);
-	block_data.off = ptr_offset;
-	block_data.pos = block_pos;
-	return block_data;
+	return *node.base + node.deltas[i];
+#else
+	return node.keys[i];
+#endif
 }
 
-static inline void _fb_unload_block(fb_tree *tree, fb_block_data data)
+/**
+ * Store the i-th key of a node, within the range
+ * _fb_key_admit made room for
+ */
+static inline void _fb_key_put(fb_node_data node, size_t i, fb_key key)
 {
-	if (munmap(data.mptr, tree->block_size + data.off))
+#if CFB_KEY_DELTA_BITS
+	if (node.slot->type & CFB_SLOT_WIDE)
 	{
-		fprintf(stderr, "ERROR: cannot munmap block\n");
-		exit(EXIT_FAILURE);
+		node.base[i] = key;
+		return;
 	}
+	assert(key >= *node.base && key - *node.base <= CFB_KEY_DELTA_MAX);
+	node.deltas[i] = key - *node.base;
+#else
+	node.keys[i] = key;
+#endif
 }
 
+#if CFB_KEY_DELTA_BITS
+/**
+ * @return Whether the keys from lo to hi lie in the reach of the deltas
+ *         of a node, along with the keys it keeps
+ */
+static inline bool _fb_key_reach(fb_node_data node, size_t from, fb_key lo, fb_key hi)
+{
+	if (from < node.slot->cont)
+	{
+		fb_key first = _fb_key_at(node, from);
+		fb_key last = _fb_key_at(node, node.slot->cont - 1);
+		lo = first < lo ? first : lo;
+		hi = last > hi ? last : hi;
+	}
+	return hi - lo <= CFB_KEY_DELTA_MAX;
+}
+#endif
 
-void fb_print_block(fb_tree *tree, fb_block_h *block, fb_pos block_pos)
+/**
+ * @param[in] from The first key of the node to keep, those before
+ *            it are about to be overwritten
+ * @param[in] room The keys the node is to have room for, a node at rest
+ *            keeps room for one more than it holds
+ * @return Whether a node can hold the keys from lo to hi along with its
+ *         own, always with whole keys
+ */
+static inline bool _fb_key_fits(
+		fb_tree *tree,
+		fb_node_data node,
+		size_t from,
+		fb_key lo,
+		fb_key hi,
+		size_t room)
 {
-	printf("\n -- block %2i --\n", block_pos);
-	printf("type %i | cont %i | parent %i | root %i | height %i\n",
-			block->type, block->cont, block->parent, block->root, block->height);
-	for (size_t i = 0; i < tree->block_slots; ++i)
+#if CFB_KEY_DELTA_BITS
+	if (!(node.slot->type & CFB_SLOT_WIDE) && _fb_key_reach(node, from, lo, hi))
 	{
-		fb_node_data slot = _fb_node_content(tree, block, i);
-		if (slot.slot->type == CFB_SLOT_TYPE_CACHE)
+		return true;
+	}
+	return room <= _fb_wide_cap(tree);
+#else
+	(void)tree;
+	(void)node;
+	(void)from;
+	(void)lo;
+	(void)hi;
+	(void)room;
+	return true;
+#endif
+}
+
+/**
+ * Make room in a node for the keys from lo to hi, moving its base
+ * to the lowest key kept if they lie out of the reach of its deltas,
+ * or storing its keys whole if they lie too far apart
+ * @return False if the node cannot hold them along with its own
+ */
+static inline bool _fb_key_admit(
+		fb_tree *tree,
+		fb_node_data node,
+		size_t from,
+		fb_key lo,
+		fb_key hi,
+		size_t room)
+{
+	if (!_fb_key_fits(tree, node, from, lo, hi, room))
+	{
+		return false;
+	}
+#if CFB_KEY_DELTA_BITS
+	if (node.slot->type & CFB_SLOT_WIDE)
+	{
+		return true;
+	}
+	size_t cont = node.slot->cont;
+	if (!_fb_key_reach(node, from, lo, hi))
+	{
+		// the whole keys take the room of the base and the deltas
+		fb_key keys[UINT8_MAX];
+		for (size_t i = from; i < cont; ++i)
 		{
-			//printf("> slot %zu is cache\n", i);
+			keys[i] = _fb_key_at(node, i);
 		}
-		else
+		node.slot->type |= CFB_SLOT_WIDE;
+		for (size_t i = from; i < cont; ++i)
 		{
-			printf("> slot %zu: type %i | cont %i | parent %i\n",
-					i, slot.slot->type, slot.slot->cont, slot.slot->parent);
-			printf(">>> entry %4i: key %4f | type %2i | val %4i\n",
-					-1, -1/0.f, slot.vals[0].type, slot.vals[0].value);
-			for (size_t j = 0; j < slot.slot->cont; ++j)
-			{
-				printf(">>> entry %4zu: key %4i | type %2i | val %4i\n",
-						j, slot.keys[j], slot.vals[j+1].type, slot.vals[j+1].value);
-			}
+			node.base[i] = keys[i];
 		}
+		return true;
 	}
-	printf(" --------------\n\n");
+	fb_key base = *node.base;
+	if (from >= cont || lo < base || hi - base > CFB_KEY_DELTA_MAX)
+	{
+		fb_key first = from < cont ? _fb_key_at(node, from) : lo;
+		*node.base = first < lo ? first : lo;
+		for (size_t i = from; i < cont; ++i)
+		{
+			node.deltas[i] = base + node.deltas[i] - *node.base;
+		}
+	}
+#endif
+	return true;
 }
 
-void fb_print_tree(fb_tree *tree)
+/**
+ * Copy count keys of a node from the first given to an empty node,
+ * packing them if they lie close enough
+ */
+static inline void _fb_keys_copy(
+		fb_tree *tree,
+		fb_node_data to,
+		fb_node_data from,
+		size_t first,
+		size_t count)
 {
-	float usage_density = tree->block_nodes / (float)tree->block_slots;
-	printf("\n\n $$$$$ tree $$$$$\n\n"
-			"index_fd %i\n"
-			"block_size %zu\n"
-			"slot_size %zu\n"
-			"block_slots %zu\n"
-			"block_nodes %zu\n"
-			"cache_tuples %zu\n"
-			"block_bfactor %zu\n"
-			"block_height %zu\n"
-			"%% density %f\n"
-			"# items %zu\n"
-			"# blocks %zu\n"
-			"root_pos %i\n",
-			tree->index_fd,
-			tree->block_size,
-			tree->slot_size,
-			tree->block_slots,
-			tree->block_nodes,
-			tree->cache_tuples,
-			tree->bfactor,
-			tree->block_height,
-			usage_density,
-			tree->content,
-			tree->blocks_alloc,
-			tree->root);
-	
-	for (size_t block_pos = 0; block_pos < tree->blocks_alloc; ++block_pos)
+	to.slot->type &= ~CFB_SLOT_WIDE;
+	if (count == 0)
 	{
-		fb_block_data data =_fb_load_block(tree, block_pos, false);
-		fb_print_block(tree, data.block, block_pos);
-		_fb_unload_block(tree, data);
+		return;
+	}
+	bool fits = _fb_key_admit(tree, to, 0, _fb_key_at(from, first),
+			_fb_key_at(from, first + count - 1), count + 1);
+	assert(fits);
+	(void)fits;
+	for (size_t i = 0; i < count; ++i)
+	{
+		_fb_key_put(to, i, _fb_key_at(from, first + i));
 	}
 }
 
-static void _fb_init_node(
-		fb_tree *tree,
-		fb_block_h *block,
-		fb_pos node_pos)
+/**
+ * @return The number of keys of a node smaller or equal to key,
+ *         i.e. the index of the child to follow
+ */
+static inline size_t _fb_key_search(fb_node_data node, fb_key key)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	
-	for (fb_pos i = 0; i < tree->bfactor; ++i)
+#if CFB_KEY_DELTA_BITS
+	if (node.slot->type & CFB_SLOT_WIDE)
 	{
-		node.vals[i].type = CFB_VALUE_TYPE_NULL;
+		return fb_search_keys(node.base, node.slot->cont, key);
 	}
+	// keys out of the reach of the deltas come before or after all of them
+	fb_key base = *node.base;
+	if (key < base)
+	{
+		return 0;
+	}
+	if (key - base > CFB_KEY_DELTA_MAX)
+	{
+		return node.slot->cont;
+	}
+	return fb_search_deltas(node.deltas, node.slot->cont, key - base);
+#else
+	return fb_search_keys(node.keys, node.slot->cont, key);
+#endif
+}
 
-	node.slot->type = CFB_SLOT_TYPE_NODE;
-	node.slot->cont = 0;
-	++block->cont;
+/**
+ * @return The map of the slots of a block holding nodes
+ */
+static inline uint64_t *_fb_block_nodes(fb_tree *tree, fb_block_h *block)
+{
+	(void)tree;
+	return (uint64_t *)(block + 1);
 }
 
+/**
+ * @return The map of the cache slots of a block holding entries
+ */
+static inline uint64_t *_fb_block_cached(fb_tree *tree, fb_block_h *block)
+{
+	return (uint64_t *)(block + 1) + tree->slot_words;
+}
 
-static void _fb_init_block(
-		fb_tree *tree,
-		fb_block_h* block,
-		uint8_t type,
-		fb_pos parent)
+/**
+ * @return The map of the keys missed in the cache of a block
+ */
+static inline uint64_t *_fb_block_seen(fb_tree *tree, fb_block_h *block)
 {
-	block->type = type;
-	block->parent = parent;
-	block->root = 0;
-	block->cont = 0;
-	block->height = 0;
+	return (uint64_t *)(block + 1) + 2 * tree->slot_words;
+}
 
-	for (size_t s = 0; s < tree->block_slots; ++s)
+/**
+ * @return The first slot of a block
+ */
+static inline char *_fb_block_body(fb_tree *tree, fb_block_h *block)
+{
+	return (char *)block + tree->slots_off;
+}
+
+/**
+ * Set or clear the bit of a slot in a map of a block header
+ */
+static inline void _fb_slot_mark(uint64_t *map, size_t slot, bool set)
+{
+	uint64_t bit = (uint64_t)1 << (slot % 64);
+	map[slot / 64] = set ? map[slot / 64] | bit : map[slot / 64] & ~bit;
+}
+
+/**
+ * @return Whether the bit of a slot is set in a map of a block header
+ */
+static inline bool _fb_slot_marked(const uint64_t *map, size_t slot)
+{
+	return (map[slot / 64] >> (slot % 64)) & 1;
+}
+
+/**
+ * @return The position in its block of a slot
+ */
+static inline size_t _fb_slot_pos(fb_tree *tree, fb_block_h *block, fb_slot_h *slot)
+{
+	return ((char *)slot - _fb_block_body(tree, block)) / tree->slot_size;
+}
+
+/**
+ * @return The first slot from the given one whose bit is set
+ *         in a map of a block header, block_slots if none
+ */
+static inline size_t _fb_slot_next(fb_tree *tree, const uint64_t *map, size_t from)
+{
+	for (size_t w = from / 64; w < tree->slot_words; ++w)
 	{
-		fb_slot_h *slot = (fb_slot_h *)(block->body + s * tree->slot_size);
-		slot->type = CFB_SLOT_TYPE_CACHE;
-		slot->cont = 0;
+		uint64_t bits = w == from / 64 ? map[w] & (~(uint64_t)0 << (from % 64)) : map[w];
+		if (bits != 0)
+		{
+			return w * 64 + __builtin_ctzll(bits);
+		}
 	}
+	return tree->block_slots;
 }
 
-void fb_init_tree(
-		fb_tree *tree,
-		const char *file,
-		size_t block_size,
-		size_t slot_size,
-		size_t bfactor)
+/**
+ * @return The first slot before limit whose bit is clear
+ *         in both maps of a block header, limit if none
+ */
+static inline size_t _fb_slot_clear(const uint64_t *map, const uint64_t *other, size_t limit)
 {
-	tree->block_size = block_size;
-	tree->slot_size = slot_size;
+	for (size_t w = 0; w * 64 < limit; ++w)
+	{
+		uint64_t bits = ~(map[w] | other[w]);
+		if (bits != 0)
+		{
+			size_t slot = w * 64 + __builtin_ctzll(bits);
+			return slot < limit ? slot : limit;
+		}
+	}
+	return limit;
+}
 
-	tree->block_slots = (block_size - sizeof(fb_block_h)) / slot_size;
+#if CFB_LAYOUT_ALIGNED
+// value types by their 2-bit tag, CFB_VALUE_TYPE_CNTNT tagged 3
+static const uint8_t _fb_tag_types[4] = {
+	CFB_VALUE_TYPE_NULL, CFB_VALUE_TYPE_NODE, CFB_VALUE_TYPE_BLOCK, CFB_VALUE_TYPE_CNTNT};
+#endif
 
-	size_t cache_avail_body = slot_size - sizeof(fb_slot_h);
-	size_t cache_tuples = cache_avail_body / sizeof(fb_tuple);
-	tree->cache_tuples = cache_tuples;
-	
-	size_t min_slot_content = sizeof(fb_val) + (bfactor-1)*(sizeof(fb_key) + sizeof(fb_val));
-	if (min_slot_content > slot_size - sizeof(slot_size))
+/**
+ * @return The type of the i-th value of a node
+ */
+static inline uint8_t _fb_val_type(fb_node_data node, size_t i)
+{
+#if CFB_LAYOUT_ALIGNED
+	return _fb_tag_types[(node.tags[i / 4] >> (2 * (i % 4))) & 3];
+#else
+	return node.vals[i].type;
+#endif
+}
+
+/**
+ * @return The i-th value of a node
+ */
+static inline fb_val _fb_val_at(fb_node_data node, size_t i)
+{
+#if CFB_LAYOUT_ALIGNED
+	fb_val val;
+	val.type = _fb_val_type(node, i);
+	if (val.type == CFB_VALUE_TYPE_NODE || val.type == CFB_VALUE_TYPE_BLOCK)
 	{
-		fprintf(stderr, "ERROR: node cannot store enough key/value pairs for bfactor\n");
-		exit(EXIT_FAILURE);
+		val.node_pos = node.refs[i];
+	}
+	else
+	{
+		val.value = node.refs[i];
 	}
+	return val;
+#else
+	return node.vals[i];
+#endif
+}
 
-	if (cache_tuples < 1)
+/**
+ * Store the i-th value of a node
+ */
+static inline void _fb_val_put(fb_node_data node, size_t i, fb_val val)
+{
+#if CFB_LAYOUT_ALIGNED
+	// CFB_VALUE_TYPE_CNTNT is the only type with bit 2 set
+	uint8_t tag = val.type - (val.type >> 2);
+	uint8_t shift = 2 * (i % 4);
+	node.tags[i / 4] = (node.tags[i / 4] & ~(3u << shift)) | tag << shift;
+	if (val.type == CFB_VALUE_TYPE_NODE || val.type == CFB_VALUE_TYPE_BLOCK)
 	{
-		fprintf(stderr, "ERROR: cache must fit at least 1 tuple\n");
-		exit(EXIT_FAILURE);
+		node.refs[i] = val.node_pos;
+	}
+	else
+	{
+		node.refs[i] = val.value;
+	}
+#else
+	node.vals[i] = val;
+#endif
+}
+
+/**
+ * Mark the i-th value of a node as empty
+ */
+static inline void _fb_val_clear(fb_node_data node, size_t i)
+{
+#if CFB_LAYOUT_ALIGNED
+	node.tags[i / 4] &= ~(3u << (2 * (i % 4)));
+#else
+	node.vals[i].type = CFB_VALUE_TYPE_NULL;
+#endif
+}
+
+/**
+ * @return Whether a value points to a node or a block, not to content
+ */
+static inline bool _fb_is_child(fb_val val)
+{
+	return val.type == CFB_VALUE_TYPE_NODE || val.type == CFB_VALUE_TYPE_BLOCK;
+}
+
+// the counters of fb_stats, summed as an array
+#define CFB_STATS_COUNTERS (offsetof(fb_stats, probe_slots) / sizeof(uint64_t) + CFB_CACHE_WAYS + 1)
+
+// the shard of the counters of the calling thread, in every tree
+static __thread int _fb_stats_shard = -1;
+static int _fb_stats_threads = 0;
+
+/**
+ * @return The counters of the calling thread, shared with
+ *         the threads that come a multiple of the shards after it
+ */
+static inline fb_stats *_fb_stats(fb_tree *tree)
+{
+	if (_fb_stats_shard < 0)
+	{
+		_fb_stats_shard = __atomic_fetch_add(&_fb_stats_threads, 1, __ATOMIC_RELAXED) % CFB_STATS_SHARDS;
+	}
+	return tree->stats + _fb_stats_shard;
+}
+
+static inline void _fb_count(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Map or pin a block
+ * @param[in] write Whether the block is written to
+ * @param[in] dirty Whether what is written must reach the index file,
+ *            only hints such as reference bits may be written otherwise
+ */
+static inline fb_block_data _fb_fetch_block(
+		fb_tree *tree,
+		fb_pos block_pos,
+		bool write,
+		bool dirty)
+{
+	_fb_count(&_fb_stats(tree)->loads, 1);
+	fb_block_data block_data;
+	if (tree->map_base != NULL)
+	{
+		// the whole file is mapped, no system call needed
+		block_data.mptr = NULL;
+		block_data.off = 0;
+		block_data.block = (fb_block_h *)(tree->map_base + (size_t)block_pos * tree->block_size);
+		block_data.pos = block_pos;
+		block_data.frame = NULL;
+		return block_data;
+	}
+
+	if (tree->pool != NULL)
+	{
+		block_data.frame = fb_pool_pin(tree->pool, block_pos, dirty);
+		block_data.mptr = NULL;
+		block_data.off = 0;
+		block_data.block = (fb_block_h *)block_data.frame->data;
+		block_data.pos = block_pos;
+		if (!(block_data.block->type & CFB_BLOCK_TYPE_LEAF))
+		{
+			// keep inner blocks resident on purpose
+			fb_pool_keep(tree->pool, block_data.frame);
+		}
+		return block_data;
+	}
+
+	int prot = write ? PROT_READ | PROT_WRITE : PROT_READ;
+	int flags = dirty ? MAP_SHARED : MAP_PRIVATE;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t file_offset = ((block_pos * tree->block_size) / page_size) * page_size;
+	size_t ptr_offset = block_pos * tree->block_size - file_offset;
+
+	block_data.mptr = mmap(
+			NULL,
+			tree->block_size + ptr_offset,
+			prot,
+			flags, 
+			tree->index_fd,
+			file_offset);
+	if (block_data.mptr == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR: cannot mmap block\n");
+		exit(EXIT_FAILURE);
+	}
+	block_data.block = (fb_block_h *)(block_data.mptr + ptr_offset);
+	block_data.off = ptr_offset;
+	block_data.pos = block_pos;
+	block_data.frame = NULL;
+	return block_data;
+}
+
+static inline fb_block_data _fb_load_block(
+		fb_tree *tree,
+		fb_pos block_pos,
+		bool write)
+{
+	fb_block_data block_data = _fb_fetch_block(tree, block_pos, write, write);
+	if (write && tree->log != NULL)
+	{
+		fb_log_image(tree->log, block_pos, block_data.block);
+	}
+	return block_data;
+}
+
+/**
+ * Load a block to update its hints only, such as the reference bits
+ * of its cache entries. They are never logged; a mapped block still
+ * writes them back, while a logged tree or a pooled frame only keep
+ * them when the block is written for another reason, as writing them
+ * back would need an image or a dirty frame
+ */
+static inline fb_block_data _fb_hint_block(
+		fb_tree *tree,
+		fb_pos block_pos)
+{
+	return _fb_fetch_block(tree, block_pos, true, tree->log == NULL && tree->pool == NULL);
+}
+
+/**
+ * Load a block to read it, mapped so that _fb_write_block can make
+ * it writable in place if it turns out to be the block to change;
+ * the mapping shows the changes made by others while it is held
+ */
+static inline fb_block_data _fb_peek_block(
+		fb_tree *tree,
+		fb_pos block_pos)
+{
+	return _fb_fetch_block(tree, block_pos, true, tree->pool == NULL);
+}
+
+/**
+ * Make a block loaded by _fb_peek_block writable,
+ * logging its image and dirtying its frame as _fb_load_block would
+ */
+static inline void _fb_write_block(fb_tree *tree, fb_block_data data)
+{
+	if (data.frame != NULL)
+	{
+		fb_pool_dirty(tree->pool, data.frame);
+	}
+	if (tree->log != NULL)
+	{
+		fb_log_image(tree->log, data.pos, data.block);
+	}
+}
+
+static inline void _fb_unload_block(fb_tree *tree, fb_block_data data)
+{
+	if (data.frame != NULL)
+	{
+		fb_pool_unpin(tree->pool, data.frame);
+		return;
+	}
+	if (data.mptr == NULL)
+	{
+		// block lives in the long-lived mapping
+		return;
+	}
+	if (munmap(data.mptr, tree->block_size + data.off))
+	{
+		fprintf(stderr, "ERROR: cannot munmap block\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static inline void _fb_latch(fb_tree *tree, fb_pos block_pos, bool exclusive)
+{
+	if (tree->latches != NULL)
+	{
+		fb_latch_acquire(tree->latches, block_pos, exclusive);
+	}
+}
+
+static inline void _fb_unlatch(fb_tree *tree, fb_pos block_pos)
+{
+	if (tree->latches != NULL)
+	{
+		fb_latch_release(tree->latches, block_pos);
+	}
+}
+
+/**
+ * Release the latches of path[from] to path[to-1]
+ */
+static inline void _fb_unlatch_path(fb_tree *tree, const fb_pos *path, size_t from, size_t to)
+{
+	for (size_t d = from; d < to; ++d)
+	{
+		_fb_unlatch(tree, path[d]);
+	}
+}
+
+/**
+ * Latch the root block, following the root if it moves meanwhile
+ * @return The position of the root block, latched
+ */
+static fb_pos _fb_latch_root(fb_tree *tree, bool exclusive)
+{
+	fb_pos root_pos = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+	if (tree->latches == NULL)
+	{
+		return root_pos;
+	}
+	while (true)
+	{
+		fb_latch_acquire(tree->latches, root_pos, exclusive);
+		fb_pos now = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+		if (now == root_pos)
+		{
+			// the root only moves while its block is latched exclusively
+			return root_pos;
+		}
+		fb_latch_release(tree->latches, root_pos);
+		root_pos = now;
+	}
+}
+
+/**
+ * Grow the index file to hold 'blocks' blocks, extending
+ * the long-lived mapping in place if there is one
+ */
+static void _fb_extend_index(fb_tree *tree, size_t blocks)
+{
+	size_t size = blocks * tree->block_size;
+	if (ftruncate(tree->index_fd, size))
+	{
+		fprintf(stderr, "ERROR: cannot increase file size for new blocks\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (tree->map_base == NULL)
+	{
+		return;
+	}
+
+	// map only the new tail right after the current mapping:
+	// the base never moves, so block pointers held by callers stay valid
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t map_size = ((size + page_size - 1) / page_size) * page_size;
+	if (map_size <= tree->map_size)
+	{
+		return;
+	}
+	if (map_size > tree->map_reserve)
+	{
+		fprintf(stderr, "ERROR: index file outgrew the reserved mapping\n");
+		exit(EXIT_FAILURE);
+	}
+	void *tail = mmap(
+			tree->map_base + tree->map_size,
+			map_size - tree->map_size,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED,
+			tree->index_fd,
+			tree->map_size);
+	if (tail == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR: cannot extend index mapping\n");
+		exit(EXIT_FAILURE);
+	}
+	tree->map_size = map_size;
+}
+
+void fb_print_block(fb_tree *tree, fb_block_h *block, fb_pos block_pos)
+{
+	printf("\n -- block %2" CFB_POS_FMT " --\n", block_pos);
+	printf("type %i | cont %i | parent %" CFB_POS_FMT " | root %" CFB_POS_FMT " | height %" CFB_POS_FMT "\n",
+			block->type, block->cont, block->parent, block->root, block->height);
+	uint64_t *nodes = _fb_block_nodes(tree, block);
+	for (size_t i = _fb_slot_next(tree, nodes, 0); i < tree->block_slots; i = _fb_slot_next(tree, nodes, i + 1))
+	{
+		fb_node_data slot = _fb_node_content(tree, block, i);
+		printf("> slot %zu: type %i | cont %i | parent %" CFB_POS_FMT "\n",
+				i, slot.slot->type, slot.slot->cont, slot.slot->parent);
+		printf(">>> entry %4i: key %4f | type %2i | val %4" CFB_VALUE_FMT "\n",
+				-1, -1/0.f, _fb_val_type(slot, 0), _fb_val_at(slot, 0).value);
+		for (size_t j = 0; j < slot.slot->cont; ++j)
+		{
+			printf(">>> entry %4zu: key %4" CFB_KEY_FMT " | type %2i | val %4" CFB_VALUE_FMT "\n",
+					j, _fb_key_at(slot, j), _fb_val_type(slot, j+1), _fb_val_at(slot, j+1).value);
+		}
+	}
+	printf(" --------------\n\n");
+}
+
+void fb_print_tree(fb_tree *tree)
+{
+	float usage_density = tree->block_nodes / (float)tree->block_slots;
+	printf("\n\n $$$$$ tree $$$$$\n\n"
+			"index_fd %i\n"
+			"block_size %zu\n"
+			"slot_size %zu\n"
+			"block_slots %zu\n"
+			"block_nodes %zu\n"
+			"cache_size %zu\n"
+			"block_bfactor %zu\n"
+			"block_height %zu\n"
+			"%% density %f\n"
+			"# items %zu\n"
+			"# blocks %zu\n"
+			"root_pos %" CFB_POS_FMT "\n",
+			tree->index_fd,
+			tree->block_size,
+			tree->slot_size,
+			tree->block_slots,
+			tree->block_nodes,
+			tree->cache_size,
+			tree->bfactor,
+			tree->block_height,
+			usage_density,
+			tree->content,
+			tree->blocks_alloc,
+			tree->root);
+	
+	for (size_t block_pos = CFB_SUPER_POS + 1; block_pos < tree->blocks_alloc; ++block_pos)
+	{
+		fb_block_data data =_fb_load_block(tree, block_pos, false);
+		fb_print_block(tree, data.block, block_pos);
+		_fb_unload_block(tree, data);
+	}
+}
+
+static void _fb_init_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos node_pos)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	if (_fb_slot_marked(_fb_block_cached(tree, block), node_pos))
+	{
+		_fb_count(&_fb_stats(tree)->lost, node.slot->cont);
+		_fb_slot_mark(_fb_block_cached(tree, block), node_pos, false);
+	}
+	_fb_slot_mark(_fb_block_nodes(tree, block), node_pos, true);
+	
+	for (fb_pos i = 0; i < tree->bfactor; ++i)
+	{
+		_fb_val_clear(node, i);
+	}
+
+	node.slot->type = CFB_SLOT_TYPE_NODE;
+	node.slot->cont = 0;
+	++block->cont;
+}
+
+
+static void _fb_init_block(
+		fb_tree *tree,
+		fb_block_h* block,
+		uint8_t type,
+		fb_pos parent)
+{
+	block->type = type;
+	block->parent = parent;
+	block->root = 0;
+	block->cont = 0;
+	block->height = 0;
+	memset(block + 1, 0, (2 * tree->slot_words + tree->seen_words) * sizeof(uint64_t));
+
+	for (size_t s = 0; s < tree->block_slots; ++s)
+	{
+		fb_slot_h *slot = (fb_slot_h *)(_fb_block_body(tree, block) + s * tree->slot_size);
+		slot->type = CFB_SLOT_TYPE_CACHE;
+		slot->cont = 0;
+		slot->parent = 0;
+	}
+}
+
+/**
+ * @return The offset of the first slot of a block of the given slots,
+ *         past its header and the maps sized for them
+ */
+static size_t _fb_slots_offset(size_t slots)
+{
+	size_t slot_words = (slots + 63) / 64;
+	size_t seen_words = (slots * CFB_SEEN_BITS + 63) / 64;
+	size_t off = sizeof(fb_block_h) + (2 * slot_words + seen_words) * sizeof(uint64_t);
+#if CFB_LAYOUT_ALIGNED
+	off = (off + CFB_CACHE_LINE - 1) & ~(size_t)(CFB_CACHE_LINE - 1);
+#endif
+	return off;
+}
+
+/**
+ * Check the geometry of a tree and derive its sizes
+ */
+static void _fb_init_geometry(
+		fb_tree *tree,
+		size_t block_size,
+		size_t slot_size,
+		size_t bfactor)
+{
+	tree->block_size = block_size;
+	tree->slot_size = slot_size;
+
+	// the maps of the header take a few bits of each slot they cover
+	size_t slots = block_size > sizeof(fb_block_h) ? (block_size - sizeof(fb_block_h)) / slot_size : 0;
+	while (slots > 0 && _fb_slots_offset(slots) + slots * slot_size > block_size)
+	{
+		--slots;
+	}
+	tree->block_slots = slots;
+	tree->slot_words = (slots + 63) / 64;
+	tree->seen_words = (slots * CFB_SEEN_BITS + 63) / 64;
+	tree->slots_off = _fb_slots_offset(slots);
+
+	tree->cache_size = slot_size - sizeof(fb_slot_h);
+
+	if (tree->block_slots == 0)
+	{
+		fprintf(stderr, "ERROR: block cannot hold a slot\n");
+		exit(EXIT_FAILURE);
+	}
+	
+#if CFB_LAYOUT_ALIGNED
+	if (block_size % CFB_CACHE_LINE != 0 || slot_size % CFB_CACHE_LINE != 0)
+	{
+		fprintf(stderr, "ERROR: aligned layout needs blocks and slots of a multiple of %d bytes\n",
+				CFB_CACHE_LINE);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	if (bfactor < 3)
+	{
+		fprintf(stderr, "ERROR: a B+tree must have a bfactor > 2\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (_fb_node_size(bfactor) > slot_size - sizeof(fb_slot_h))
+	{
+		fprintf(stderr, "ERROR: node cannot store enough key/value pairs for bfactor\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (tree->cache_size <= sizeof(fb_cache_h))
+	{
+		fprintf(stderr, "ERROR: cache must fit at least 1 tuple\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (tree->cache_size > UINT16_MAX)
+	{
+		fprintf(stderr, "ERROR: cache entries cannot address a slot of %zu bytes\n", slot_size);
+		exit(EXIT_FAILURE);
+	}
+
+	fb_search_select();
+
+	tree->bfactor = bfactor;
+	tree->kfactor = bfactor - 1;
+
+#if CFB_KEY_DELTA_BITS
+	// keys too far apart to pack are stored whole, fewer of them, in
+	// nodes that must still split as those of a bfactor of 5 at least
+	if (_fb_wide_cap(tree) < 4)
+	{
+		fprintf(stderr, "ERROR: node cannot store enough whole keys for bfactor %zu, packed keys need %d\n",
+				bfactor, CFB_KEY_DELTA_BFACTOR_MIN);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	tree->block_nodes = 0;
+	for (size_t h = 0; h < tree->block_slots; ++h)
+	{
+		tree->block_nodes += pow(bfactor, h);
+		if (tree->block_nodes <= tree->block_slots)
+		{
+			tree->block_height = h;
+		}
+		else
+		{
+			tree->block_nodes -= pow(bfactor, h);
+			break;
+		}
+	}
+
+	if (sizeof(fb_super) > block_size)
+	{
+		fprintf(stderr, "ERROR: block cannot store the superblock\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tree->map_base = NULL;
+	tree->map_reserve = 0;
+	tree->map_size = 0;
+	tree->pool = NULL;
+	tree->latches = NULL;
+	tree->recover = false;
+	tree->log = NULL;
+	tree->cache_policy = CFB_CACHE_CLOCK;
+	tree->admit_policy = CFB_ADMIT_ALL;
+	tree->split_policy = CFB_SPLIT_APPEND;
+	tree->key_high = 0;
+	if (posix_memalign((void **)&tree->stats, __alignof__(fb_stats), CFB_STATS_SHARDS * sizeof(fb_stats)))
+	{
+		fprintf(stderr, "ERROR: cannot allocate tree counters\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(tree->stats, 0, CFB_STATS_SHARDS * sizeof(fb_stats));
+	tree->versions = calloc(CFB_VERSION_STRIPES, sizeof(fb_version));
+	if (tree->versions == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate tree versions\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Store the state of the tree in its superblock
+ * @param[in] clean Whether the blocks of the tree are all written
+ */
+static void _fb_write_super(fb_tree *tree, bool clean)
+{
+	fb_super super;
+	memset(&super, 0, sizeof(fb_super));
+	super.magic = CFB_SUPER_MAGIC;
+	super.version = CFB_SUPER_VERSION;
+	super.block_size = tree->block_size;
+	super.slot_size = tree->slot_size;
+	super.bfactor = tree->bfactor;
+	super.key_bits = CFB_KEY_BITS;
+	super.value_bits = CFB_VALUE_BITS;
+	super.pos_bits = CFB_POS_BITS;
+	super.layout_aligned = CFB_LAYOUT_ALIGNED;
+	super.key_delta_bits = CFB_KEY_DELTA_BITS;
+	super.content = tree->content;
+	super.blocks_alloc = tree->blocks_alloc;
+	super.blocks_free = tree->blocks_free;
+	super.root = tree->root;
+	super.free_head = tree->free_head;
+	super.epoch = tree->epoch;
+	super.key_high = tree->key_high;
+	super.clean = clean && !tree->recover;
+
+	off_t off = CFB_SUPER_POS * tree->block_size;
+	if (pwrite(tree->index_fd, &super, sizeof(fb_super), off) != sizeof(fb_super))
+	{
+		fprintf(stderr, "ERROR: cannot write superblock\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void fb_init_tree(
+		fb_tree *tree,
+		const char *file,
+		size_t block_size,
+		size_t slot_size,
+		size_t bfactor)
+{
+	_fb_init_geometry(tree, block_size, slot_size, bfactor);
+
+	tree->index_fd = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	assert(tree->index_fd != -1);
+
+	// the root block comes right after the superblock
+	tree->epoch = 0;
+	tree->content = 0;
+	tree->root = CFB_SUPER_POS + 1;
+	tree->blocks_alloc = tree->root + 1;
+	tree->free_head = CFB_NULL_POS;
+	tree->blocks_free = 0;
+	_fb_extend_index(tree, tree->blocks_alloc);
+	fb_block_data block = _fb_load_block(tree, tree->root, true);
+	_fb_init_block(tree, block.block, CFB_BLOCK_TYPE_ROOT | CFB_BLOCK_TYPE_LEAF, CFB_SUPER_POS);
+	_fb_unload_block(tree, block);
+	_fb_write_super(tree, false);
+}
+
+void fb_open_tree(
+		fb_tree *tree,
+		const char *file,
+		size_t block_size,
+		size_t slot_size,
+		size_t bfactor,
+		bool logged)
+{
+	_fb_init_geometry(tree, block_size, slot_size, bfactor);
+
+	tree->index_fd = open(file, O_RDWR);
+	if (tree->index_fd == -1)
+	{
+		fprintf(stderr, "ERROR: cannot open index file %s\n", file);
+		exit(EXIT_FAILURE);
+	}
+
+	fb_super super;
+	off_t off = CFB_SUPER_POS * block_size;
+	if (pread(tree->index_fd, &super, sizeof(fb_super), off) != sizeof(fb_super)
+			|| super.magic != CFB_SUPER_MAGIC)
+	{
+		fprintf(stderr, "ERROR: %s is not an index file\n", file);
+		exit(EXIT_FAILURE);
+	}
+	if (super.version != CFB_SUPER_VERSION)
+	{
+		fprintf(stderr, "ERROR: index file has layout version %u, expected %u\n",
+				super.version, CFB_SUPER_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	if (super.block_size != block_size || super.slot_size != slot_size
+			|| super.bfactor != bfactor)
+	{
+		fprintf(stderr, "ERROR: index file has geometry %lu %lu %lu, expected %zu %zu %zu\n",
+				(unsigned long)super.block_size, (unsigned long)super.slot_size,
+				(unsigned long)super.bfactor, block_size, slot_size, bfactor);
+		exit(EXIT_FAILURE);
+	}
+	if (super.key_bits != CFB_KEY_BITS || super.value_bits != CFB_VALUE_BITS
+			|| super.pos_bits != CFB_POS_BITS)
+	{
+		fprintf(stderr, "ERROR: index file has %u-bit keys, %u-bit values and %u-bit positions, "
+				"expected %u, %u and %u\n",
+				super.key_bits, super.value_bits, super.pos_bits,
+				CFB_KEY_BITS, CFB_VALUE_BITS, CFB_POS_BITS);
+		exit(EXIT_FAILURE);
+	}
+	if (super.layout_aligned != CFB_LAYOUT_ALIGNED)
+	{
+		fprintf(stderr, "ERROR: index file has the %s node layout\n",
+				super.layout_aligned ? "aligned" : "packed");
+		exit(EXIT_FAILURE);
+	}
+	if (super.key_delta_bits != CFB_KEY_DELTA_BITS)
+	{
+		fprintf(stderr, "ERROR: index file has keys stored as %u-bit deltas, expected %u (0 for whole keys)\n",
+				super.key_delta_bits, CFB_KEY_DELTA_BITS);
+		exit(EXIT_FAILURE);
+	}
+	// blocks allocated since the last checkpoint outlive a crash
+	struct stat st;
+	uint64_t stored = super.blocks_alloc * block_size;
+	if (fstat(tree->index_fd, &st)
+			|| (super.clean ? (uint64_t)st.st_size != stored : (uint64_t)st.st_size < stored)
+			|| super.root <= CFB_SUPER_POS || super.root >= super.blocks_alloc)
+	{
+		fprintf(stderr, "ERROR: index file does not match its superblock\n");
+		exit(EXIT_FAILURE);
+	}
+	// the blocks of a file not closed cleanly may be newer than its
+	// superblock, only a replay of the log brings them back in line
+	if (!super.clean && !logged)
+	{
+		fprintf(stderr, "ERROR: index file was not closed cleanly and is opened without its log\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tree->content = super.content;
+	tree->root = super.root;
+	tree->blocks_alloc = super.blocks_alloc;
+	tree->free_head = super.free_head;
+	tree->blocks_free = super.blocks_free;
+	tree->key_high = super.key_high;
+
+	// the blocks are those of the last checkpoint only if the file
+	// was closed cleanly, otherwise its log must be replayed
+	tree->recover = !super.clean;
+	tree->epoch = super.epoch;
+	if (!tree->recover)
+	{
+		// changes from now on are in no log of an earlier checkpoint
+		++tree->epoch;
+	}
+
+	// changes from now on are not in the file until fb_destr_tree
+	_fb_write_super(tree, false);
+	fdatasync(tree->index_fd);
+}
+
+void fb_map_tree(fb_tree *tree, size_t reserve)
+{
+	if (tree->map_base != NULL)
+	{
+		return;
+	}
+	if (tree->pool != NULL)
+	{
+		fprintf(stderr, "ERROR: cannot map a tree served by a buffer pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (reserve == 0)
+	{
+		reserve = CFB_MAP_RESERVE;
+	}
+	reserve = ((reserve + page_size - 1) / page_size) * page_size;
+
+	// reserve the address range once, the file is mapped over its head
+	void *base = mmap(NULL, reserve, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR: cannot reserve address space for index\n");
+		exit(EXIT_FAILURE);
+	}
+	tree->map_base = base;
+	tree->map_reserve = reserve;
+	tree->map_size = 0;
+	_fb_extend_index(tree, tree->blocks_alloc);
+}
+
+void fb_pool_tree(fb_tree *tree, size_t budget)
+{
+	if (tree->pool != NULL)
+	{
+		return;
+	}
+	if (tree->map_base != NULL)
+	{
+		fprintf(stderr, "ERROR: cannot attach a buffer pool to a mapped tree\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tree->pool = malloc(sizeof(fb_pool));
+	if (tree->pool == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate buffer pool\n");
+		exit(EXIT_FAILURE);
+	}
+	fb_pool_init(tree->pool, tree->index_fd, tree->block_size, budget);
+	if (tree->latches != NULL)
+	{
+		fb_pool_share(tree->pool);
+	}
+}
+
+void fb_latch_tree(fb_tree *tree)
+{
+	if (tree->latches != NULL)
+	{
+		return;
+	}
+
+	tree->latches = malloc(sizeof(fb_latches));
+	if (tree->latches == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate latches\n");
+		exit(EXIT_FAILURE);
+	}
+	fb_latch_init(tree->latches);
+	if (tree->pool != NULL)
+	{
+		fb_pool_share(tree->pool);
+	}
+}
+
+void fb_destr_tree(fb_tree *tree)
+{
+	if (tree->log != NULL)
+	{
+		fb_checkpoint(tree);
+		fb_log_destr(tree->log);
+		close(tree->log->fd);
+		free(tree->log);
+		tree->log = NULL;
+	}
+	if (tree->pool != NULL)
+	{
+		fb_pool_destr(tree->pool);
+		free(tree->pool);
+		tree->pool = NULL;
+	}
+	if (tree->map_base != NULL)
+	{
+		munmap(tree->map_base, tree->map_reserve);
+		tree->map_base = NULL;
+	}
+	if (tree->latches != NULL)
+	{
+		fb_latch_destr(tree->latches);
+		free(tree->latches);
+		tree->latches = NULL;
+	}
+
+	// the blocks reach the file before the superblock telling they did
+	fdatasync(tree->index_fd);
+	_fb_write_super(tree, true);
+	fdatasync(tree->index_fd);
+	close(tree->index_fd);
+	free(tree->stats);
+	tree->stats = NULL;
+	free(tree->versions);
+	tree->versions = NULL;
+}
+
+static size_t _fb_cache_worth(
+		fb_slot_h *slot);
+
+static void _fb_cache_migrate(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos slot_pos);
+
+static inline fb_pos _fb_get_fresh_node(
+		fb_tree *tree,
+		fb_block_h *block)
+{
+	// nodes keep to the first block_nodes slots, there is always one
+	// free among them; an empty slot costs nothing, else the cache
+	// slot worth the least is taken and its entries move out
+	uint64_t *nodes = _fb_block_nodes(tree, block);
+	uint64_t *cached = _fb_block_cached(tree, block);
+	fb_pos node_pos = _fb_slot_clear(nodes, cached, tree->block_nodes);
+	if (node_pos == tree->block_nodes)
+	{
+		size_t node_worth = SIZE_MAX;
+		for (size_t s = _fb_slot_next(tree, cached, 0); s < tree->block_nodes; s = _fb_slot_next(tree, cached, s + 1))
+		{
+			size_t worth = _fb_cache_worth(_fb_node_content(tree, block, s).slot);
+			if (worth < node_worth)
+			{
+				node_pos = s;
+				node_worth = worth;
+			}
+		}
+	}
+	if (node_pos == tree->block_nodes)
+	{
+		fprintf(stderr, "ERROR: could not find room for a node\n");
+		exit(EXIT_FAILURE);
+	}
+	if (_fb_slot_marked(cached, node_pos))
+	{
+		_fb_cache_migrate(tree, block, node_pos);
+	}
+	_fb_init_node(tree, block, node_pos);
+	return node_pos;
+}
+
+/**
+ * Give the slot of a node back to the block cache
+ */
+static inline void _fb_free_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos node_pos)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	node.slot->type = CFB_SLOT_TYPE_CACHE;
+	node.slot->cont = 0;
+	node.slot->parent = 0;
+	_fb_slot_mark(_fb_block_nodes(tree, block), node_pos, false);
+	--block->cont;
+}
+
+/**
+ * Take a block from the free list, or grow the index file by one
+ */
+static fb_pos _fb_alloc_block(fb_tree *tree)
+{
+	if (tree->latches != NULL)
+	{
+		pthread_mutex_lock(&tree->latches->alloc);
+	}
+
+	fb_pos block_pos = tree->free_head;
+	if (block_pos != CFB_NULL_POS)
+	{
+		fb_block_data data = _fb_load_block(tree, block_pos, false);
+		tree->free_head = data.block->parent;
+		--tree->blocks_free;
+		_fb_unload_block(tree, data);
+	}
+	else
+	{
+		block_pos = tree->blocks_alloc++;
+		_fb_extend_index(tree, tree->blocks_alloc);
+	}
+
+	if (tree->latches != NULL)
+	{
+		pthread_mutex_unlock(&tree->latches->alloc);
+	}
+	return block_pos;
+}
+
+/**
+ * Push a block on the free list, all its slots become cache
+ */
+static void _fb_free_block(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos block_pos)
+{
+	if (tree->latches != NULL)
+	{
+		pthread_mutex_lock(&tree->latches->alloc);
+	}
+	_fb_init_block(tree, block, CFB_BLOCK_TYPE_FREE, tree->free_head);
+	tree->free_head = block_pos;
+	++tree->blocks_free;
+	if (tree->latches != NULL)
+	{
+		pthread_mutex_unlock(&tree->latches->alloc);
+	}
+}
+
+/**
+ * @param[in] tree The tree to query
+ * @param[in] block The block in the tree to query
+ * @param[in] node_pos The node to be scanned, must be an inner node
+ * @param[in] key The key being searched
+ * @param[out] result Child position in block
+ */
+static inline void _fb_search_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos node_pos,
+		fb_key key,
+		bool *exact,
+		fb_val *result)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	assert (node.slot->cont > 0);
+
+	// first key larger than the searched one
+	size_t i = _fb_key_search(node, key);
+	*exact = ((i > 0) && (_fb_key_at(node, i-1) == key)) ? true : false;
+	*result = _fb_val_at(node, i);
+
+	// an inner node without a first child lets the next child
+	// cover the lower range, only leaf level nodes yield NULL
+	if (result->type == CFB_VALUE_TYPE_NULL && _fb_is_child(_fb_val_at(node, 1)))
+	{
+		*result = _fb_val_at(node, 1);
+	}
+	//printf("### search_node result type %i value %i\n", result->type, result->value);
+}
+
+
+/**
+ * @param[in] tree The tree to search in
+ * @param[in] block The block in the tree to search in
+ * @param[in] key The key being searched
+ * @param[out] node_pos The node that owns the leaf
+ * @param[out] leaf The leaf found by the search
+ * @param[out] leaf_pos The absolute position of the leaf in the block
+ * @param[out] child The child of the lowest existing node to which the leaf corresponds
+ * @param[out] status Whether we found the exact item or the range that should contain it
+ */
+static inline void _fb_search_block(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		bool *exact,
+		fb_val *result,
+		fb_pos *node_pos)
+{
+	*node_pos = block->root;
+	while (true)
+	{
+		fb_slot_h *slot = (fb_slot_h *)(_fb_block_body(tree, block) + *node_pos * tree->slot_size);
+		//printf("~ search_block node-type %i\n", slot->type);
+		if (slot->type & CFB_SLOT_TYPE_NODE)
+		{
+			_fb_search_node(tree, block, *node_pos, key, exact, result);
+
+			//printf("~ search_block leaf-type %i\n", result->type);
+			switch (result->type)
+			{
+				case CFB_VALUE_TYPE_NODE: *node_pos = result->node_pos; break;
+				case CFB_VALUE_TYPE_NULL: return;
+				case CFB_VALUE_TYPE_BLOCK: return;
+				case CFB_VALUE_TYPE_CNTNT: return;
+				default:
+					fprintf(stderr, "ERROR: found leaf with unknown value\n");
+					assert(false);
+			}
+		}
+		else
+		{
+			assert(false);
+		}
+	}
+}
+
+/**
+ * Walk down to the leaf block of a key with coupled shared latches,
+ * recording the path
+ * @param[in] hint Whether the blocks are loaded to update their hints,
+ *            so that the cache of the leaf is probed without loading it again
+ * @return The leaf block, loaded to read or for its hints and still latched
+ */
+static fb_block_data _fb_walk_leaf(
+		fb_tree *tree,
+		fb_key key,
+		bool hint,
+		bool *exact,
+		fb_val *result,
+		fb_pos *path,
+		size_t *depth,
+		fb_pos *node_pos)
+{
+	*depth = 0;
+	path[(*depth)++] = _fb_latch_root(tree, false);
+	fb_block_data block = hint ? _fb_hint_block(tree, path[0]) : _fb_load_block(tree, path[0], false);
+
+	if (block.block->cont == 0) // empty tree
+	{
+		result->type = CFB_VALUE_TYPE_NULL;
+		*exact = false;
+		*node_pos = 0;
+		return block;
+	}
+
+	_fb_search_block(tree, block.block, key, exact, result, node_pos);
+	
+	while (result->type == CFB_VALUE_TYPE_BLOCK)
+	{
+		// latch coupling, the child cannot change before it is latched
+		assert(*depth < CFB_MAX_DEPTH);
+		fb_pos child_pos = result->block_pos;
+		_fb_latch(tree, child_pos, false);
+		_fb_unload_block(tree, block);
+		_fb_unlatch(tree, path[*depth-1]);
+		path[(*depth)++] = child_pos;
+		block = hint ? _fb_hint_block(tree, child_pos) : _fb_load_block(tree, child_pos, false);
+		_fb_search_block(tree, block.block, key, exact, result, node_pos);
+	}
+
+	if (result->type != CFB_VALUE_TYPE_CNTNT)
+	{
+		*exact = false;
+	}
+	return block;
+}
+
+void _fb_retrieve_path(
+		fb_tree *tree,
+		fb_key key,
+		bool *exact,
+		fb_val *result,
+		fb_pos *path,
+		size_t *depth,
+		fb_pos *node_pos)
+{
+	fb_block_data block = _fb_walk_leaf(tree, key, false, exact, result, path, depth, node_pos);
+	_fb_unload_block(tree, block);
+	_fb_unlatch(tree, path[*depth-1]);
+}
+
+void _fb_retrieve(
+		fb_tree *tree,
+		fb_key key,
+		bool *exact,
+		fb_val *result,
+		fb_pos *block_pos,
+		fb_pos *node_pos)
+{
+	fb_pos path[CFB_MAX_DEPTH];
+	size_t depth;
+	_fb_retrieve_path(tree, key, exact, result, path, &depth, node_pos);
+	*block_pos = path[depth-1];
+}
+
+void fb_retrieve(
+		fb_tree *tree,
+		fb_key key,
+		bool *exact,
+		fb_val *result)
+{
+	fb_pos block_pos;
+	fb_pos node_pos;
+	_fb_retrieve(tree, key, exact, result, &block_pos, &node_pos);
+}
+
+
+/**
+ * A key of a batch, with its position in the caller's arrays
+ */
+typedef struct _fb_batch_key fb_batch_key;
+struct _fb_batch_key
+{
+	fb_key key;
+	uint32_t index;
+};
+
+static int _fb_batch_cmp(const void *a, const void *b)
+{
+	fb_key x = ((const fb_batch_key *)a)->key;
+	fb_key y = ((const fb_batch_key *)b)->key;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Find the child followed by the keys of a run starting at items[start]
+ * @param[out] child_index The index of the child in node
+ * @return The end of the run of keys following the same child
+ */
+static inline size_t _fb_batch_run(
+		fb_node_data node,
+		const fb_batch_key *items,
+		size_t start,
+		size_t count,
+		size_t *child_index)
+{
+	size_t i = _fb_key_search(node, items[start].key);
+	if (_fb_val_type(node, i) == CFB_VALUE_TYPE_NULL && _fb_is_child(_fb_val_at(node, 1)))
+	{
+		i = 1;
+	}
+	*child_index = i;
+	if (i == node.slot->cont)
+	{
+		return count;
+	}
+
+	size_t end = start + 1;
+	while (end < count && items[end].key < _fb_key_at(node, i))
+	{
+		++end;
+	}
+	return end;
+}
+
+/**
+ * Resolve the sorted keys of a batch below a node,
+ * visiting each child once for all the keys it covers
+ */
+static void _fb_batch_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos block_pos,
+		fb_pos node_pos,
+		const fb_batch_key *items,
+		size_t count,
+		bool *exact,
+		fb_val *results,
+		fb_pos *blocks)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	if (!_fb_is_child(_fb_val_at(node, 1)))
+	{
+		// a leaf, every key has its own entry
+		for (size_t k = 0; k < count; ++k)
+		{
+			fb_key key = items[k].key;
+			uint32_t index = items[k].index;
+			size_t i = _fb_key_search(node, key);
+			results[index] = _fb_val_at(node, i);
+			exact[index] = i > 0 && _fb_key_at(node, i-1) == key
+					&& _fb_val_type(node, i) == CFB_VALUE_TYPE_CNTNT;
+			if (blocks != NULL)
+			{
+				blocks[index] = block_pos;
+			}
+		}
+		return;
+	}
+
+	// announce the children about to be visited
+	size_t i;
+	size_t start = 0;
+	while (start < count)
+	{
+		start = _fb_batch_run(node, items, start, count, &i);
+		if (_fb_val_type(node, i) == CFB_VALUE_TYPE_NODE)
+		{
+			__builtin_prefetch(_fb_block_body(tree, block) + _fb_val_at(node, i).node_pos * tree->slot_size);
+		}
+		else if (_fb_val_type(node, i) == CFB_VALUE_TYPE_BLOCK && tree->map_base != NULL)
+		{
+			__builtin_prefetch(tree->map_base + (size_t)_fb_val_at(node, i).block_pos * tree->block_size);
+		}
+	}
+
+	start = 0;
+	while (start < count)
+	{
+		size_t end = _fb_batch_run(node, items, start, count, &i);
+		fb_val child = _fb_val_at(node, i);
+		if (child.type == CFB_VALUE_TYPE_NODE)
+		{
+			_fb_batch_node(tree, block, block_pos, child.node_pos,
+					items + start, end - start, exact, results, blocks);
+		}
+		else
+		{
+			_fb_latch(tree, child.block_pos, false);
+			fb_block_data data = _fb_load_block(tree, child.block_pos, false);
+			_fb_batch_node(tree, data.block, child.block_pos, data.block->root,
+					items + start, end - start, exact, results, blocks);
+			_fb_unload_block(tree, data);
+			_fb_unlatch(tree, child.block_pos);
+		}
+		start = end;
+	}
+}
+
+void _fb_retrieve_batch(
+		fb_tree *tree,
+		const fb_key *keys,
+		size_t count,
+		bool *exact,
+		fb_val *results,
+		fb_pos *block_pos)
+{
+	fb_pos root_pos = _fb_latch_root(tree, false);
+	fb_block_data root = _fb_load_block(tree, root_pos, false);
+	if (root.block->cont == 0) // empty tree
+	{
+		for (size_t k = 0; k < count; ++k)
+		{
+			exact[k] = false;
+			results[k].type = CFB_VALUE_TYPE_NULL;
+			if (block_pos != NULL)
+			{
+				block_pos[k] = root_pos;
+			}
+		}
+		_fb_unload_block(tree, root);
+		_fb_unlatch(tree, root_pos);
+		return;
+	}
+
+	fb_batch_key *items = malloc(count * sizeof(fb_batch_key));
+	if (items == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate batch\n");
+		exit(EXIT_FAILURE);
+	}
+	bool sorted = true;
+	for (size_t k = 0; k < count; ++k)
+	{
+		items[k].key = keys[k];
+		items[k].index = k;
+		sorted = sorted && (k == 0 || keys[k-1] <= keys[k]);
+	}
+	if (!sorted)
+	{
+		// keys of the same subtree become neighbours
+		qsort(items, count, sizeof(fb_batch_key), _fb_batch_cmp);
+	}
+
+	_fb_batch_node(tree, root.block, root_pos, root.block->root,
+			items, count, exact, results, block_pos);
+	_fb_unload_block(tree, root);
+	_fb_unlatch(tree, root_pos);
+	free(items);
+}
+
+void fb_retrieve_batch(
+		fb_tree *tree,
+		const fb_key *keys,
+		size_t count,
+		bool *exact,
+		fb_val *results)
+{
+	_fb_retrieve_batch(tree, keys, count, exact, results, NULL);
+}
+
+void _fb_insert_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos,
+		fb_key key,
+		fb_val val);
+
+static void _fb_cache_drop(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key);
+
+static void _fb_cache_purge(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key from);
+
+/**
+ * Take a node from new and recursively move all its children from old to new
+ */
+void _fb_move_subtree(
+		fb_tree *tree,
+		fb_block_h *old,
+		fb_block_h *new,
+		fb_pos node_pos,
+		fb_pos height)
+{
+	new->height = height;
+
+	fb_node_data node = _fb_node_content(tree, new, node_pos);
+	for (size_t i = 0; i < node.slot->cont + 1u; ++i)
+	{
+		fb_val curr_val = _fb_val_at(node, i);
+		if (curr_val.type == CFB_VALUE_TYPE_NODE)
+		{
+			_fb_init_node(tree, new, curr_val.node_pos);
+			fb_node_data from = _fb_node_content(tree, old, curr_val.node_pos);
+			fb_node_data to = _fb_node_content(tree, new, curr_val.node_pos);
+			to.slot->type = from.slot->type;
+			to.slot->parent = node_pos;
+			_fb_keys_copy(tree, to, from, 0, from.slot->cont);
+			to.slot->cont = from.slot->cont;
+			_fb_val_put(to, 0, _fb_val_at(from, 0));
+			for (size_t j = 0; j < to.slot->cont; ++j)
+			{
+				_fb_val_put(to, j+1, _fb_val_at(from, j+1));
+			}
+			from.slot->type = CFB_SLOT_TYPE_CACHE;
+			from.slot->cont = 0;
+			from.slot->parent = 0;
+			_fb_slot_mark(_fb_block_nodes(tree, old), curr_val.node_pos, false);
+			--old->cont;
+
+			_fb_move_subtree(tree, old, new, curr_val.node_pos, height+1);
+		}
+	}
+}
+
+/**
+ * Move the keys of a node from target_size on to an empty one, then
+ * the entry apart if any, alone once no key moved
+ */
+static void _fb_split_entries(
+		fb_tree *tree,
+		fb_node_data node,
+		fb_node_data next,
+		size_t target_size,
+		fb_key key,
+		const fb_val *apart)
+{
+	size_t moved = node.slot->cont - target_size;
+	_fb_keys_copy(tree, next, node, target_size, moved);
+	for (size_t i = 0; i < moved; ++i)
+	{
+		_fb_val_put(next, i+1, _fb_val_at(node, target_size+i+1));
+	}
+	next.slot->cont = moved;
+	node.slot->cont = target_size;
+
+	if (apart != NULL)
+	{
+		bool fits = _fb_key_admit(tree, next, 0, key, key, next.slot->cont + 2);
+		assert(fits);
+		(void)fits;
+		_fb_key_put(next, next.slot->cont, key);
+		_fb_val_put(next, next.slot->cont + 1, *apart);
+		++next.slot->cont;
+	}
+}
+
+/**
+ * Split a block whose root node is full, moving the upper keys of the root
+ * to a new block; the blocks below the moved nodes are not touched, as
+ * blocks know no parent and are only found from the blocks above them
+ * @param[in] path The blocks from the root down to the one to split, the
+ *            ones above it that may split as well are latched
+ * @param[in] depth The number of blocks of the path
+ * @param[in] apart An entry for key to add to the new block, or NULL
+ */
+void _fb_split_block(
+		fb_tree *tree,
+		fb_block_h *curr,
+		const fb_pos *path,
+		size_t depth,
+		size_t target_size,
+		fb_key key,
+		const fb_val *apart)
+{
+	fb_pos curr_pos = path[depth-1];
+	fb_pos newr_pos;
+	fb_pos next_pos;
+	bool fresh_parent = curr->type & CFB_BLOCK_TYPE_ROOT;
+	if (fresh_parent)
+	{
+		newr_pos = _fb_alloc_block(tree);
+		next_pos = _fb_alloc_block(tree);
+		_fb_latch(tree, newr_pos, true);
+	}
+	else
+	{
+		assert(depth > 1);
+		newr_pos = path[depth-2];
+		next_pos = _fb_alloc_block(tree);
+	}
+	// fresh blocks are unreachable from the tree, but not from
+	// callers still holding a position they looked up earlier
+	_fb_latch(tree, next_pos, true);
+	
+	// cannot be a root anymore
+	curr->type &= ~CFB_BLOCK_TYPE_ROOT;
+
+	uint8_t next_type = curr->type & CFB_BLOCK_TYPE_LEAF;
+	fb_block_data newr =_fb_load_block(tree, newr_pos, true);
+	if (fresh_parent)
+	{
+		_fb_init_block(tree, newr.block, CFB_BLOCK_TYPE_ROOT, CFB_NULL_POS);
+		_fb_init_node(tree, newr.block, newr.block->root);
+	}
+	fb_block_data next =_fb_load_block(tree, next_pos, true);
+	_fb_init_block(tree, next.block, next_type, CFB_NULL_POS);
+	// moved nodes keep their positions, the one of the old root is free
+	next.block->root = curr->root;
+	_fb_init_node(tree, next.block, next.block->root);
+	
+	fb_node_data old_node = _fb_node_content(tree, curr, curr->root);
+	fb_node_data new_node = _fb_node_content(tree, next.block, next.block->root);
+	_fb_split_entries(tree, old_node, new_node, target_size, key, apart);
+
+	if (curr->type & CFB_BLOCK_TYPE_LEAF)
+	{
+		// the moved keys are now cached in the new block
+		_fb_cache_purge(tree, curr, _fb_key_at(new_node, 0));
+	}
+
+	_fb_move_subtree(tree, curr, next.block, next.block->root, 0);
+	
+	// update root node
+	if (fresh_parent)
+	{
+		fb_node_data root_node = _fb_node_content(tree, newr.block, newr.block->root);
+		_fb_key_admit(tree, root_node, 0, _fb_key_at(new_node, 0), _fb_key_at(new_node, 0), 2);
+		_fb_key_put(root_node, 0, _fb_key_at(new_node, 0));
+		root_node.slot->cont = 1;
+		fb_val child;
+		child.type = CFB_VALUE_TYPE_BLOCK;
+		child.block_pos = curr_pos;
+		_fb_val_put(root_node, 0, child);
+		child.block_pos = next_pos;
+		_fb_val_put(root_node, 1, child);
+
+		// publish the new root once complete, readers waiting
+		// on the former one move to it
+		__atomic_store_n(&tree->root, newr_pos, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		fb_key insert_key = _fb_key_at(new_node, 0);
+		fb_val insert_val;
+		insert_val.type = CFB_VALUE_TYPE_BLOCK;
+		insert_val.block_pos = next_pos;
+		bool exact;
+		fb_val result;
+		fb_pos node_pos;
+		_fb_search_block(tree, newr.block, insert_key, &exact, &result, &node_pos);
+		_fb_insert_node(tree, newr.block, path, depth - 1, node_pos, insert_key, insert_val);
+	}
+	
+	_fb_unload_block(tree, newr);
+	_fb_unload_block(tree, next);
+	_fb_unlatch(tree, next_pos);
+	if (fresh_parent)
+	{
+		_fb_unlatch(tree, newr_pos);
+	}
+}
+
+/**
+ * @param[in] apart An entry for key to add to the new node, or NULL
+ */
+void _fb_split_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos,
+		size_t target_size,
+		fb_key key,
+		const fb_val *apart,
+		fb_pos *next_pos)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	*next_pos = _fb_get_fresh_node(tree, block);
+	fb_node_data next = _fb_node_content(tree, block, *next_pos);
+	next.slot->parent = node.slot->parent;
+
+	// copy keys and values to new node
+	_fb_split_entries(tree, node, next, target_size, key, apart);
+	
+	// update the parent of moved children
+	for (size_t i = 0; i < next.slot->cont + 1u; ++i)
+	{
+		fb_val curr_val = _fb_val_at(next, i);
+		if (curr_val.type == CFB_VALUE_TYPE_NODE)
+		{
+			fb_node_data child = _fb_node_content(tree, block, curr_val.node_pos);
+			child.slot->parent = *next_pos;
+		}
+	}
+
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_NODE;
+	val.node_pos = *next_pos;
+	_fb_insert_node(tree, block, path, depth, node.slot->parent, _fb_key_at(next, 0), val);
+}
+
+/**
+ * Split a node, adding a parent to it if it is the root of the block
+ * and the block has a level left, or else splitting the block
+ * @param[in] apart An entry for key to add to the new node, or NULL
+ */
+static void _fb_split(
+		fb_tree *tree,
+		fb_block_h *block,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos,
+		size_t target_size,
+		fb_key key,
+		const fb_val *apart)
+{
+	fb_pos next_pos;
+	if (node_pos != block->root) // guaranteed to have one free node
+	{
+		_fb_split_node(tree, block, path, depth, node_pos, target_size, key, apart, &next_pos);
+	}
+	else
+	{
+		if (block->height < tree->block_height)
+		{
+			// add a parent to the current root
+			fb_pos parent_pos =_fb_get_fresh_node(tree, block);
+			fb_node_data parent = _fb_node_content(tree, block, parent_pos);
+			fb_val child;
+			child.type = CFB_VALUE_TYPE_NODE;
+			child.node_pos = node_pos;
+			_fb_val_put(parent, 0, child);
+			block->root = parent_pos;
+			_fb_node_content(tree, block, node_pos).slot->parent = parent_pos;
+
+			++block->height;
+			
+			// split the former root
+			_fb_split_node(tree, block, path, depth, node_pos, target_size, key, apart, &next_pos);
+		}
+		else
+		{
+			//printf("~~~~~~~~~~~ splitting block ~~~~~~~~~~~\n");
+			_fb_split_block(tree, block, path, depth, target_size, key, apart);
+		}
+	}
+}
+
+static inline bool _fb_node_needs_split(fb_tree *tree, fb_block_h *block, size_t node_pos)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	return node.slot->cont == _fb_node_cap(tree, node) ? true : false;
+}
+
+/**
+ * Add a key out of the reach of the deltas of a node too full to hold
+ * whole keys, splitting the node on the side of the key: the keys left
+ * with it are few enough to be stored whole
+ * @param[in] first Whether key takes the place of the first key of the node
+ */
+static void _fb_insert_apart(
+		fb_tree *tree,
+		fb_block_h *block,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos,
+		fb_key key,
+		fb_val val,
+		bool first)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	if (key < _fb_key_at(node, 0))
+	{
+		// the node keeps nothing the key has to share deltas with
+		_fb_split(tree, block, path, depth, node_pos, first ? 1 : 0, key, NULL);
+		_fb_insert_node(tree, block, path, depth, node_pos, key, val);
+	}
+	else
+	{
+		// a key past all others of the tree goes alone, as appends would
+		size_t moved = _fb_wide_cap(tree) - 2;
+		if (tree->split_policy == CFB_SPLIT_APPEND
+				&& key >= __atomic_load_n(&tree->key_high, __ATOMIC_RELAXED))
+		{
+			moved = 0;
+		}
+		_fb_split(tree, block, path, depth, node_pos, node.slot->cont - moved, key, &val);
+	}
+}
+
+void _fb_insert_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos,
+		fb_key key,
+		fb_val val)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+
+	// the child covering the lower range without a first child split,
+	// it becomes the first child and the new one takes its place
+	if ((val.type == CFB_VALUE_TYPE_NODE || val.type == CFB_VALUE_TYPE_BLOCK)
+			&& _fb_val_type(node, 0) == CFB_VALUE_TYPE_NULL
+			&& node.slot->cont > 0 && key < _fb_key_at(node, 0))
+	{
+		if (!_fb_key_admit(tree, node, 1, key, key, node.slot->cont + 1))
+		{
+			_fb_insert_apart(tree, block, path, depth, node_pos, key, val, true);
+			return;
+		}
+		_fb_val_put(node, 0, _fb_val_at(node, 1));
+		_fb_key_put(node, 0, key);
+		_fb_val_put(node, 1, val);
+		return;
+	}
+
+	if (!_fb_key_admit(tree, node, 0, key, key, node.slot->cont + 1))
+	{
+		_fb_insert_apart(tree, block, path, depth, node_pos, key, val, false);
+		return;
+	}
+
+	fb_key key_tmp;
+	fb_key key_old = key;
+	fb_val val_tmp;
+	fb_val val_old = val;
+	for (size_t i = 0; i < node.slot->cont; ++i)
+	{
+		if (_fb_key_at(node, i) > key_old)
+		{
+			key_tmp = _fb_key_at(node, i);
+			val_tmp = _fb_val_at(node, i+1);
+			_fb_key_put(node, i, key_old);
+			_fb_val_put(node, i+1, val_old);
+			key_old = key_tmp;
+			val_old = val_tmp;
+		}
+	}
+	_fb_key_put(node, node.slot->cont, key_old);
+	_fb_val_put(node, node.slot->cont+1, val_old);
+
+	++node.slot->cont;
+
+	if (_fb_node_needs_split(tree, block, node_pos))
+	{
+		// a key past all others of the tree lands last in its node and
+		// the keys before it will not grow again, they stay where they are
+		size_t target_size = (_fb_node_cap(tree, node) + 1) / 2;
+		if (tree->split_policy == CFB_SPLIT_APPEND && key_old == key
+				&& key >= __atomic_load_n(&tree->key_high, __ATOMIC_RELAXED))
+		{
+			target_size = node.slot->cont - 1;
+		}
+		_fb_split(tree, block, path, depth, node_pos, target_size, key, NULL);
+	}
+}
+
+void _fb_replace_value(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos node_pos,
+		fb_key key,
+		fb_val val)
+{
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	
+	for (size_t i = 0; i < node.slot->cont; ++i)
+	{
+		if (_fb_key_at(node, i) == key)
+		{
+			_fb_val_put(node, i+1, val);
+		}
+	}
+}
+
+/**
+ * Number of children of a node, or of values of a leaf level node
+ */
+static inline size_t _fb_node_entries(fb_node_data node)
+{
+	return node.slot->cont + (_fb_val_type(node, 0) != CFB_VALUE_TYPE_NULL ? 1u : 0u);
+}
+
+/**
+ * Fewest entries a node should keep before borrowing or merging
+ */
+static inline size_t _fb_min_entries(fb_tree *tree)
+{
+	size_t min = (tree->kfactor - 1) / 2;
+	return min < 2 ? 2 : min;
+}
+
+/**
+ * @return Whether adding (or removing) an entry for key in a block
+ *         cannot change its parent block
+ */
+static inline bool _fb_block_safe(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		bool removing)
+{
+	if (block->cont == 0)
+	{
+		return !removing;
+	}
+	fb_node_data root = _fb_node_content(tree, block, block->root);
+	if (removing)
+	{
+		// the root of the block loses one entry at most
+		return _fb_node_entries(root) > _fb_min_entries(tree);
+	}
+	// a full root only splits the block once it has no level left to grow
+	if (block->height < tree->block_height)
+	{
+		return true;
+	}
+#if CFB_KEY_DELTA_BITS
+	// a root with room for whole keys takes any key, else the separators
+	// coming up from a child between two keys of the root stay in the
+	// reach of its deltas, the outer children may push them out of it
+	if (root.slot->cont + 1u < _fb_wide_cap(tree))
+	{
+		return true;
+	}
+	size_t i = _fb_key_search(root, key);
+	if ((root.slot->type & CFB_SLOT_WIDE) || i < 2 || i >= root.slot->cont)
+	{
+		return false;
+	}
+#else
+	(void)key;
+#endif
+	return root.slot->cont + 1u < tree->kfactor;
+}
+
+/**
+ * Walk down to the leaf block of a key to change it, recording the path.
+ * The optimistic walk couples shared latches and latches exclusively
+ * the leaf block alone, while its parent keeps it from being split or
+ * merged; it gives up if the change may spread to the parent block.
+ * The pessimistic walk latches the blocks exclusively, releasing the
+ * ancestors of each block the change cannot spread out of.
+ * Without latches, the first walk always succeeds.
+ * @param[in] tree The tree to walk
+ * @param[in] key The key to add or remove
+ * @param[in] optimistic Whether to latch the leaf block only
+ * @param[in] removing Whether the key will be removed
+ * @param[out] path The blocks from the root to the leaf block
+ * @param[out] top The first block of the path still latched
+ * @param[out] exact Whether the key is in the tree
+ * @param[out] result The value found for the key
+ * @param[out] node_pos The node of the leaf block holding the key
+ * @param[out] leaf The leaf block, left loaded for _fb_write_block unless NULL
+ * @return The depth of the path, 0 if the optimistic walk gave up
+ */
+static size_t _fb_descend(
+		fb_tree *tree,
+		fb_key key,
+		bool optimistic,
+		bool removing,
+		fb_pos *path,
+		size_t *top,
+		bool *exact,
+		fb_val *result,
+		fb_pos *node_pos,
+		fb_block_data *leaf)
+{
+	bool latched = tree->latches != NULL;
+	size_t depth = 0;
+	*top = 0;
+	path[depth++] = _fb_latch_root(tree, !optimistic);
+	fb_block_data block = _fb_peek_block(tree, path[0]);
+	if (latched && optimistic && (block.block->type & CFB_BLOCK_TYPE_LEAF))
+	{
+		// the root is the leaf block, nothing keeps it from
+		// splitting while it is latched again, its mapping
+		// shows the block as it is then
+		_fb_unlatch(tree, path[0]);
+		_fb_latch(tree, path[0], true);
+		if (__atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) != path[0]
+				|| !(block.block->type & CFB_BLOCK_TYPE_LEAF))
+		{
+			_fb_unload_block(tree, block);
+			_fb_unlatch(tree, path[0]);
+			return 0;
+		}
+	}
+
+	while (true)
+	{
+		if (block.block->cont == 0) // empty tree
+		{
+			result->type = CFB_VALUE_TYPE_NULL;
+			*node_pos = 0;
+			*exact = false;
+			break;
+		}
+		_fb_search_block(tree, block.block, key, exact, result, node_pos);
+		if (result->type != CFB_VALUE_TYPE_BLOCK)
+		{
+			break;
+		}
+
+		assert(depth < CFB_MAX_DEPTH);
+		fb_pos child_pos = result->block_pos;
+		path[depth++] = child_pos;
+		_fb_latch(tree, child_pos, !optimistic);
+		_fb_unload_block(tree, block);
+		block = _fb_peek_block(tree, child_pos);
+		if (!latched)
+		{
+			continue;
+		}
+
+		if (optimistic)
+		{
+			if (block.block->type & CFB_BLOCK_TYPE_LEAF)
+			{
+				// the parent is still latched, the block stays the leaf of key
+				_fb_unlatch(tree, child_pos);
+				_fb_latch(tree, child_pos, true);
+			}
+			_fb_unlatch(tree, path[depth-2]);
+			*top = depth - 1;
+		}
+		else if (_fb_block_safe(tree, block.block, key, removing))
+		{
+			_fb_unlatch_path(tree, path, *top, depth - 1);
+			*top = depth - 1;
+		}
+	}
+
+	if (result->type != CFB_VALUE_TYPE_CNTNT)
+	{
+		*exact = false;
+	}
+	if (latched && optimistic)
+	{
+		// the root block has no parent to spread to, replacing a value
+		// or missing the key to remove changes no structure
+		bool moot = depth == 1 || (removing ? !*exact : *exact);
+		if (!moot && !_fb_block_safe(tree, block.block, key, removing))
+		{
+			_fb_unload_block(tree, block);
+			_fb_unlatch(tree, path[depth-1]);
+			return 0;
+		}
+	}
+	if (leaf != NULL)
+	{
+		*leaf = block;
+		return depth;
+	}
+	_fb_unload_block(tree, block);
+	return depth;
+}
+
+/**
+ * Log a change to the tree, with its leaf latched so that
+ * changes to the same key are logged in the order they are made
+ * @param[in] value The new value of the key, NULL for a removal
+ */
+static inline void _fb_log_change(
+		fb_tree *tree,
+		fb_key key,
+		const fb_val *value)
+{
+	if (tree->log == NULL || tree->recover)
+	{
+		return;
+	}
+	uint8_t type = value != NULL ? CFB_LOG_INSERT : CFB_LOG_DELETE;
+	fb_log_append(tree->log, type, &key, sizeof(fb_key),
+			value, value != NULL ? sizeof(fb_val) : 0);
+}
+
+/**
+ * Raise the highest key inserted in the tree, it only hints at
+ * appends so it never goes down when keys are removed
+ */
+static inline void _fb_raise_high(fb_tree *tree, fb_key key)
+{
+	fb_key high = __atomic_load_n(&tree->key_high, __ATOMIC_RELAXED);
+	while (key > high && !__atomic_compare_exchange_n(&tree->key_high,
+			&high, key, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+static inline uint64_t _fb_key_hash(fb_key key);
+
+/**
+ * @return The versions of the tuples of the keys of the stripe of key
+ */
+static inline fb_version *_fb_version(fb_tree *tree, fb_key key)
+{
+	return tree->versions + _fb_key_hash(key) % CFB_VERSION_STRIPES;
+}
+
+/**
+ * @return The version to read the tuple of a key at, the writes
+ *         ended by then being in view
+ */
+static inline uint64_t _fb_read_version(fb_tree *tree, fb_key key)
+{
+	return __atomic_load_n(&_fb_version(tree, key)->ended, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @return Whether a tuple read at version is still the tuple of its key,
+ *         no write over it going on then nor begun since; a tuple
+ *         written elsewhere changes the value of its key instead,
+ *         which readers check as well
+ */
+static inline bool _fb_same_version(fb_tree *tree, fb_key key, uint64_t version)
+{
+	return __atomic_load_n(&_fb_version(tree, key)->began, __ATOMIC_ACQUIRE) == version;
+}
+
+/**
+ * Begin a write of the tuple of a key over its older version,
+ * before its leaf block is released
+ * @return The ticket of the write
+ */
+static inline uint64_t _fb_begin_write(fb_tree *tree, fb_key key)
+{
+	return __atomic_fetch_add(&_fb_version(tree, key)->began, 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Wait for the writes begun before a ticket to end
+ */
+static inline void _fb_await_write(fb_tree *tree, fb_key key, uint64_t ticket)
+{
+	while (__atomic_load_n(&_fb_version(tree, key)->ended, __ATOMIC_ACQUIRE) != ticket)
+	{
+		sched_yield();
+	}
+}
+
+/**
+ * End the write of a ticket, once the tuple is written
+ */
+static inline void _fb_end_write(fb_tree *tree, fb_key key, uint64_t ticket)
+{
+	__atomic_store_n(&_fb_version(tree, key)->ended, ticket + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Insert in the leaf block of the path, already loaded to write
+ */
+static void _fb_insert_leaf(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		fb_val value,
+		bool exact,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos)
+{
+	_fb_log_change(tree, key, &value);
+	if (block->cont == 0) // insertion on empty tree
+	{
+		_fb_init_node(tree, block, 0);
+		_fb_raise_high(tree, key);
+		_fb_insert_node(tree, block, path, depth, 0, key, value);
+		__atomic_add_fetch(&tree->content, 1, __ATOMIC_RELAXED);
+	}
+	else if (exact) // exact match, replace value
+	{
+		_fb_replace_value(tree, block, node_pos, key, value);
+	}
+	else // true insertion
+	{
+		_fb_raise_high(tree, key);
+		_fb_insert_node(tree, block, path, depth, node_pos, key, value);
+		__atomic_add_fetch(&tree->content, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void _fb_insert(
+		fb_tree *tree,
+		fb_key key,
+		fb_val value,
+		bool exact,
+		const fb_pos *path,
+		size_t depth,
+		fb_pos node_pos)
+{
+	fb_block_data block = _fb_load_block(tree, path[depth-1], true);
+	_fb_insert_leaf(tree, block.block, key, value, exact, path, depth, node_pos);
+	_fb_unload_block(tree, block);
+}
+
+void fb_insert(
+		fb_tree *tree,
+		fb_key key,
+		fb_val value)
+{
+	fb_pos path[CFB_MAX_DEPTH];
+	size_t top;
+	bool exact;
+	fb_val result;
+	fb_pos node_pos;
+	fb_block_data leaf;
+	size_t depth = _fb_descend(tree, key, true, false, path, &top, &exact, &result, &node_pos, &leaf);
+	if (depth == 0)
+	{
+		// the leaf block may split into its parent
+		depth = _fb_descend(tree, key, false, false, path, &top, &exact, &result, &node_pos, &leaf);
+	}
+	_fb_write_block(tree, leaf);
+	_fb_insert_leaf(tree, leaf.block, key, value, exact, path, depth, node_pos);
+	_fb_unload_block(tree, leaf);
+	_fb_unlatch_path(tree, path, top, depth);
+}
+
+/**
+ * @return The index in node of the value pointing to child, or -1
+ */
+static inline int _fb_child_index(
+		fb_tree *tree,
+		fb_node_data node,
+		uint8_t type,
+		fb_pos child)
+{
+	(void)tree;
+	for (size_t i = 0; i < node.slot->cont + 1u; ++i)
+	{
+		if (_fb_val_type(node, i) == type && _fb_val_at(node, i).node_pos == child)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static inline void _fb_adopt(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_val val,
+		fb_pos parent)
+{
+	if (val.type == CFB_VALUE_TYPE_NODE)
+	{
+		_fb_node_content(tree, block, val.node_pos).slot->parent = parent;
+	}
+}
+
+/**
+ * Remove the i-th child of a node
+ */
+static void _fb_remove_child(
+		fb_tree *tree,
+		fb_node_data node,
+		size_t i)
+{
+	(void)tree;
+	if (i == 0)
+	{
+		// the next child takes over the lower range
+		_fb_val_clear(node, 0);
+		return;
+	}
+
+	fb_key removed = _fb_key_at(node, i-1);
+	for (size_t j = i; j < node.slot->cont; ++j)
+	{
+		_fb_key_put(node, j-1, _fb_key_at(node, j));
+		_fb_val_put(node, j, _fb_val_at(node, j+1));
+	}
+	--node.slot->cont;
+
+	if (node.slot->cont == 0 && _fb_val_type(node, 0) != CFB_VALUE_TYPE_NULL)
+	{
+		// a node needs a key to be searched
+		_fb_key_put(node, 0, removed);
+		_fb_val_put(node, 1, _fb_val_at(node, 0));
+		_fb_val_clear(node, 0);
+		node.slot->cont = 1;
+	}
+}
+
+/**
+ * @param[in] admit Whether to make room for the keys in left
+ * @return Whether left can take the keys of right, sep being the key
+ *         that separates them in their parent
+ */
+static inline bool _fb_append_fits(
+		fb_tree *tree,
+		fb_node_data left,
+		fb_node_data right,
+		fb_key sep,
+		bool admit)
+{
+	size_t room = left.slot->cont + _fb_node_entries(right) + 1;
+	fb_key lo = sep;
+	fb_key hi = sep;
+	if (right.slot->cont > 0)
+	{
+		fb_key first = _fb_key_at(right, 0);
+		fb_key last = _fb_key_at(right, right.slot->cont - 1);
+		lo = first < lo ? first : lo;
+		hi = last > hi ? last : hi;
+	}
+	return admit ? _fb_key_admit(tree, left, 0, lo, hi, room) : _fb_key_fits(tree, left, 0, lo, hi, room);
+}
+
+/**
+ * Append the entries of right to left, sep being the key that
+ * separates them in their parent
+ */
+static void _fb_append_entries(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos left_pos,
+		fb_node_data left,
+		fb_node_data right,
+		fb_key sep)
+{
+	bool fits = _fb_append_fits(tree, left, right, sep, true);
+	assert(fits);
+	(void)fits;
+	if (_fb_val_type(right, 0) != CFB_VALUE_TYPE_NULL)
+	{
+		_fb_key_put(left, left.slot->cont, sep);
+		_fb_val_put(left, left.slot->cont + 1, _fb_val_at(right, 0));
+		_fb_adopt(tree, block, _fb_val_at(right, 0), left_pos);
+		++left.slot->cont;
+	}
+	for (size_t i = 0; i < right.slot->cont; ++i)
+	{
+		// without a first child, the second one covers the lower range
+		bool lower = i == 0 && _fb_val_type(right, 0) == CFB_VALUE_TYPE_NULL && _fb_is_child(_fb_val_at(right, 1));
+		_fb_key_put(left, left.slot->cont, lower ? sep : _fb_key_at(right, i));
+		_fb_val_put(left, left.slot->cont + 1, _fb_val_at(right, i+1));
+		_fb_adopt(tree, block, _fb_val_at(right, i+1), left_pos);
+		++left.slot->cont;
+	}
+}
+
+/**
+ * Move the last entry of left to the front of node, i-th child of parent
+ * @return False if the keys moved do not fit the nodes, nothing is moved
+ */
+static bool _fb_borrow_left(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_node_data parent,
+		size_t i,
+		fb_node_data left,
+		fb_node_data node,
+		fb_pos node_pos)
+{
+	fb_key last_key = _fb_key_at(left, left.slot->cont - 1);
+	fb_val last_val = _fb_val_at(left, left.slot->cont);
+	fb_key sep = _fb_key_at(parent, i-1);
+	fb_key lo = last_key < sep ? last_key : sep;
+	fb_key hi = last_key < sep ? sep : last_key;
+	if (!_fb_key_fits(tree, node, 0, lo, hi, node.slot->cont + 2)
+			|| !_fb_key_fits(tree, parent, 0, last_key, last_key, parent.slot->cont + 1))
+	{
+		return false;
+	}
+	_fb_key_admit(tree, node, 0, lo, hi, node.slot->cont + 2);
+	_fb_key_admit(tree, parent, 0, last_key, last_key, parent.slot->cont + 1);
+	--left.slot->cont;
+
+	if (_fb_val_type(node, 0) == CFB_VALUE_TYPE_NULL && _fb_is_child(last_val))
+	{
+		// the borrowed child fills the missing first one, the range
+		// of the next child starts where the node starts
+		_fb_key_put(node, 0, _fb_key_at(parent, i-1));
+		_fb_val_put(node, 0, last_val);
+		_fb_key_put(parent, i-1, last_key);
+		_fb_adopt(tree, block, last_val, node_pos);
+		return true;
+	}
+
+	for (size_t j = node.slot->cont; j > 0; --j)
+	{
+		_fb_key_put(node, j, _fb_key_at(node, j-1));
+		_fb_val_put(node, j+1, _fb_val_at(node, j));
+	}
+	if (_fb_val_type(node, 0) != CFB_VALUE_TYPE_NULL)
+	{
+		// rotate through the parent
+		_fb_key_put(node, 0, _fb_key_at(parent, i-1));
+		_fb_val_put(node, 1, _fb_val_at(node, 0));
+		_fb_val_put(node, 0, last_val);
+	}
+	else
+	{
+		_fb_key_put(node, 0, last_key);
+		_fb_val_put(node, 1, last_val);
+	}
+	++node.slot->cont;
+	_fb_key_put(parent, i-1, last_key);
+	if (i == 2 && _fb_val_type(parent, 0) == CFB_VALUE_TYPE_NULL && _fb_key_at(parent, 0) > last_key)
+	{
+		// the first key of a parent without first child bounds nothing,
+		// it only has to stay sorted for the search
+		_fb_key_put(parent, 0, last_key);
+	}
+	_fb_adopt(tree, block, last_val, node_pos);
+	return true;
+}
+
+/**
+ * Move the first entry of right to the back of node, i-th child of parent
+ * @return False if the keys moved do not fit the nodes, nothing is moved
+ */
+static bool _fb_borrow_right(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_node_data parent,
+		size_t i,
+		fb_node_data node,
+		fb_pos node_pos,
+		fb_node_data right)
+{
+	fb_val moved;
+	fb_key key;
+	fb_key sep;
+	bool rotate = _fb_val_type(right, 0) != CFB_VALUE_TYPE_NULL;
+	if (rotate)
+	{
+		// rotate through the parent
+		moved = _fb_val_at(right, 0);
+		key = _fb_key_at(parent, i);
+		sep = _fb_key_at(right, 0);
+	}
+	else
+	{
+		// without a first child, the second one covers the lower range
+		moved = _fb_val_at(right, 1);
+		key = _fb_is_child(moved) ? _fb_key_at(parent, i) : _fb_key_at(right, 0);
+		sep = _fb_key_at(right, 1);
+	}
+	if (!_fb_key_fits(tree, node, 0, key, key, node.slot->cont + 2)
+			|| !_fb_key_fits(tree, parent, 0, sep, sep, parent.slot->cont + 1))
+	{
+		return false;
+	}
+	_fb_key_admit(tree, node, 0, key, key, node.slot->cont + 2);
+	_fb_key_admit(tree, parent, 0, sep, sep, parent.slot->cont + 1);
+	_fb_key_put(node, node.slot->cont, key);
+	if (rotate)
+	{
+		_fb_val_put(right, 0, _fb_val_at(right, 1));
+	}
+	_fb_val_put(node, node.slot->cont + 1, moved);
+	++node.slot->cont;
+	_fb_adopt(tree, block, moved, node_pos);
+
+	for (size_t j = 1; j < right.slot->cont; ++j)
+	{
+		_fb_key_put(right, j-1, _fb_key_at(right, j));
+		_fb_val_put(right, j, _fb_val_at(right, j+1));
+	}
+	--right.slot->cont;
+	_fb_key_put(parent, i, sep);
+	return true;
+}
+
+/**
+ * Replace the root of a block by its only child, as long as it has one
+ */
+static void _fb_collapse_root(
+		fb_tree *tree,
+		fb_block_h *block)
+{
+	while (block->height > 0)
+	{
+		fb_node_data root = _fb_node_content(tree, block, block->root);
+		if (_fb_node_entries(root) != 1)
+		{
+			return;
+		}
+		fb_val child = _fb_val_type(root, 0) != CFB_VALUE_TYPE_NULL ? _fb_val_at(root, 0) : _fb_val_at(root, 1);
+		_fb_free_node(tree, block, block->root);
+		block->root = child.node_pos;
+		--block->height;
+	}
+}
+
+/**
+ * Restore the fill of a node after one of its entries was removed,
+ * borrowing from or merging with its siblings in the block
+ */
+static void _fb_rebalance_node(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_pos node_pos)
+{
+	size_t min = _fb_min_entries(tree);
+	while (node_pos != block->root)
+	{
+		fb_node_data node = _fb_node_content(tree, block, node_pos);
+		size_t entries = _fb_node_entries(node);
+		if (entries >= min)
+		{
+			break;
+		}
+
+		fb_pos parent_pos = node.slot->parent;
+		fb_node_data parent = _fb_node_content(tree, block, parent_pos);
+		int i = _fb_child_index(tree, parent, CFB_VALUE_TYPE_NODE, node_pos);
+		assert(i >= 0);
+
+		if (entries == 0)
+		{
+			// nothing to borrow into, an inner node split off with its
+			// only child by an append loses its last entry this way
+			_fb_remove_child(tree, parent, i);
+			_fb_free_node(tree, block, node_pos);
+			node_pos = parent_pos;
+			continue;
+		}
+
+		fb_pos left_pos = CFB_NULL_POS;
+		fb_pos right_pos = CFB_NULL_POS;
+		if (i > 0 && _fb_val_type(parent, i-1) == CFB_VALUE_TYPE_NODE)
+		{
+			left_pos = _fb_val_at(parent, i-1).node_pos;
+		}
+		if (i < parent.slot->cont)
+		{
+			right_pos = _fb_val_at(parent, i+1).node_pos;
+		}
+
+		if (left_pos != CFB_NULL_POS)
+		{
+			fb_node_data left = _fb_node_content(tree, block, left_pos);
+			if (_fb_node_entries(left) > min
+					&& _fb_borrow_left(tree, block, parent, i, left, node, node_pos))
+			{
+				break;
+			}
+		}
+		if (right_pos != CFB_NULL_POS)
+		{
+			fb_node_data right = _fb_node_content(tree, block, right_pos);
+			if (_fb_node_entries(right) > min
+					&& _fb_borrow_right(tree, block, parent, i, node, node_pos, right))
+			{
+				break;
+			}
+		}
+
+		if (left_pos != CFB_NULL_POS)
+		{
+			fb_node_data left = _fb_node_content(tree, block, left_pos);
+			if (left.slot->cont + entries < tree->kfactor
+					&& _fb_append_fits(tree, left, node, _fb_key_at(parent, i-1), false))
+			{
+				_fb_append_entries(tree, block, left_pos, left, node, _fb_key_at(parent, i-1));
+				_fb_remove_child(tree, parent, i);
+				_fb_free_node(tree, block, node_pos);
+				node_pos = parent_pos;
+				continue;
+			}
+		}
+		if (right_pos != CFB_NULL_POS)
+		{
+			fb_node_data right = _fb_node_content(tree, block, right_pos);
+			if (node.slot->cont + _fb_node_entries(right) < tree->kfactor
+					&& _fb_append_fits(tree, node, right, _fb_key_at(parent, i), false))
+			{
+				_fb_append_entries(tree, block, node_pos, node, right, _fb_key_at(parent, i));
+				_fb_remove_child(tree, parent, i+1);
+				_fb_free_node(tree, block, right_pos);
+				node_pos = parent_pos;
+				continue;
+			}
+		}
+
+		break;
+	}
+
+	_fb_collapse_root(tree, block);
+}
+
+/**
+ * Copy a subtree of a block into fresh nodes of another block
+ * @return The position of the copied node in block 'to'
+ */
+static fb_pos _fb_copy_subtree(
+		fb_tree *tree,
+		fb_block_h *from,
+		fb_pos from_pos,
+		fb_block_h *to,
+		fb_pos parent)
+{
+	fb_pos to_pos = _fb_get_fresh_node(tree, to);
+	fb_node_data src = _fb_node_content(tree, from, from_pos);
+	fb_node_data dst = _fb_node_content(tree, to, to_pos);
+	dst.slot->parent = parent;
+	_fb_keys_copy(tree, dst, src, 0, src.slot->cont);
+	dst.slot->cont = src.slot->cont;
+	for (size_t i = 0; i < src.slot->cont + 1u; ++i)
+	{
+		fb_val val = _fb_val_at(src, i);
+		if (val.type == CFB_VALUE_TYPE_NODE)
+		{
+			val.node_pos = _fb_copy_subtree(tree, from, val.node_pos, to, to_pos);
+		}
+		_fb_val_put(dst, i, val);
+	}
+	return to_pos;
+}
+
+/**
+ * Merge block right into block left, its sibling on the left,
+ * if their trees have the same height and fit in one block
+ * @return True if the blocks were merged
+ */
+static bool _fb_merge_blocks(
+		fb_tree *tree,
+		fb_block_h *left,
+		fb_block_h *right,
+		fb_key sep)
+{
+	if (left->cont == 0 || right->cont == 0 || left->height != right->height)
+	{
+		return false;
+	}
+	fb_node_data left_root = _fb_node_content(tree, left, left->root);
+	fb_node_data right_root = _fb_node_content(tree, right, right->root);
+	if (left_root.slot->cont + _fb_node_entries(right_root) >= tree->kfactor
+			|| tree->block_slots - left->cont < right->cont - 1u
+			|| !_fb_append_fits(tree, left_root, right_root, sep, false))
+	{
+		return false;
+	}
+
+	// move the subtrees below the root of right, then the root entries
+	for (size_t i = 0; i < right_root.slot->cont + 1u; ++i)
+	{
+		fb_val val = _fb_val_at(right_root, i);
+		if (val.type == CFB_VALUE_TYPE_NODE)
+		{
+			val.node_pos = _fb_copy_subtree(tree, right, val.node_pos, left, left->root);
+			_fb_val_put(right_root, i, val);
+		}
+	}
+	_fb_append_entries(tree, left, left->root, left_root, right_root, sep);
+	return true;
+}
+
+/**
+ * @return The node of block holding the entry for child, and its index
+ */
+static fb_pos _fb_find_child_block(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		fb_pos child,
+		int *index)
+{
+	bool exact;
+	fb_val result;
+	fb_pos node_pos;
+	_fb_search_block(tree, block, key, &exact, &result, &node_pos);
+	*index = _fb_child_index(tree, _fb_node_content(tree, block, node_pos),
+			CFB_VALUE_TYPE_BLOCK, child);
+	assert(*index >= 0);
+	return node_pos;
+}
+
+/**
+ * Restore the blocks on the path after an entry was removed
+ * from the last one, merging or freeing them bottom up,
+ * and release their latches
+ * @param[in] top The first block of the path still latched,
+ *            the blocks above it are not changed
+ */
+static void _fb_rebalance_path(
+		fb_tree *tree,
+		fb_key key,
+		fb_pos *path,
+		size_t top,
+		size_t depth)
+{
+	size_t min = _fb_min_entries(tree);
+	for (size_t d = depth - 1; d > top; --d)
+	{
+		fb_block_data block = _fb_load_block(tree, path[d], true);
+		fb_block_data parent = _fb_load_block(tree, path[d-1], true);
+		size_t entries = 0;
+		if (block.block->cont > 0)
+		{
+			entries = _fb_node_entries(_fb_node_content(tree, block.block, block.block->root));
+		}
+
+		int i;
+		fb_pos node_pos = _fb_find_child_block(tree, parent.block, key, path[d], &i);
+		fb_node_data node = _fb_node_content(tree, parent.block, node_pos);
+		bool changed = false;
+		if (entries == 0)
+		{
+			// nothing left in the block
+			_fb_remove_child(tree, node, i);
+			_fb_free_block(tree, block.block, path[d]);
+			changed = true;
+		}
+		else if (entries < min)
+		{
+			// merge with a sibling block, the left one absorbing the right;
+			// the parent is latched, no one else can reach the siblings
+			if (i > 0 && _fb_val_type(node, i-1) == CFB_VALUE_TYPE_BLOCK)
+			{
+				fb_pos left_pos = _fb_val_at(node, i-1).block_pos;
+				_fb_latch(tree, left_pos, true);
+				fb_block_data left = _fb_load_block(tree, left_pos, true);
+				if (_fb_merge_blocks(tree, left.block, block.block, _fb_key_at(node, i-1)))
+				{
+					_fb_remove_child(tree, node, i);
+					_fb_free_block(tree, block.block, path[d]);
+					changed = true;
+				}
+				_fb_unload_block(tree, left);
+				_fb_unlatch(tree, left_pos);
+			}
+			if (!changed && i < node.slot->cont)
+			{
+				fb_pos right_pos = _fb_val_at(node, i+1).block_pos;
+				_fb_latch(tree, right_pos, true);
+				fb_block_data right = _fb_load_block(tree, right_pos, true);
+				if (_fb_merge_blocks(tree, block.block, right.block, _fb_key_at(node, i)))
+				{
+					_fb_remove_child(tree, node, i+1);
+					_fb_free_block(tree, right.block, right_pos);
+					changed = true;
+				}
+				_fb_unload_block(tree, right);
+				_fb_unlatch(tree, right_pos);
+			}
+		}
+
+		if (changed)
+		{
+			_fb_rebalance_node(tree, parent.block, node_pos);
+		}
+		_fb_unload_block(tree, parent);
+		_fb_unload_block(tree, block);
+		_fb_unlatch(tree, path[d]);
+		if (!changed)
+		{
+			_fb_unlatch_path(tree, path, top, d);
+			return;
+		}
+	}
+	if (top > 0)
+	{
+		_fb_unlatch(tree, path[top]);
+		return;
+	}
+
+	// shrink the tree while the root block has a single child block
+	fb_pos root_pos = path[0];
+	fb_block_data root = _fb_load_block(tree, root_pos, true);
+	while (root.block->height == 0 && !(root.block->type & CFB_BLOCK_TYPE_LEAF))
+	{
+		fb_node_data node = _fb_node_content(tree, root.block, root.block->root);
+		if (_fb_node_entries(node) != 1)
+		{
+			break;
+		}
+		fb_pos child_pos = _fb_val_type(node, 0) != CFB_VALUE_TYPE_NULL
+				? _fb_val_at(node, 0).block_pos : _fb_val_at(node, 1).block_pos;
+		_fb_latch(tree, child_pos, true);
+		_fb_free_block(tree, root.block, root_pos);
+		_fb_unload_block(tree, root);
+		root = _fb_load_block(tree, child_pos, true);
+		root.block->type |= CFB_BLOCK_TYPE_ROOT;
+		__atomic_store_n(&tree->root, child_pos, __ATOMIC_RELEASE);
+		_fb_unlatch(tree, root_pos);
+		root_pos = child_pos;
+	}
+
+	if (root.block->cont > 0
+			&& _fb_node_entries(_fb_node_content(tree, root.block, root.block->root)) == 0)
+	{
+		// the last key is gone, start over from an empty root block
+		_fb_init_block(tree, root.block, CFB_BLOCK_TYPE_ROOT | CFB_BLOCK_TYPE_LEAF, 0);
+	}
+	_fb_unload_block(tree, root);
+	_fb_unlatch(tree, root_pos);
+}
+
+bool fb_delete(
+		fb_tree *tree,
+		fb_key key,
+		fb_val *value)
+{
+	// descend recording the blocks on the path
+	fb_pos path[CFB_MAX_DEPTH];
+	size_t top;
+	bool exact;
+	fb_val result;
+	fb_pos node_pos;
+	fb_block_data leaf;
+	size_t depth = _fb_descend(tree, key, true, true, path, &top, &exact, &result, &node_pos, &leaf);
+	if (depth == 0)
+	{
+		// the leaf block may merge into its siblings
+		depth = _fb_descend(tree, key, false, true, path, &top, &exact, &result, &node_pos, &leaf);
+	}
+	if (!exact)
+	{
+		_fb_unload_block(tree, leaf);
+		_fb_unlatch_path(tree, path, top, depth);
+		return false;
+	}
+	if (value != NULL)
+	{
+		*value = result;
+	}
+
+	_fb_log_change(tree, key, NULL);
+	_fb_write_block(tree, leaf);
+	fb_node_data node = _fb_node_content(tree, leaf.block, node_pos);
+	int i = _fb_key_search(node, key);
+	_fb_remove_child(tree, node, i);
+	_fb_cache_drop(tree, leaf.block, key);
+	__atomic_sub_fetch(&tree->content, 1, __ATOMIC_RELAXED);
+
+	_fb_rebalance_node(tree, leaf.block, node_pos);
+	_fb_unload_block(tree, leaf);
+	_fb_rebalance_path(tree, key, path, top, depth);
+	return true;
+}
+
+/**
+ * The shape of a tree built bottom-up: at each level,
+ * items are spread as evenly as possible over the nodes
+ */
+typedef struct _fb_bulk_shape fb_bulk_shape;
+struct _fb_bulk_shape
+{
+	// number of node levels, the root level is levels-1
+	size_t levels;
+
+	// number of entries (level 0) or child nodes below each level
+	size_t items[CFB_MAX_DEPTH];
+
+	// number of nodes at each level
+	size_t nodes[CFB_MAX_DEPTH];
+};
+
+/**
+ * @return The index of the first item below a node
+ */
+static inline size_t _fb_bulk_first(
+		const fb_bulk_shape *shape,
+		size_t level,
+		size_t node)
+{
+	return node * shape->items[level] / shape->nodes[level];
+}
+
+/**
+ * @return The index of the first entry below a node
+ */
+static inline size_t _fb_bulk_entry(
+		const fb_bulk_shape *shape,
+		size_t level,
+		size_t node)
+{
+	size_t item = _fb_bulk_first(shape, level, node);
+	while (level-- > 0)
+	{
+		item = _fb_bulk_first(shape, level, item);
+	}
+	return item;
+}
+
+/**
+ * Find the lowest and highest keys a node of the shape holds
+ */
+static inline void _fb_bulk_span(
+		const fb_bulk_shape *shape,
+		size_t level,
+		size_t index,
+		const fb_key *keys,
+		fb_key *lo,
+		fb_key *hi)
+{
+	size_t first = _fb_bulk_first(shape, level, index);
+	size_t last = _fb_bulk_first(shape, level, index + 1);
+	if (level == 0)
+	{
+		*lo = keys[first];
+		*hi = keys[last-1];
+		return;
+	}
+	// the first child has no key, unless it is alone
+	*lo = keys[_fb_bulk_entry(shape, level - 1, last - first == 1 ? first : first + 1)];
+	*hi = keys[_fb_bulk_entry(shape, level - 1, last - 1)];
+}
+
+/**
+ * Fill a node and, down to level bottom, the nodes below it
+ * @param[in] child_base The position of the first block of the tier below
+ * @return The slot of the node in the block
+ */
+static fb_pos _fb_bulk_node(
+		fb_tree *tree,
+		const fb_bulk_shape *shape,
+		fb_block_h *block,
+		fb_pos *slots,
+		size_t level,
+		size_t bottom,
+		size_t index,
+		fb_pos parent,
+		const fb_key *keys,
+		const fb_value *values,
+		fb_pos child_base)
+{
+	fb_pos node_pos = (*slots)++;
+	_fb_init_node(tree, block, node_pos);
+	fb_node_data node = _fb_node_content(tree, block, node_pos);
+	node.slot->parent = parent;
+
+	fb_key lo;
+	fb_key hi;
+	_fb_bulk_span(shape, level, index, keys, &lo, &hi);
+	_fb_key_admit(tree, node, 0, lo, hi, tree->kfactor);
+
+	size_t first = _fb_bulk_first(shape, level, index);
+	size_t last = _fb_bulk_first(shape, level, index + 1);
+	size_t n = last - first;
+	for (size_t c = first; c < last; ++c)
+	{
+		size_t i = c - first;
+		fb_val val;
+		if (level == 0)
+		{
+			_fb_key_put(node, i, keys[c]);
+			val.type = CFB_VALUE_TYPE_CNTNT;
+			val.value = values[c];
+			_fb_val_put(node, i+1, val);
+			continue;
+		}
+		if (level == bottom)
+		{
+			val.type = CFB_VALUE_TYPE_BLOCK;
+			val.block_pos = child_base + c;
+		}
+		else
+		{
+			val.type = CFB_VALUE_TYPE_NODE;
+			val.node_pos = _fb_bulk_node(tree, shape, block, slots,
+					level - 1, bottom, c, node_pos, keys, values, child_base);
+		}
+
+		// a lone child goes after its key, with no first child
+		size_t k = n == 1 ? 1 : i;
+		if (k == 0)
+		{
+			_fb_val_put(node, 0, val);
+		}
+		else
+		{
+			_fb_key_put(node, k-1, keys[_fb_bulk_entry(shape, level - 1, c)]);
+			_fb_val_put(node, k, val);
+		}
+	}
+	node.slot->cont = (level == 0 || n == 1) ? n : n - 1;
+	return node_pos;
+}
+
+void fb_bulk_load(
+		fb_tree *tree,
+		const fb_key *keys,
+		const fb_value *values,
+		size_t count,
+		float fill)
+{
+	if (tree->content != 0 || tree->blocks_alloc != CFB_SUPER_POS + 2)
+	{
+		fprintf(stderr, "ERROR: bulk loading needs a freshly initialized tree\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!(fill > 0 && fill <= 1))
+	{
+		fprintf(stderr, "ERROR: fill factor must be in (0, 1]\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 1; i < count; ++i)
+	{
+		if (keys[i-1] >= keys[i])
+		{
+			fprintf(stderr, "ERROR: bulk loaded keys must be sorted and unique\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (count == 0)
+	{
+		return;
+	}
+
+	// nodes never rest full, they split as soon as they are
+	size_t leaf_fill = fill * (tree->kfactor - 1);
+	size_t inner_fill = fill * tree->kfactor;
+	leaf_fill = leaf_fill < 1 ? 1 : leaf_fill;
+	inner_fill = inner_fill < 2 ? 2 : inner_fill;
+
+	fb_bulk_shape shape;
+	shape.levels = 0;
+	size_t items = count;
+	do
+	{
+		size_t capacity = shape.levels == 0 ? leaf_fill : inner_fill;
+		shape.items[shape.levels] = items;
+		shape.nodes[shape.levels] = (items + capacity - 1) / capacity;
+		items = shape.nodes[shape.levels++];
+	}
+	while (items > 1);
+
+#if CFB_KEY_DELTA_BITS
+	// keys too far apart for the deltas of a node go in one by one,
+	// splitting the nodes they do not fit in
+	for (size_t level = 0; level < shape.levels; ++level)
+	{
+		for (size_t n = 0; n < shape.nodes[level]; ++n)
+		{
+			fb_key lo;
+			fb_key hi;
+			_fb_bulk_span(&shape, level, n, keys, &lo, &hi);
+			if (hi - lo > CFB_KEY_DELTA_MAX)
+			{
+				for (size_t i = 0; i < count; ++i)
+				{
+					fb_val value;
+					value.type = CFB_VALUE_TYPE_CNTNT;
+					value.value = values[i];
+					fb_insert(tree, keys[i], value);
+				}
+				return;
+			}
+		}
+	}
+#endif
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		fb_val value;
+		value.type = CFB_VALUE_TYPE_CNTNT;
+		value.value = values[i];
+		_fb_log_change(tree, keys[i], &value);
+	}
+
+	// group the levels in tiers of blocks, each block
+	// holds a subtree of at most block_height+1 levels
+	size_t tier_levels = tree->block_height + 1;
+	size_t tiers = (shape.levels + tier_levels - 1) / tier_levels;
+	if (tiers > CFB_MAX_DEPTH)
+	{
+		fprintf(stderr, "ERROR: bulk loaded tree too deep\n");
+		exit(EXIT_FAILURE);
+	}
+	fb_pos base[CFB_MAX_DEPTH + 1];
+	base[0] = CFB_SUPER_POS + 1;
+	for (size_t t = 0; t < tiers; ++t)
+	{
+		size_t top = t * tier_levels + tree->block_height;
+		top = top < shape.levels - 1 ? top : shape.levels - 1;
+		base[t+1] = base[t] + shape.nodes[top];
+	}
+
+	// blocks are laid out tier by tier, the root block last
+	tree->blocks_alloc = base[tiers];
+	_fb_extend_index(tree, tree->blocks_alloc);
+
+	for (size_t t = 0; t < tiers; ++t)
+	{
+		size_t bottom = t * tier_levels;
+		size_t top = bottom + tree->block_height;
+		top = top < shape.levels - 1 ? top : shape.levels - 1;
+
+		for (size_t b = 0; b < shape.nodes[top]; ++b)
+		{
+			uint8_t type = t == 0 ? CFB_BLOCK_TYPE_LEAF : CFB_BLOCK_TYPE_INNER;
+			if (t + 1 == tiers)
+			{
+				type |= CFB_BLOCK_TYPE_ROOT;
+			}
+
+			fb_block_data data = _fb_load_block(tree, base[t] + b, true);
+			_fb_init_block(tree, data.block, type, CFB_NULL_POS);
+			fb_pos slots = 0;
+			data.block->root = _fb_bulk_node(tree, &shape, data.block, &slots,
+					top, bottom, b, 0, keys, values, t > 0 ? base[t-1] : 0);
+			data.block->height = top - bottom;
+			_fb_unload_block(tree, data);
+		}
+	}
+
+	tree->root = base[tiers] - 1;
+	tree->content = count;
+	tree->key_high = keys[count-1];
+}
+
+/**
+ * Descend from a node of the leaf block to the leftmost leaf below it,
+ * pushing the visited nodes
+ */
+static void _fb_cursor_enter(
+		fb_cursor *cursor,
+		fb_pos node_pos)
+{
+	fb_tree *tree = cursor->tree;
+	while (true)
+	{
+		fb_node_data node = _fb_node_content(tree, cursor->block.block, node_pos);
+		fb_cursor_level *level = cursor->levels + cursor->depth++;
+		level->node_pos = node_pos;
+		level->index = 0;
+		if (_fb_val_type(node, 1) == CFB_VALUE_TYPE_CNTNT)
+		{
+			return;
+		}
+
+		if (_fb_val_type(node, 0) == CFB_VALUE_TYPE_NULL)
+		{
+			level->index = 1;
+		}
+		node_pos = _fb_val_at(node, level->index).node_pos;
+	}
+}
+
+/**
+ * Walk down to the leaf that would contain lo with coupled shared
+ * latches, keeping its block latched, and record the first key
+ * past the block, from the separators above it
+ * @return False if the tree is empty
+ */
+static bool _fb_cursor_seek(
+		fb_cursor *cursor,
+		fb_key lo)
+{
+	fb_tree *tree = cursor->tree;
+	fb_pos block_pos = _fb_latch_root(tree, false);
+	fb_block_data data = _fb_load_block(tree, block_pos, false);
+	if (data.block->cont == 0) // empty tree
+	{
+		_fb_unload_block(tree, data);
+		_fb_unlatch(tree, block_pos);
+		return false;
+	}
+
+	cursor->bounded = false;
+	cursor->depth = 0;
+	fb_pos node_pos = data.block->root;
+	while (true)
+	{
+		fb_node_data node = _fb_node_content(tree, data.block, node_pos);
+		fb_cursor_level *level = cursor->levels + cursor->depth++;
+		level->node_pos = node_pos;
+
+		size_t i = _fb_key_search(node, lo);
+		if (_fb_val_type(node, 1) == CFB_VALUE_TYPE_CNTNT)
+		{
+			// first key not below lo
+			if (i > 0 && _fb_key_at(node, i-1) == lo)
+			{
+				--i;
+			}
+			level->index = i;
+			break;
+		}
+
+		if (_fb_val_type(node, i) == CFB_VALUE_TYPE_NULL)
+		{
+			i = 1;
+		}
+		if (i < node.slot->cont && !(data.block->type & CFB_BLOCK_TYPE_LEAF))
+		{
+			// the keys from the separator on lie past the child
+			cursor->bound = _fb_key_at(node, i);
+			cursor->bounded = true;
+		}
+		level->index = i;
+
+		fb_val child = _fb_val_at(node, i);
+		if (child.type == CFB_VALUE_TYPE_BLOCK)
+		{
+			// latch coupling, the child cannot change before it is latched
+			_fb_latch(tree, child.block_pos, false);
+			_fb_unload_block(tree, data);
+			_fb_unlatch(tree, block_pos);
+			block_pos = child.block_pos;
+			data = _fb_load_block(tree, block_pos, false);
+			cursor->depth = 0;
+			node_pos = data.block->root;
+		}
+		else
+		{
+			node_pos = child.node_pos;
+		}
+	}
+	cursor->block = data;
+	cursor->held = true;
+	return true;
+}
+
+/**
+ * Release the leaf block of the cursor, if it holds one
+ */
+static void _fb_cursor_leave(fb_cursor *cursor)
+{
+	if (cursor->held)
+	{
+		_fb_unload_block(cursor->tree, cursor->block);
+		_fb_unlatch(cursor->tree, cursor->block.pos);
+		cursor->held = false;
+	}
+}
+
+/**
+ * Move the cursor to the first key of the next leaf, descending
+ * again from the root once its leaf block is read
+ * @return False if the cursor was on the last leaf
+ */
+static bool _fb_cursor_advance(fb_cursor *cursor)
+{
+	fb_tree *tree = cursor->tree;
+	while (cursor->depth > 1)
+	{
+		--cursor->depth;
+		fb_cursor_level *level = cursor->levels + cursor->depth - 1;
+		fb_node_data node = _fb_node_content(tree, cursor->block.block, level->node_pos);
+		if (level->index < node.slot->cont)
+		{
+			++level->index;
+			_fb_cursor_enter(cursor, _fb_val_at(node, level->index).node_pos);
+			return true;
+		}
+	}
+
+	// the keys of the block were all returned, the next ones
+	// are wherever the bound of the block lies now
+	_fb_cursor_leave(cursor);
+	return cursor->bounded && cursor->bound <= cursor->hi
+			&& _fb_cursor_seek(cursor, cursor->bound);
+}
+
+void fb_cursor_open(
+		fb_tree *tree,
+		fb_cursor *cursor,
+		fb_key lo,
+		fb_key hi)
+{
+	cursor->tree = tree;
+	cursor->hi = hi;
+	cursor->depth = 0;
+	cursor->held = false;
+	cursor->bounded = false;
+	cursor->done = lo > hi;
+	cursor->levels = malloc((tree->block_height + 1) * sizeof(fb_cursor_level));
+	if (cursor->levels == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate cursor\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cursor->done)
+	{
+		return;
+	}
+	cursor->done = !_fb_cursor_seek(cursor, lo);
+}
+
+size_t fb_cursor_next(
+		fb_cursor *cursor,
+		fb_key *keys,
+		fb_value *values,
+		size_t batch)
+{
+	size_t count = 0;
+	while (count < batch && !cursor->done)
+	{
+		fb_cursor_level *level = cursor->levels + cursor->depth - 1;
+		fb_node_data node = _fb_node_content(cursor->tree, cursor->block.block, level->node_pos);
+
+		if (level->index == node.slot->cont)
+		{
+			cursor->done = !_fb_cursor_advance(cursor);
+			continue;
+		}
+
+		// copy the leaf until the batch is full
+		while (level->index < node.slot->cont && count < batch)
+		{
+			if (_fb_key_at(node, level->index) > cursor->hi)
+			{
+				cursor->done = true;
+				break;
+			}
+			keys[count] = _fb_key_at(node, level->index);
+			values[count] = _fb_val_at(node, level->index + 1).value;
+			++count;
+			++level->index;
+		}
+	}
+	return count;
+}
+
+void fb_cursor_close(
+		fb_cursor *cursor)
+{
+	_fb_cursor_leave(cursor);
+	free(cursor->levels);
+	cursor->levels = NULL;
+	cursor->done = true;
+}
+
+size_t fb_scan(
+		fb_tree *tree,
+		fb_key lo,
+		fb_key hi,
+		fb_scan_fn callback,
+		void *arg)
+{
+	fb_key keys[CFB_SCAN_BATCH];
+	fb_value values[CFB_SCAN_BATCH];
+	size_t total = 0;
+
+	fb_cursor cursor;
+	fb_cursor_open(tree, &cursor, lo, hi);
+	size_t count;
+	while ((count = fb_cursor_next(&cursor, keys, values, CFB_SCAN_BATCH)) > 0)
+	{
+		total += count;
+		if (!callback(keys, values, count, arg))
+		{
+			break;
+		}
+	}
+	fb_cursor_close(&cursor);
+	return total;
+}
+
+/**
+ * @return The bits of a key mixed, so that close keys end up apart
+ */
+static inline uint64_t _fb_key_hash(fb_key key)
+{
+	uint64_t hash = key;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/**
+ * The slots of a block a key may be cached in, spread by a mixed
+ * hash of the key and mapped to the slots without a division
+ * @param[out] ways The slots, each once
+ * @return The number of slots
+ */
+static inline size_t _fb_cache_ways(fb_tree *tree, fb_key key, fb_pos *ways)
+{
+	uint64_t hash = _fb_key_hash(key);
+
+	// nodes take the first free slots and a block holds block_nodes
+	// of them at most, half of the ways go to the slots past those
+	size_t spare = tree->block_slots - tree->block_nodes;
+	size_t count = 0;
+	uint32_t base = hash >> 32;
+	uint32_t step = (uint32_t)hash | 1;
+	for (size_t i = 0; i < CFB_CACHE_WAYS; ++i)
+	{
+		// double hashing, each way from the high half moved by the low one
+		uint64_t spread = (uint32_t)(base + i * step);
+		fb_pos way = i % 2 && spare > 0
+				? tree->block_nodes + ((spread * spare) >> 32)
+				: (spread * tree->block_slots) >> 32;
+		size_t j = 0;
+		while (j < count && ways[j] != way)
+		{
+			++j;
+		}
+		if (j == count)
+		{
+			ways[count++] = way;
+		}
+	}
+	return count;
+}
+
+/**
+ * The directory of a cache slot, its tuples are packed at the end of the slot
+ */
+static inline fb_cache_h *_fb_cache_dir(fb_slot_h *slot)
+{
+	return (fb_cache_h *)slot->body;
+}
+
+/**
+ * @return The first byte of the tuples of a cache slot
+ */
+static size_t _fb_cache_low(fb_tree *tree, fb_slot_h *slot)
+{
+	fb_cache_h *dir = _fb_cache_dir(slot);
+	size_t low = tree->cache_size;
+	for (size_t j = 0; j < slot->cont; ++j)
+	{
+		low -= dir[j].size;
+	}
+	return low;
+}
+
+/**
+ * @return Whether an entry with a tuple of size fits in a cache slot
+ */
+static inline bool _fb_cache_fits(fb_tree *tree, fb_slot_h *slot, size_t size)
+{
+	return slot->cont < UINT8_MAX
+			&& (slot->cont + 1) * sizeof(fb_cache_h) + size <= _fb_cache_low(tree, slot);
+}
+
+/**
+ * Remove an entry from a cache slot, keeping its tuples packed
+ */
+static void _fb_cache_remove(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_slot_h *slot,
+		size_t entry)
+{
+	fb_cache_h *dir = _fb_cache_dir(slot);
+	size_t low = _fb_cache_low(tree, slot);
+	uint16_t off = dir[entry].off;
+	uint16_t size = dir[entry].size;
+
+	// the tuples below the removed one move up by its size
+	memmove(slot->body + low + size, slot->body + low, off - low);
+	for (size_t j = 0; j < slot->cont; ++j)
+	{
+		if (dir[j].off < off)
+		{
+			dir[j].off += size;
+		}
+	}
+	dir[entry] = dir[slot->cont - 1];
+	if (--slot->cont == 0)
+	{
+		_fb_slot_mark(_fb_block_cached(tree, block), _fb_slot_pos(tree, block, slot), false);
+	}
+}
+
+/**
+ * Find the cache entry of a key in a loaded block
+ * @param[out] entry The index of the entry in the directory of its slot
+ * @param[out] probes The number of cache slots looked into
+ * @return The slot holding the entry, NULL if the key is not cached
+ */
+static fb_slot_h *_fb_cache_locate(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		size_t *entry,
+		size_t *probes)
+{
+	fb_pos ways[CFB_CACHE_WAYS];
+	size_t count = _fb_cache_ways(tree, key, ways);
+	*probes = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		// only the cache slots holding entries are looked into
+		if (_fb_slot_marked(_fb_block_cached(tree, block), ways[i]))
+		{
+			fb_node_data node = _fb_node_content(tree, block, ways[i]);
+			++*probes;
+			fb_cache_h *dir = _fb_cache_dir(node.slot);
+			for (size_t j = 0; j < node.slot->cont; ++j)
+			{
+				if (dir[j].key == key)
+				{
+					*entry = j;
+					return node.slot;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Force an entry out of a full cache slot, as the policy of the tree says
+ */
+static void _fb_cache_evict(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_slot_h *slot,
+		fb_key key)
+{
+	fb_cache_h *dir = _fb_cache_dir(slot);
+	size_t victim = key % slot->cont;
+	if (tree->cache_policy == CFB_CACHE_CLOCK)
+	{
+		// the hand takes the reference of the entries it passes
+		for (victim = slot->hand % slot->cont; dir[victim].ref; victim = (victim + 1) % slot->cont)
+		{
+			dir[victim].ref = 0;
+		}
+		slot->hand = victim;
+	}
+	else if (tree->cache_policy == CFB_CACHE_LFU)
+	{
+		for (size_t j = 0; j < slot->cont; ++j)
+		{
+			victim = dir[j].ref < dir[victim].ref ? j : victim;
+		}
+		// every entry ages by the count of the victim, its own included
+		uint8_t age = dir[victim].ref;
+		for (size_t j = 0; j < slot->cont; ++j)
+		{
+			dir[j].ref -= age;
+		}
+	}
+	_fb_cache_remove(tree, block, slot, victim);
+	_fb_count(&_fb_stats(tree)->evictions, 1);
+}
+
+/**
+ * Note a read of a cache entry, readers may share the block
+ */
+static inline void _fb_cache_touch(
+		fb_tree *tree,
+		fb_cache_h *entry)
+{
+	uint8_t ref = __atomic_load_n(&entry->ref, __ATOMIC_RELAXED);
+	if (tree->cache_policy == CFB_CACHE_CLOCK && ref == 0)
+	{
+		__atomic_store_n(&entry->ref, 1, __ATOMIC_RELAXED);
 	}
-	
-	if (bfactor < 3)
+	else if (tree->cache_policy == CFB_CACHE_LFU && ref < UINT8_MAX)
 	{
-		fprintf(stderr, "ERROR: a B+tree must have a bfactor > 2\n");
-		exit(EXIT_FAILURE);
+		// a count lost to a concurrent read does no harm
+		__atomic_store_n(&entry->ref, ref + 1, __ATOMIC_RELAXED);
 	}
+}
 
-	tree->bfactor = bfactor;
-	tree->kfactor = bfactor - 1;
-	tree->content = 0;
+/**
+ * Add an entry to the cache of a loaded block
+ * @param[in] force Whether to force entries out to make room,
+ *            else the tuple goes only where there is room left
+ * @return The entry added, NULL if the tuple was not cached
+ */
+static fb_cache_h *_fb_cache_insert(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key,
+		const void *tuple,
+		size_t size,
+		bool force)
+{
+	if (sizeof(fb_cache_h) + size > tree->cache_size)
+	{
+		// larger than a whole cache slot
+		return NULL;
+	}
 
-	tree->block_nodes = 0;
-	for (size_t h = 0; h < tree->block_slots; ++h)
+	// the least loaded of the ways that are cache slots,
+	// forcing items out of it when the tuple does not fit
+	fb_pos ways[CFB_CACHE_WAYS];
+	size_t count = _fb_cache_ways(tree, key, ways);
+	fb_slot_h *insert_slot = NULL;
+	fb_pos insert_pos = 0;
+	size_t insert_room = 0;
+	for (size_t i = 0; i < count; ++i)
 	{
-		tree->block_nodes += pow(bfactor, h);
-		if (tree->block_nodes <= tree->block_slots)
+		if (_fb_slot_marked(_fb_block_nodes(tree, block), ways[i]))
 		{
-			tree->block_height = h;
+			continue;
 		}
-		else
+		fb_node_data node = _fb_node_content(tree, block, ways[i]);
+		if (!_fb_slot_marked(_fb_block_cached(tree, block), ways[i]))
 		{
-			tree->block_nodes -= pow(bfactor, h);
+			// an empty slot has the most room there is
+			insert_slot = node.slot;
+			insert_pos = ways[i];
 			break;
 		}
+		size_t room = _fb_cache_low(tree, node.slot) - node.slot->cont * sizeof(fb_cache_h);
+		if (insert_slot == NULL || room > insert_room)
+		{
+			insert_slot = node.slot;
+			insert_pos = ways[i];
+			insert_room = room;
+		}
 	}
-
-	tree->index_fd = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	assert(tree->index_fd != -1);
-
-	tree->root = 0;
-	tree->blocks_alloc = 1;
-	if (ftruncate(tree->index_fd, block_size))
+	if (insert_slot == NULL) // no cache slot available
 	{
-		fprintf(stderr, "ERROR: cannot increase file size\n");
-		exit(EXIT_FAILURE);
+		return NULL;
+	}
+	if (!force && !_fb_cache_fits(tree, insert_slot, size))
+	{
+		return NULL;
+	}
+	while (!_fb_cache_fits(tree, insert_slot, size))
+	{
+		_fb_cache_evict(tree, block, insert_slot, key);
 	}
-	fb_block_data block = _fb_load_block(tree, 0, true);
-	_fb_init_block(tree, block.block, CFB_BLOCK_TYPE_ROOT | CFB_BLOCK_TYPE_LEAF, 0);
-	_fb_unload_block(tree, block);
 
-	fb_print_tree(tree);
+	fb_cache_h *entry = _fb_cache_dir(insert_slot) + insert_slot->cont;
+	entry->key = key;
+	entry->size = size;
+	entry->off = _fb_cache_low(tree, insert_slot) - size;
+	entry->ref = 0;
+	memcpy(insert_slot->body + entry->off, tuple, size);
+	++insert_slot->cont;
+	_fb_slot_mark(_fb_block_cached(tree, block), insert_pos, true);
+	_fb_count(&_fb_stats(tree)->inserts, 1);
+	return entry;
 }
 
-void fb_destr_tree(fb_tree *tree)
+/**
+ * @return How much the entries of a cache slot are worth keeping,
+ *         each counting once and once more for each of its reads
+ *         the replacement policy remembers
+ */
+static size_t _fb_cache_worth(
+		fb_slot_h *slot)
 {
-	close(tree->index_fd);
+	fb_cache_h *dir = _fb_cache_dir(slot);
+	size_t worth = 0;
+	for (size_t j = 0; j < slot->cont; ++j)
+	{
+		worth += 1 + dir[j].ref;
+	}
+	return worth;
 }
 
-static inline fb_pos _fb_get_fresh_node(
+/**
+ * Move the entries of a cache slot about to hold a node to the other
+ * cache slots of their ways: the entries read since they were cached
+ * force others out as a new entry would, the rest only take the room
+ * left and are lost without it; lookups probe every way, so no entry
+ * goes astray
+ */
+static void _fb_cache_migrate(
 		fb_tree *tree,
-		fb_block_h *block)
+		fb_block_h *block,
+		fb_pos slot_pos)
 {
-	fb_pos node_pos;
-	for (node_pos = 0; node_pos < tree->block_slots; ++node_pos)
+	// out of the ways of its keys first, the entries still in place
+	_fb_slot_mark(_fb_block_nodes(tree, block), slot_pos, true);
+	fb_slot_h *slot = _fb_node_content(tree, block, slot_pos).slot;
+	fb_cache_h *dir = _fb_cache_dir(slot);
+	size_t left = 0;
+	for (size_t j = 0; j < slot->cont; ++j)
 	{
-		fb_node_data node = _fb_node_content(tree, block, node_pos);
-		if (node.slot->type == CFB_SLOT_TYPE_CACHE)
+		fb_cache_h *moved = _fb_cache_insert(tree, block, dir[j].key,
+				slot->body + dir[j].off, dir[j].size, dir[j].ref > 0);
+		if (moved != NULL)
 		{
-			_fb_init_node(tree, block, node_pos);
-			return node_pos;
+			moved->ref = dir[j].ref;
+			_fb_count(&_fb_stats(tree)->migrations, 1);
+		}
+		else
+		{
+			++left;
 		}
 	}
-	fprintf(stderr, "ERROR: could not find room for a node\n");
-	exit(EXIT_FAILURE);
+	slot->cont = left;
 }
 
 /**
- * @param[in] tree The tree to query
- * @param[in] block The block in the tree to query
- * @param[in] node_pos The node to be scanned, must be an inner node
- * @param[in] key The key being searched
- * @param[out] result Child position in block
+ * Look an entry up in the cache of a loaded block
+ * @param[in,out] size The room in tuple, then the size of the tuple found
  */
-static inline void _fb_search_node(
+static bool _fb_cache_lookup(
 		fb_tree *tree,
 		fb_block_h *block,
-		fb_pos node_pos,
 		fb_key key,
-		bool *exact,
-		fb_val *result)
+		void *tuple,
+		size_t *size)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	assert (node.slot->cont > 0);
-
-	// bounds of range being considered
-	for (uint8_t i = 0; i < node.slot->cont; ++i)
+	size_t entry, probes;
+	fb_slot_h *slot = _fb_cache_locate(tree, block, key, &entry, &probes);
+	fb_stats *stats = _fb_stats(tree);
+	_fb_count(&stats->probes, 1);
+	_fb_count(stats->probe_slots + probes, 1);
+	if (slot == NULL)
 	{
-		if (key < node.keys[i])
-		{
-			*exact = ((i > 0) && (node.keys[i-1] == key)) ? true : false;
-			*result = node.vals[i];
-			return;
-		}
+		_fb_count(&stats->misses, 1);
+		return false;
 	}
-	
-	// larger or eq than last key
-	*exact = node.keys[node.slot->cont - 1] == key ? true : false;
-	*result = node.vals[node.slot->cont];
-	//printf("### search_node result type %i value %i\n", result->type, result->value);
+	fb_cache_h *found = _fb_cache_dir(slot) + entry;
+	if (found->size > *size)
+	{
+		_fb_count(&stats->misses, 1);
+		return false;
+	}
+	_fb_count(&stats->hits, 1);
+	memcpy(tuple, slot->body + found->off, found->size);
+	*size = found->size;
+	_fb_cache_touch(tree, found);
+	return true;
 }
 
-
 /**
- * @param[in] tree The tree to search in
- * @param[in] block The block in the tree to search in
- * @param[in] key The key being searched
- * @param[out] node_pos The node that owns the leaf
- * @param[out] leaf The leaf found by the search
- * @param[out] leaf_pos The absolute position of the leaf in the block
- * @param[out] child The child of the lowest existing node to which the leaf corresponds
- * @param[out] status Whether we found the exact item or the range that should contain it
+ * @return Whether a tuple read on a miss may be cached in block; with
+ *         CFB_ADMIT_SECOND, the block remembers the key and lets it
+ *         in only if it was missed before, since its bits last aged
  */
-static inline void _fb_search_block(
+static bool _fb_cache_admits(
 		fb_tree *tree,
 		fb_block_h *block,
-		fb_key key,
-		bool *exact,
-		fb_val *result,
-		fb_pos *node_pos)
+		fb_key key)
 {
-	*node_pos = block->root;
-	while (true)
+	if (tree->admit_policy == CFB_ADMIT_ALL)
 	{
-		fb_slot_h *slot = (fb_slot_h *)(block->body + *node_pos * tree->slot_size);
-		//printf("~ search_block node-type %i\n", slot->type);
-		if (slot->type == CFB_SLOT_TYPE_NODE)
-		{
-			_fb_search_node(tree, block, *node_pos, key, exact, result);
+		return true;
+	}
+	uint64_t *seen = _fb_block_seen(tree, block);
+	uint64_t hash = _fb_key_hash(key);
+	size_t bits = tree->seen_words * 64;
+	size_t a = (hash & 0xffffffff) % bits;
+	size_t b = (hash >> 32) % bits;
+	if ((seen[a / 64] >> (a % 64) & 1) && (seen[b / 64] >> (b % 64) & 1))
+	{
+		return true;
+	}
 
-			//printf("~ search_block leaf-type %i\n", result->type);
-			switch (result->type)
-			{
-				case CFB_VALUE_TYPE_NODE: *node_pos = result->node_pos; break;
-				case CFB_VALUE_TYPE_NULL: return;
-				case CFB_VALUE_TYPE_BLOCK: return;
-				case CFB_VALUE_TYPE_CNTNT: return;
-				default:
-					fprintf(stderr, "ERROR: found leaf with unknown value\n");
-					assert(false);
-			}
-		}
-		else
-		{
-			assert(false);
-		}
+	size_t set = 0;
+	for (size_t w = 0; w < tree->seen_words; ++w)
+	{
+		set += __builtin_popcountll(seen[w]);
+	}
+	if (set >= bits / 2)
+	{
+		// forget the keys missed so far, else every key gets in at last
+		memset(seen, 0, tree->seen_words * sizeof(uint64_t));
 	}
+	seen[a / 64] |= 1ull << (a % 64);
+	seen[b / 64] |= 1ull << (b % 64);
+	_fb_count(&_fb_stats(tree)->rejections, 1);
+	return false;
 }
 
-void _fb_retrieve(
+/**
+ * @return Whether the entry of key is in a leaf of block, so that its
+ *         tuple may be cached there; with other threads around, the
+ *         block may have been split or merged since it was looked up
+ * @param[in] value The value the tuple was read from, the entry must
+ *            still hold it; NULL for any value
+ */
+static bool _fb_cache_owns(
 		fb_tree *tree,
+		fb_block_h *block,
 		fb_key key,
-		bool *exact,
-		fb_val *result,
-		fb_pos *block_pos,
-		fb_pos *node_pos)
+		const fb_value *value)
 {
-	*block_pos = tree->root;
-
-	if (tree->content == 0)
+	if (tree->latches == NULL)
 	{
-		result->type = CFB_VALUE_TYPE_NULL;
-		*exact = false;
-		*node_pos = 0;
-		return;
+		return true;
 	}
-
-	fb_block_data block = _fb_load_block(tree, *block_pos, false);
-	_fb_search_block(tree, block.block, key, exact, result, node_pos);
-	
-	while (result->type == CFB_VALUE_TYPE_BLOCK)
+	if (!(block->type & CFB_BLOCK_TYPE_LEAF) || block->cont == 0)
 	{
-		_fb_unload_block(tree, block);
-		*block_pos = result->block_pos;
-		block = _fb_load_block(tree, *block_pos, false);
-		_fb_search_block(tree, block.block, key, exact, result, node_pos);
+		return false;
 	}
+	bool exact;
+	fb_val result;
+	fb_pos node_pos;
+	_fb_search_block(tree, block, key, &exact, &result, &node_pos);
+	return exact && result.type == CFB_VALUE_TYPE_CNTNT
+			&& (value == NULL || result.value == *value);
+}
 
-	if (result->type != CFB_VALUE_TYPE_CNTNT)
+void fb_get_stats(fb_tree *tree, fb_stats *stats)
+{
+	memset(stats, 0, sizeof(fb_stats));
+	uint64_t *sum = (uint64_t *)stats;
+	for (size_t s = 0; s < CFB_STATS_SHARDS; ++s)
 	{
-		*exact = false;
+		uint64_t *shard = (uint64_t *)(tree->stats + s);
+		for (size_t c = 0; c < CFB_STATS_COUNTERS; ++c)
+		{
+			sum[c] += __atomic_load_n(shard + c, __ATOMIC_RELAXED);
+		}
 	}
-	_fb_unload_block(tree, block);
 }
 
-void fb_retrieve(
-		fb_tree *tree,
-		fb_key key,
-		bool *exact,
-		fb_val *result)
+void fb_reset_stats(fb_tree *tree)
 {
-	fb_pos block_pos;
-	fb_pos node_pos;
-	_fb_retrieve(tree, key, exact, result, &block_pos, &node_pos);
+	for (size_t s = 0; s < CFB_STATS_SHARDS; ++s)
+	{
+		uint64_t *shard = (uint64_t *)(tree->stats + s);
+		for (size_t c = 0; c < CFB_STATS_COUNTERS; ++c)
+		{
+			__atomic_store_n(shard + c, 0, __ATOMIC_RELAXED);
+		}
+	}
 }
 
-
-void _fb_insert_node(
-		fb_tree *tree,
-		fb_block_h *block,
-		fb_pos block_pos,
-		fb_pos node_pos,
-		fb_key key,
-		fb_val val);
+void fb_print_probes(fb_tree *tree)
+{
+	fb_stats stats;
+	fb_get_stats(tree, &stats);
+	printf("cache lookups %" PRIu64 "\n", stats.probes);
+	for (size_t p = 0; p <= CFB_CACHE_WAYS; ++p)
+	{
+		printf("> %zu slots probed: %" PRIu64 " (%.1f%%)\n", p, stats.probe_slots[p],
+				stats.probes ? 100.0 * stats.probe_slots[p] / stats.probes : 0.0);
+	}
+}
 
 /**
- * Take a node from new and recursively move all its children from old to new
+ * Measure a latched block and the blocks below it, releasing the latch
+ * @param[in] depth The level of the block, the root at 0
+ * @param[in,out] leaf_sq The sum of the squares of the keys per leaf block
  */
-void _fb_move_subtree(
+static void _fb_stats_block(
 		fb_tree *tree,
-		fb_block_h *old,
-		fb_block_h *new,
-		fb_pos new_block,
-		fb_pos node_pos,
-		fb_pos height)
+		fb_pos block_pos,
+		size_t depth,
+		fb_shape *shape,
+		double *leaf_sq)
 {
-	new->height = height;
+	fb_block_data data = _fb_load_block(tree, block_pos, false);
+	fb_block_h *block = data.block;
+	if (block->type & CFB_BLOCK_TYPE_FREE)
+	{
+		// freed by a writer since its parent was read
+		_fb_unload_block(tree, data);
+		_fb_unlatch(tree, block_pos);
+		return;
+	}
 
-	fb_node_data node = _fb_node_content(tree, new, node_pos);
-	for (size_t i = 0; i < node.slot->cont + 1u; ++i)
+	size_t child_max = tree->block_nodes * tree->bfactor;
+	fb_pos *children = malloc(child_max * sizeof(fb_pos));
+	if (children == NULL)
 	{
-		fb_val curr_val = node.vals[i];
-		if (curr_val.type == CFB_VALUE_TYPE_NODE)
+		fprintf(stderr, "ERROR: cannot allocate block children\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t child_count = 0;
+	size_t keys = 0;
+	fb_key key_min = 0;
+	fb_key key_max = 0;
+
+	// the slots without a node are cache slots, only those
+	// holding entries are in the cache map
+	uint64_t *nodes = _fb_block_nodes(tree, block);
+	uint64_t *cached = _fb_block_cached(tree, block);
+	size_t node_slots = 0;
+	for (size_t w = 0; w < tree->slot_words; ++w)
+	{
+		node_slots += __builtin_popcountll(nodes[w]);
+	}
+	shape->cache_slots += tree->block_slots - node_slots;
+	for (size_t i = _fb_slot_next(tree, cached, 0); i < tree->block_slots; i = _fb_slot_next(tree, cached, i + 1))
+	{
+		fb_slot_h *slot = _fb_node_content(tree, block, i).slot;
+		shape->cache_entries += slot->cont;
+		shape->cache_used += slot->cont * sizeof(fb_cache_h)
+				+ tree->cache_size - _fb_cache_low(tree, slot);
+	}
+
+	for (size_t i = _fb_slot_next(tree, nodes, 0); i < tree->block_slots; i = _fb_slot_next(tree, nodes, i + 1))
+	{
+		fb_node_data node = _fb_node_content(tree, block, i);
+		size_t cap = _fb_node_cap(tree, node);
+		size_t fill = node.slot->cont * CFB_FILL_BUCKETS / cap;
+		shape->node_fill[fill < CFB_FILL_BUCKETS ? fill : CFB_FILL_BUCKETS - 1]++;
+		shape->node_fill_avg += node.slot->cont / (double)cap;
+		for (size_t j = 0; j <= node.slot->cont; ++j)
 		{
-			_fb_init_node(tree, new, curr_val.node_pos);
-			fb_node_data from = _fb_node_content(tree, old, curr_val.node_pos);
-			fb_node_data to = _fb_node_content(tree, new, curr_val.node_pos);
-			to.slot->type = from.slot->type;
-			to.slot->cont = from.slot->cont;
-			to.slot->parent = node_pos;
-			to.vals[0] = from.vals[0];
-			for (size_t j = 0; j < to.slot->cont; ++j)
+			if (_fb_val_type(node, j) == CFB_VALUE_TYPE_BLOCK && child_count < child_max)
 			{
-				to.keys[j] = from.keys[j];
-				to.vals[j+1] = from.vals[j+1];
+				children[child_count++] = _fb_val_at(node, j).block_pos;
 			}
-			from.slot->type = CFB_SLOT_TYPE_CACHE;
-			from.slot->cont = 0;
-			--old->cont;
-		
-			// update the parent of moved children blocks
-			for (size_t j = 0; j < to.slot->cont + 1u; ++j)
+			else if (_fb_val_type(node, j) == CFB_VALUE_TYPE_CNTNT && j > 0)
 			{
-				fb_val curr_val = to.vals[j];
-				if (curr_val.type == CFB_VALUE_TYPE_BLOCK)
-				{
-					fb_block_data block = _fb_load_block(tree, curr_val.block_pos, true);
-					block.block->parent = new_block;
-					_fb_unload_block(tree, block);
-				}
+				fb_key key = _fb_key_at(node, j-1);
+				key_min = keys == 0 || key < key_min ? key : key_min;
+				key_max = keys == 0 || key > key_max ? key : key_max;
+				keys++;
 			}
-
-			_fb_move_subtree(tree, old, new, new_block, curr_val.node_pos, height+1);
 		}
 	}
-}
+	bool leaf = block->type & CFB_BLOCK_TYPE_LEAF;
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
 
-void _fb_split_block(
-		fb_tree *tree,
-		fb_block_h *curr,
-		fb_pos curr_pos)
-{
-	size_t newr_pos;
-	size_t next_pos;
-	size_t increase;
-	bool fresh_parent = curr->type & CFB_BLOCK_TYPE_ROOT;
-	if (fresh_parent)
+	shape->blocks++;
+	shape->node_slots += node_slots;
+	size_t fill = node_slots * CFB_FILL_BUCKETS / tree->block_slots;
+	shape->block_fill[fill < CFB_FILL_BUCKETS ? fill : CFB_FILL_BUCKETS - 1]++;
+	shape->height = depth + 1 > shape->height ? depth + 1 : shape->height;
+
+	if (leaf)
 	{
-		newr_pos = tree->blocks_alloc;
-		next_pos = tree->blocks_alloc + 1u;
-		increase = 2;
-		tree->root = newr_pos;
+		if (keys > 0)
+		{
+			shape->key_min = shape->keys == 0 || key_min < shape->key_min ? key_min : shape->key_min;
+			shape->key_max = shape->keys == 0 || key_max > shape->key_max ? key_max : shape->key_max;
+			double density = keys / ((double)(key_max - key_min) + 1);
+			shape->density_min = shape->keys == 0 || density < shape->density_min ? density : shape->density_min;
+			shape->density_max = density > shape->density_max ? density : shape->density_max;
+		}
+		shape->leaf_keys_min = shape->leaf_blocks == 0 || keys < shape->leaf_keys_min ? keys : shape->leaf_keys_min;
+		shape->leaf_keys_max = keys > shape->leaf_keys_max ? keys : shape->leaf_keys_max;
+		shape->leaf_keys_mean += keys;
+		*leaf_sq += (double)keys * keys;
+		shape->leaf_blocks++;
+		shape->keys += keys;
 	}
-	else
+
+	for (size_t c = 0; c < child_count; ++c)
 	{
-		newr_pos = curr->parent;
-		next_pos = tree->blocks_alloc;
-		increase = 1;
+		_fb_latch(tree, children[c], false);
+		_fb_stats_block(tree, children[c], depth + 1, shape, leaf_sq);
 	}
-	
-	// cannot be a root anymore
-	curr->type &= ~CFB_BLOCK_TYPE_ROOT;
-	curr->parent = newr_pos;
+	free(children);
+}
 
-	tree->blocks_alloc += increase;
-	if (ftruncate(tree->index_fd, tree->blocks_alloc * tree->block_size))
+static void _fb_stats_json(const size_t *hist, FILE *json)
+{
+	fprintf(json, "[");
+	for (size_t b = 0; b < CFB_FILL_BUCKETS; ++b)
 	{
-		fprintf(stderr, "ERROR: cannot increase file size for new blocks\n");
-		exit(EXIT_FAILURE);
+		fprintf(json, "%s%zu", b > 0 ? ", " : "", hist[b]);
 	}
+	fprintf(json, "]");
+}
 
-	uint8_t next_type = curr->type & CFB_BLOCK_TYPE_LEAF;
-	fb_block_data newr =_fb_load_block(tree, newr_pos, true);
-	if (fresh_parent)
+void fb_tree_stats(fb_tree *tree, fb_shape *shape, FILE *json)
+{
+	memset(shape, 0, sizeof(fb_shape));
+	double leaf_sq = 0;
+	fb_pos root_pos = _fb_latch_root(tree, false);
+	_fb_stats_block(tree, root_pos, 0, shape, &leaf_sq);
+	shape->free_blocks = __atomic_load_n(&tree->blocks_free, __ATOMIC_RELAXED);
+	shape->cache_capacity = shape->cache_slots * tree->cache_size;
+	if (shape->node_slots > 0)
 	{
-		_fb_init_block(tree, newr.block, CFB_BLOCK_TYPE_ROOT, newr_pos);
-		_fb_init_node(tree, newr.block, newr.block->root);
+		shape->node_fill_avg /= shape->node_slots;
 	}
-	fb_block_data next =_fb_load_block(tree, next_pos, true);
-	_fb_init_block(tree, next.block, next_type, newr_pos);
-	_fb_init_node(tree, next.block, next.block->root);
-	
-	fb_node_data old_node = _fb_node_content(tree, curr, curr->root);
-	fb_node_data new_node = _fb_node_content(tree, next.block, next.block->root);
-
-	size_t target_size = tree->bfactor / 2;
-	for (size_t i = target_size; i < old_node.slot->cont; ++i)
+	if (shape->leaf_blocks > 0)
 	{
-		new_node.keys[i-target_size] = old_node.keys[i];
-		new_node.vals[i-target_size+1] = old_node.vals[i+1];
-		++new_node.slot->cont;
+		shape->leaf_keys_mean /= shape->leaf_blocks;
+		double var = leaf_sq / shape->leaf_blocks - shape->leaf_keys_mean * shape->leaf_keys_mean;
+		shape->leaf_keys_stddev = var > 0 ? sqrt(var) : 0;
 	}
-	old_node.slot->cont -= new_node.slot->cont;
-	
-	_fb_move_subtree(tree, curr, next.block, next.pos, next.block->root, 0);
-	
-	// update root node
-	if (fresh_parent)
+
+	if (json == NULL)
 	{
-		fb_node_data root_node = _fb_node_content(tree, newr.block, newr.block->root);
-		root_node.slot->cont = 1;
-		root_node.keys[0] = new_node.keys[0];
-		root_node.vals[0].type = CFB_VALUE_TYPE_BLOCK;
-		root_node.vals[0].block_pos = curr_pos;
-		root_node.vals[1].type = CFB_VALUE_TYPE_BLOCK;
-		root_node.vals[1].block_pos = next_pos;
+		return;
 	}
-	else
+	fprintf(json, "{\n"
+			"  \"height\": %zu,\n"
+			"  \"blocks\": %zu,\n"
+			"  \"leaf_blocks\": %zu,\n"
+			"  \"free_blocks\": %zu,\n"
+			"  \"node_slots\": %zu,\n"
+			"  \"cache_slots\": %zu,\n"
+			"  \"node_fill\": ",
+			shape->height, shape->blocks, shape->leaf_blocks,
+			shape->free_blocks, shape->node_slots, shape->cache_slots);
+	_fb_stats_json(shape->node_fill, json);
+	fprintf(json, ",\n"
+			"  \"node_fill_avg\": %.4f,\n"
+			"  \"block_fill\": ",
+			shape->node_fill_avg);
+	_fb_stats_json(shape->block_fill, json);
+	fprintf(json, ",\n"
+			"  \"cache_capacity\": %zu,\n"
+			"  \"cache_used\": %zu,\n"
+			"  \"cache_entries\": %zu,\n"
+			"  \"keys\": %zu,\n"
+			"  \"key_min\": %" CFB_KEY_FMT ",\n"
+			"  \"key_max\": %" CFB_KEY_FMT ",\n"
+			"  \"leaf_keys_min\": %zu,\n"
+			"  \"leaf_keys_max\": %zu,\n"
+			"  \"leaf_keys_mean\": %.4f,\n"
+			"  \"leaf_keys_stddev\": %.4f,\n"
+			"  \"density_min\": %.6g,\n"
+			"  \"density_max\": %.6g\n"
+			"}\n",
+			shape->cache_capacity, shape->cache_used, shape->cache_entries,
+			shape->keys, shape->key_min, shape->key_max,
+			shape->leaf_keys_min, shape->leaf_keys_max,
+			shape->leaf_keys_mean, shape->leaf_keys_stddev,
+			shape->density_min, shape->density_max);
+}
+
+void fb_cache_policy(
+		fb_tree *tree,
+		uint8_t policy)
+{
+	if (policy > CFB_CACHE_LFU)
 	{
-		fb_key insert_key = new_node.keys[0];
-		fb_val insert_val;
-		insert_val.type = CFB_VALUE_TYPE_BLOCK;
-		insert_val.block_pos = next_pos;
-		bool exact;
-		fb_val result;
-		fb_pos node_pos;
-		_fb_search_block(tree, newr.block, insert_key, &exact, &result, &node_pos);
-		_fb_insert_node(tree, newr.block, newr_pos, node_pos, insert_key, insert_val);
+		fprintf(stderr, "ERROR: unknown cache policy %u\n", policy);
+		exit(EXIT_FAILURE);
 	}
-	
-	_fb_unload_block(tree, newr);
-	_fb_unload_block(tree, next);
+	tree->cache_policy = policy;
 }
 
-void _fb_split_node(
+void fb_admit_policy(
 		fb_tree *tree,
-		fb_block_h *block,
-		fb_pos block_pos,
-		fb_pos node_pos,
-		fb_pos *next_pos)
+		uint8_t policy)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	*next_pos = _fb_get_fresh_node(tree, block);
-	fb_node_data next = _fb_node_content(tree, block, *next_pos);
-	next.slot->parent = node.slot->parent;
-
-	// copy keys and values to new node
-	size_t target_size = tree->bfactor / 2;
-	for (size_t i = target_size; i < node.slot->cont; ++i)
+	if (policy > CFB_ADMIT_SECOND)
 	{
-		next.keys[i-target_size] = node.keys[i];
-		next.vals[i-target_size+1] = node.vals[i+1];
-		++next.slot->cont;
+		fprintf(stderr, "ERROR: unknown admission policy %u\n", policy);
+		exit(EXIT_FAILURE);
 	}
-	node.slot->cont -= next.slot->cont;
-	
-	// update the parent of moved children
-	for (size_t i = 0; i < next.slot->cont + 1u; ++i)
+	tree->admit_policy = policy;
+}
+
+void fb_split_policy(
+		fb_tree *tree,
+		uint8_t policy)
+{
+	if (policy > CFB_SPLIT_APPEND)
 	{
-		fb_val curr_val = next.vals[i];
-		if (curr_val.type == CFB_VALUE_TYPE_NODE)
-		{
-			fb_node_data child = _fb_node_content(tree, block, curr_val.node_pos);
-			child.slot->parent = *next_pos;
-		}
+		fprintf(stderr, "ERROR: unknown split policy %u\n", policy);
+		exit(EXIT_FAILURE);
 	}
-
-	fb_val val;
-	val.type = CFB_VALUE_TYPE_NODE;
-	val.node_pos = *next_pos;
-	_fb_insert_node(tree, block, block_pos, node.slot->parent, next.keys[0], val);
+	tree->split_policy = policy;
 }
 
-static inline bool _fb_node_needs_split(fb_tree *tree, fb_block_h *block, size_t node_pos)
+void fb_cache_add(
+		fb_tree *tree,
+		fb_pos block_pos,
+		fb_key key,
+		const void *tuple,
+		size_t size)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	return node.slot->cont == tree->kfactor ? true : false;
+	_fb_latch(tree, block_pos, true);
+	fb_block_data data =_fb_load_block(tree, block_pos, true);
+	if (_fb_cache_owns(tree, data.block, key, NULL) && _fb_cache_admits(tree, data.block, key))
+	{
+		_fb_cache_insert(tree, data.block, key, tuple, size, true);
+	}
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
 }
 
-void _fb_insert_node(
+void fb_cache_add_batch(
 		fb_tree *tree,
-		fb_block_h *block,
 		fb_pos block_pos,
-		fb_pos node_pos,
-		fb_key key,
-		fb_val val)
+		const fb_key *keys,
+		const fb_value *values,
+		const uint64_t *versions,
+		const void *tuples,
+		size_t stride,
+		const size_t *sizes,
+		size_t count)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	
-	fb_key key_tmp;
-	fb_key key_old = key;
-	fb_val val_tmp;
-	fb_val val_old = val;
-	for (size_t i = 0; i < node.slot->cont; ++i)
+	_fb_latch(tree, block_pos, true);
+	fb_block_data data =_fb_load_block(tree, block_pos, true);
+	for (size_t k = 0; k < count; ++k)
 	{
-		if (node.keys[i] > key_old)
+		// a tuple overwritten since it was read would be cached stale
+		if (versions != NULL && !_fb_same_version(tree, keys[k], versions[k]))
 		{
-			key_tmp = node.keys[i];
-			val_tmp = node.vals[i+1];
-			node.keys[i] = key_old;
-			node.vals[i+1] = val_old;
-			key_old = key_tmp;
-			val_old = val_tmp;
+			continue;
+		}
+		if (_fb_cache_owns(tree, data.block, keys[k], values != NULL ? values + k : NULL)
+				&& _fb_cache_admits(tree, data.block, keys[k]))
+		{
+			_fb_cache_insert(tree, data.block, keys[k], (const char *)tuples + k * stride,
+					sizes != NULL ? sizes[k] : stride, true);
 		}
 	}
-	node.keys[node.slot->cont] = key_old;
-	node.vals[node.slot->cont+1] = val_old;
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
+}
 
-	++node.slot->cont;
-	++tree->content;
+bool fb_cache_probe(
+		fb_tree *tree,
+		fb_pos block_pos,
+		fb_key key,
+		void *tuple,
+		size_t *size)
+{
+	_fb_latch(tree, block_pos, false);
+	fb_block_data data =_fb_hint_block(tree, block_pos);
+	bool found = _fb_cache_lookup(tree, data.block, key, tuple, size);
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
+	return found;
+}
 
-	fb_pos next_pos;
-	if (_fb_node_needs_split(tree, block, node_pos))
+size_t fb_cache_probe_batch(
+		fb_tree *tree,
+		fb_pos block_pos,
+		const fb_key *keys,
+		void *tuples,
+		size_t stride,
+		size_t *sizes,
+		bool *hits,
+		uint64_t *versions,
+		size_t count)
+{
+	size_t found = 0;
+	_fb_latch(tree, block_pos, false);
+	fb_block_data data =_fb_hint_block(tree, block_pos);
+	for (size_t k = 0; k < count; ++k)
 	{
-		if (node_pos != block->root) // guaranteed to have one free node
+		if (versions != NULL)
 		{
-			_fb_split_node(tree, block, block_pos, node_pos, &next_pos);
+			versions[k] = _fb_read_version(tree, keys[k]);
 		}
-		else
+		size_t size = stride;
+		hits[k] = _fb_cache_lookup(tree, data.block, keys[k], (char *)tuples + k * stride, &size);
+		if (sizes != NULL)
 		{
-			if (block->height < tree->block_height)
-			{
-				// add a parent to the current root
-				fb_pos parent_pos =_fb_get_fresh_node(tree, block);
-				fb_node_data parent = _fb_node_content(tree, block, parent_pos);
-				parent.vals[0].type = CFB_VALUE_TYPE_NODE;
-				parent.vals[0].node_pos = node_pos;
-				block->root = parent_pos;
-				node.slot->parent = parent_pos;
-
-				++block->height;
-				
-				// split the former root
-				_fb_split_node(tree, block, block_pos, node_pos, &next_pos);
-			}
-			else
-			{
-				//printf("~~~~~~~~~~~ splitting block ~~~~~~~~~~~\n");
-				_fb_split_block(tree, block, block_pos);
-			}
+			sizes[k] = hits[k] ? size : 0;
 		}
+		found += hits[k];
 	}
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
+	return found;
 }
 
-void _fb_replace_value(
+/**
+ * Replace the tuple of a key cached in a loaded block, if any
+ */
+static void _fb_cache_update(
 		fb_tree *tree,
 		fb_block_h *block,
-		fb_pos node_pos,
 		fb_key key,
-		fb_val val)
+		const void *tuple,
+		size_t size)
 {
-	fb_node_data node = _fb_node_content(tree, block, node_pos);
-	
-	for (size_t i = 0; i < node.slot->cont; ++i)
+	size_t entry, probes;
+	fb_slot_h *slot = _fb_cache_locate(tree, block, key, &entry, &probes);
+	if (slot != NULL)
 	{
-		if (node.keys[i] == key)
+		// the new tuple may not fit where the old one was
+		uint8_t ref = _fb_cache_dir(slot)[entry].ref;
+		_fb_cache_remove(tree, block, slot, entry);
+		fb_cache_h *added = _fb_cache_insert(tree, block, key, tuple, size, true);
+		if (added != NULL)
 		{
-			node.vals[i+1] = val;
+			added->ref = ref;
 		}
+		_fb_count(&_fb_stats(tree)->replacements, 1);
 	}
 }
 
-void _fb_insert(
+/**
+ * Make a block loaded for its hints writable, at no cost unless
+ * writing it needs an image in the log or a dirty frame in the pool
+ */
+static inline fb_block_data _fb_reload_block(fb_tree *tree, fb_block_data data)
+{
+	if (data.frame == NULL && tree->log == NULL)
+	{
+		// its hints already reach the index file, so does the rest
+		return data;
+	}
+	fb_block_data again = _fb_load_block(tree, data.pos, true);
+	_fb_unload_block(tree, data);
+	return again;
+}
+
+bool fb_retrieve_cached(
 		fb_tree *tree,
 		fb_key key,
-		fb_val value,
-		bool exact,
-		fb_pos block_pos,
-		fb_pos node_pos)
+		void *tuple,
+		size_t *size,
+		fb_fetch_fn fetch,
+		void *arg)
 {
-	fb_block_data block;
-	if (tree->content == 0) // insertion on empty tree
+	bool exact;
+	fb_val result;
+	fb_pos path[CFB_MAX_DEPTH];
+	size_t depth;
+	fb_pos node_pos;
+	// a hit touches its entry in the leaf loaded by the walk
+	fb_block_data data = _fb_walk_leaf(tree, key, true, &exact, &result, path, &depth, &node_pos);
+	fb_pos block_pos = path[depth-1];
+	if (!exact)
 	{
-		block = _fb_load_block(tree, tree->root, true);
-		_fb_init_node(tree, block.block, 0);
-		_fb_insert_node(tree, block.block, tree->root, 0, key, value);
-		_fb_unload_block(tree, block);
-		return;
+		_fb_unload_block(tree, data);
+		_fb_unlatch(tree, block_pos);
+		return false;
 	}
-	
-	block = _fb_load_block(tree, block_pos, true);
-	if (exact) // exact match, replace value
+	uint64_t version = _fb_read_version(tree, key);
+
+	if (_fb_cache_lookup(tree, data.block, key, tuple, size))
 	{
-		_fb_replace_value(tree, block.block, node_pos, key, value);
-		return;
+		_fb_unload_block(tree, data);
+		_fb_unlatch(tree, block_pos);
+		return true;
 	}
-	else // true insertion
+
+	if (tree->latches != NULL)
 	{
-		_fb_insert_node(tree, block.block, block_pos, node_pos, key, value);
+		// the tuple is read without holding the block, which is
+		// latched again exclusively to admit it, unless an upsert
+		// changed the tuple meanwhile
+		_fb_unload_block(tree, data);
+		_fb_unlatch(tree, block_pos);
+		fb_value value = result.value;
+		if (fetch(value, tuple, size, arg))
+		{
+			fb_cache_add_batch(tree, block_pos, &key, &value, &version, tuple, *size, NULL, 1);
+		}
+		return true;
 	}
-	_fb_unload_block(tree, block);
+	if (fetch(result.value, tuple, size, arg))
+	{
+		// admitting writes the block, even when it rejects the tuple
+		data = _fb_reload_block(tree, data);
+		if (_fb_cache_admits(tree, data.block, key))
+		{
+			_fb_cache_insert(tree, data.block, key, tuple, *size, true);
+		}
+	}
+	_fb_unload_block(tree, data);
+	return true;
 }
 
-void fb_insert(
+bool fb_upsert(
 		fb_tree *tree,
 		fb_key key,
-		fb_val value)
+		const void *tuple,
+		size_t size,
+		fb_store_fn store,
+		fb_write_fn write,
+		void *arg)
 {
+	fb_pos path[CFB_MAX_DEPTH];
+	size_t top;
 	bool exact;
-	fb_pos block_pos;
-	fb_pos node_pos;
 	fb_val result;
-	if (tree->content > 0)
+	fb_pos node_pos;
+	fb_block_data leaf;
+	size_t depth = _fb_descend(tree, key, true, false, path, &top, &exact, &result, &node_pos, &leaf);
+	if (depth == 0)
 	{
-		_fb_retrieve(tree, key, &exact, &result, &block_pos, &node_pos);
+		// the leaf block may split into its parent
+		depth = _fb_descend(tree, key, false, false, path, &top, &exact, &result, &node_pos, &leaf);
 	}
-	_fb_insert(tree, key, value, exact, block_pos, node_pos);
-}
 
-static fb_pos _fb_cache_hash(fb_key key, uint32_t param, uint32_t range)
-{
-	return (key + param) % range;
+	// the tuple is stored, or only logged to go over its older
+	// version, with the leaf latched, and that write takes a ticket
+	// so that the versions of a key land in the order of their upserts
+	fb_value old = result.value;
+	fb_val value;
+	value.type = CFB_VALUE_TYPE_CNTNT;
+	value.value = store(exact ? &old : NULL, tuple, size, arg);
+	bool over = exact && value.value == old;
+	uint64_t ticket = over ? _fb_begin_write(tree, key) : 0;
+	uint64_t lsn = over && tree->log != NULL ? fb_log_mark(tree->log) : 0;
+	_fb_write_block(tree, leaf);
+	if (!over)
+	{
+		_fb_insert_leaf(tree, leaf.block, key, value, exact, path, depth, node_pos);
+	}
+	if (exact)
+	{
+		// replacing a value splits nothing, the key stays in the leaf
+		_fb_cache_update(tree, leaf.block, key, tuple, size);
+	}
+	_fb_unload_block(tree, leaf);
+	_fb_unlatch_path(tree, path, top, depth);
+
+	// the log syncs with the leaf released, a crash before the tuple
+	// is written over its older version leaving the record to replay
+	if (over)
+	{
+		if (tree->log != NULL)
+		{
+			fb_log_wait(tree->log, lsn);
+		}
+		_fb_await_write(tree, key, ticket);
+		write(value.value, tuple, size, arg);
+		_fb_end_write(tree, key, ticket);
+	}
+	return exact;
 }
 
-void fb_cache_add(
+void fb_cache_replace(
 		fb_tree *tree,
 		fb_pos block_pos,
 		fb_key key,
-		fb_tuple *tuple)
+		const void *tuple,
+		size_t size)
 {
+	_fb_latch(tree, block_pos, true);
 	fb_block_data data =_fb_load_block(tree, block_pos, true);
-	fb_pos insert_slot = 0;
-	fb_pos insert_entry = 0;
-	bool cache_found = false;
+	_fb_cache_update(tree, data.block, key, tuple, size);
+	_fb_unload_block(tree, data);
+	_fb_unlatch(tree, block_pos);
+}
 
-	// either find a slot where we can insert the tuple
-	// or force out a cached item in the first slot we hash to
-	fb_pos node_pos;
-	fb_node_data node;
-	for (size_t i = 0; i < tree->block_slots; ++i)
-	{
-		node_pos = _fb_cache_hash(key, i, tree->block_slots);
-		node = _fb_node_content(tree, data.block, node_pos);
-		if (node.slot->type == CFB_SLOT_TYPE_CACHE)
-		{		
-			if (!cache_found)
+static void _fb_cache_drop(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key key)
+{
+	size_t entry, probes;
+	fb_slot_h *slot = _fb_cache_locate(tree, block, key, &entry, &probes);
+	if (slot != NULL)
+	{
+		_fb_cache_remove(tree, block, slot, entry);
+	}
+}
+
+static void _fb_cache_purge(
+		fb_tree *tree,
+		fb_block_h *block,
+		fb_key from)
+{
+	uint64_t *cached = _fb_block_cached(tree, block);
+	for (size_t i = _fb_slot_next(tree, cached, 0); i < tree->block_slots; i = _fb_slot_next(tree, cached, i + 1))
+	{
+		fb_node_data node = _fb_node_content(tree, block, i);
+		fb_cache_h *dir = _fb_cache_dir(node.slot);
+		for (size_t j = 0; j < node.slot->cont; )
+		{
+			if (dir[j].key >= from)
 			{
-				// coordinates of first cache found
-				// in case we cannot find any available cache entry
-				insert_slot = node_pos;
-				insert_entry = key % tree->cache_tuples;
-				cache_found = true;
+				_fb_cache_remove(tree, block, node.slot, j);
 			}
-			if (node.slot->cont < tree->cache_tuples)
+			else
 			{
-				// found an available cache entry
-				insert_slot = node_pos;
-				insert_entry = node.slot->cont;
-				++node.slot->cont;
-				break;
+				++j;
 			}
 		}
 	}
-	if (!cache_found) // no cache slot available
-	{
-		return;
-	}
-
-	node = _fb_node_content(tree, data.block, insert_slot);
-	fb_tuple *check = (fb_tuple *)node.slot->body + insert_entry;
-	memcpy(check, tuple, sizeof(fb_tuple));
-
-	_fb_unload_block(tree, data);
 }
 
-bool fb_cache_probe(
-		fb_tree *tree,
-		fb_pos block_pos,
-		fb_key key,
-		fb_tuple *tuple)
+/**
+ * Write back the images of the blocks changed since the checkpoint
+ * @param[out] imaged Which blocks had an image, to free
+ * @return The end of the valid records of the log
+ */
+static size_t _fb_log_restore(fb_tree *tree, int fd, uint8_t **imaged)
 {
-	fb_block_data data =_fb_load_block(tree, block_pos, true);
+	*imaged = calloc(tree->blocks_alloc / 8 + 1, 1);
+	if (*imaged == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate log image map\n");
+		exit(EXIT_FAILURE);
+	}
 
-	for (size_t i = 0; i < tree->block_slots; ++i)
+	size_t off = sizeof(fb_log_h);
+	fb_log_rec rec;
+	char *body;
+	while ((body = fb_log_read(fd, off, &rec)) != NULL)
 	{
-		fb_pos node_pos = _fb_cache_hash(key, i, tree->block_slots);
-		fb_node_data node = _fb_node_content(tree, data.block, node_pos);
-		if (node.slot->type == CFB_SLOT_TYPE_CACHE)
+		if (rec.type == CFB_LOG_IMAGE)
 		{
-			for (size_t j = 0; j < node.slot->cont; ++j)
+			// only the first image is the block as of the checkpoint
+			fb_pos block_pos;
+			memcpy(&block_pos, body, sizeof(fb_pos));
+			if (block_pos < tree->blocks_alloc
+					&& !((*imaged)[block_pos / 8] & (1u << (block_pos % 8))))
 			{
-				fb_tuple *check = (fb_tuple *)node.slot->body + j;
-				if (check->id == key)
+				(*imaged)[block_pos / 8] |= 1u << (block_pos % 8);
+				off_t block_off = (off_t)block_pos * tree->block_size;
+				if (pwrite(tree->index_fd, body + sizeof(fb_pos), tree->block_size, block_off)
+						!= (ssize_t)tree->block_size)
 				{
-					memcpy(tuple, check, sizeof(fb_tuple));
-					_fb_unload_block(tree, data);
-					return true;
+					fprintf(stderr, "ERROR: cannot restore block %" CFB_POS_FMT "\n", block_pos);
+					exit(EXIT_FAILURE);
 				}
 			}
-			if (tree->cache_tuples > node.slot->cont)
-			{
-				// there is a space that key should have used
-				// if it's not here, it's not cached
-				break;
-			}
 		}
+		free(body);
+		off += sizeof(fb_log_rec) + rec.size;
 	}
 
-	_fb_unload_block(tree, data);
-	return false;
+	// blocks allocated since the checkpoint are rebuilt by the replay
+	if (ftruncate(tree->index_fd, tree->blocks_alloc * tree->block_size))
+	{
+		fprintf(stderr, "ERROR: cannot truncate index file\n");
+		exit(EXIT_FAILURE);
+	}
+	return off;
 }
 
-void fb_cache_replace(
+/**
+ * Apply again the changes logged since the checkpoint
+ */
+static void _fb_log_replay(
 		fb_tree *tree,
-		fb_pos block_pos,
-		fb_key key,
-		fb_tuple *tuple)
+		int fd,
+		size_t end,
+		fb_replay_fn replay,
+		void *arg)
 {
-	fb_block_data data =_fb_load_block(tree, block_pos, true);
+	size_t off = sizeof(fb_log_h);
+	fb_log_rec rec;
+	while (off < end)
+	{
+		char *body = fb_log_read(fd, off, &rec);
+		assert(body != NULL);
+		fb_key key;
+		memcpy(&key, body, sizeof(fb_key));
+		if (rec.type == CFB_LOG_INSERT)
+		{
+			fb_val value;
+			memcpy(&value, body + sizeof(fb_key), sizeof(fb_val));
+			fb_insert(tree, key, value);
+
+			// the cache may hold the tuple of a value since replaced
+			bool exact;
+			fb_val result;
+			fb_pos block_pos, node_pos;
+			_fb_retrieve(tree, key, &exact, &result, &block_pos, &node_pos);
+			fb_block_data block = _fb_load_block(tree, block_pos, true);
+			_fb_cache_drop(tree, block.block, key);
+			_fb_unload_block(tree, block);
+		}
+		else if (rec.type == CFB_LOG_DELETE)
+		{
+			fb_delete(tree, key, NULL);
+		}
+		else if (rec.type == CFB_LOG_DATA && replay != NULL)
+		{
+			replay(body, rec.size, arg);
+		}
+		free(body);
+		off += sizeof(fb_log_rec) + rec.size;
+	}
+}
 
-	for (size_t i = 0; i < tree->block_slots; ++i)
+void fb_log_tree(
+		fb_tree *tree,
+		const char *file,
+		size_t latency,
+		fb_replay_fn replay,
+		void *arg)
+{
+	if (tree->log != NULL)
 	{
-		fb_pos node_pos = _fb_cache_hash(key, i, tree->block_slots);
-		fb_node_data node = _fb_node_content(tree, data.block, node_pos);
-		if (node.slot->type == CFB_SLOT_TYPE_CACHE)
+		return;
+	}
+
+	int fd = open(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1)
+	{
+		fprintf(stderr, "ERROR: cannot open log file %s\n", file);
+		exit(EXIT_FAILURE);
+	}
+
+	// only a log of the last checkpoint holds the changes since
+	fb_log_h head;
+	bool current = pread(fd, &head, sizeof(fb_log_h), 0) == sizeof(fb_log_h)
+			&& head.magic == CFB_LOG_MAGIC
+			&& head.version == CFB_LOG_VERSION
+			&& head.epoch == tree->epoch
+			&& head.block_size == tree->block_size;
+	if (tree->recover && !current)
+	{
+		fprintf(stderr, "ERROR: index file was not closed cleanly and has no log to recover from\n");
+		exit(EXIT_FAILURE);
+	}
+	if (tree->recover && tree->pool != NULL)
+	{
+		fprintf(stderr, "ERROR: cannot replay a log under a buffer pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tree->log = malloc(sizeof(fb_log));
+	if (tree->log == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot allocate log\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!current)
+	{
+		fb_log_init(tree->log, fd, 0, tree->epoch, tree->block_size, tree->blocks_alloc, latency);
+
+		// the blocks written so far become the first checkpoint
+		fb_checkpoint(tree);
+		return;
+	}
+
+	uint8_t *imaged;
+	size_t end = _fb_log_restore(tree, fd, &imaged);
+	fb_log_init(tree->log, fd, end, tree->epoch,
+			tree->block_size, tree->blocks_alloc, latency);
+	for (fb_pos block_pos = 0; block_pos < tree->blocks_alloc; ++block_pos)
+	{
+		if (imaged[block_pos / 8] & (1u << (block_pos % 8)))
 		{
-			for (size_t j = 0; j < node.slot->cont; ++j)
-			{
-				fb_tuple *check = (fb_tuple *)node.slot->body + j;
-				if (check->id == key)
-				{
-					// replace old entry
-					memcpy(check, tuple, sizeof(fb_tuple));
-					_fb_unload_block(tree, data);
-				}
-			}
-			if (tree->cache_tuples > node.slot->cont)
-			{
-				// there is a space that key should have used
-				// if it's not here, it's not cached
-				break;
-			}
+			fb_log_imaged(tree->log, block_pos);
 		}
 	}
+	free(imaged);
 
-	_fb_unload_block(tree, data);
+	// replayed changes are not logged again, the blocks they touch are
+	tree->recover = true;
+	_fb_log_replay(tree, fd, end, replay, arg);
+	tree->recover = false;
+}
+
+void fb_log_data(
+		fb_tree *tree,
+		const void *data,
+		size_t size)
+{
+	if (tree->log != NULL && !tree->recover)
+	{
+		fb_log_append(tree->log, CFB_LOG_DATA, data, size, NULL, 0);
+	}
+}
+
+void fb_commit(fb_tree *tree)
+{
+	if (tree->log != NULL)
+	{
+		fb_log_commit(tree->log);
+	}
 }
 
+void fb_checkpoint(fb_tree *tree)
+{
+	if (tree->log == NULL)
+	{
+		return;
+	}
 
+	// the blocks reach the file, then the superblock moves the epoch past the log
+	if (tree->pool != NULL)
+	{
+		fb_pool_flush(tree->pool);
+	}
+	fdatasync(tree->index_fd);
+	++tree->epoch;
+	_fb_write_super(tree, false);
+	fdatasync(tree->index_fd);
+	fb_log_reset(tree->log, tree->epoch, tree->blocks_alloc);
+}
@@ -1,10 +1,50 @@
 #ifndef CFB_TREE_H
 #define CFB_TREE_H
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+// width in bits of the keys, of the values pointing to tuples and of
+// the positions of blocks and nodes, 32 or 64 each, fixed at build time
+#ifndef CFB_KEY_BITS
+#define CFB_KEY_BITS 32
+#endif
+#ifndef CFB_VALUE_BITS
+#define CFB_VALUE_BITS 32
+#endif
+#ifndef CFB_POS_BITS
+#define CFB_POS_BITS 32
+#endif
+
+// 1 to start slots on cache lines and lay out the keys, values and
+// value types of a node as separate arrays at their natural alignment,
+// 0 to pack headers and values to the byte, fixed at build time
+#ifndef CFB_LAYOUT_ALIGNED
+#define CFB_LAYOUT_ALIGNED 0
+#endif
+
+// 8 or 16 to store the keys of a node as deltas of that many bits from
+// a base key of the node, searched without widening them, 0 to store
+// whole keys, fixed at build time; a node whose keys lie too far apart
+// holds as many whole keys as fit in the room of the deltas, which must
+// be 4 at least: bfactor has to reach CFB_KEY_DELTA_BFACTOR_MIN, i.e. 7
+// with 16-bit deltas of 32-bit keys, 13 with 8-bit deltas or 64-bit keys
+// and 25 with both, so that 4096/64/6 or 4096/128/12 are refused
+#ifndef CFB_KEY_DELTA_BITS
+#define CFB_KEY_DELTA_BITS 0
+#endif
+
+#define CFB_CACHE_LINE (64)
+
+#if CFB_LAYOUT_ALIGNED
+#define CFB_HEAD_PACKED
+#else
+#define CFB_HEAD_PACKED __attribute__((packed))
+#endif
+
 #define CFB_VALUE_TYPE_NULL (0)
 #define CFB_VALUE_TYPE_NODE (1)
 #define CFB_VALUE_TYPE_BLOCK (2)
@@ -13,10 +53,79 @@
 #define CFB_SLOT_TYPE_CACHE (8)
 #define CFB_SLOT_TYPE_NODE (16)
 
+// a node of a tree of packed keys holding whole keys instead,
+// as they lie too far apart for its deltas
+#define CFB_SLOT_WIDE (1)
+
 #define CFB_BLOCK_TYPE_INNER (0)
 #define CFB_BLOCK_TYPE_ROOT (32)
+#define CFB_BLOCK_TYPE_FREE (64)
 #define CFB_BLOCK_TYPE_LEAF (128)
 
+// replacement policies of the block cache:
+// the entry the new key hashes to, as in the original cache
+#define CFB_CACHE_HASHED (0)
+
+// the first entry not read since the clock hand last passed it
+#define CFB_CACHE_CLOCK (1)
+
+// the entry read the least, the survivors losing the count of
+// each entry forced out so that old favourites age
+#define CFB_CACHE_LFU (2)
+
+// split policies of full nodes:
+// half of the keys move to the new node
+#define CFB_SPLIT_HALF (0)
+
+// as half, but a key higher than any inserted before moves alone,
+// so that ascending inserts leave full nodes behind them
+#define CFB_SPLIT_APPEND (1)
+
+// admission policies of the block cache:
+// every tuple read on a miss is cached
+#define CFB_ADMIT_ALL (0)
+
+// a tuple is cached on the second miss of its key that the block
+// remembers, so that one sweep over the keys leaves the cache alone
+#define CFB_ADMIT_SECOND (1)
+
+// the slots of a block a key may be cached in, those
+// that hold nodes are skipped, so a lookup looks into
+// at most this many cache slots
+#define CFB_CACHE_WAYS (8)
+
+// the counters of a tree, threads spread over them
+#define CFB_STATS_SHARDS (32)
+
+// the versions of the tuples of a tree, keys spread over them
+#define CFB_VERSION_STRIPES (1024)
+
+// buckets of the fill histograms of fb_tree_stats, 10% each
+#define CFB_FILL_BUCKETS (10)
+
+// no block, ends the list of free blocks
+#define CFB_NULL_POS ((fb_pos)-1)
+
+// max number of blocks on a path from the root
+#define CFB_MAX_DEPTH (64)
+
+// number of entries fb_scan hands to its callback at once
+#define CFB_SCAN_BATCH (64)
+
+// default address space reserved by fb_map_tree
+#define CFB_MAP_RESERVE ((size_t)1 << 36)
+
+// the bits of a block header remembering the keys missed in its cache,
+// for each slot of the block
+#define CFB_SEEN_BITS (8)
+
+// the block holding the superblock, the blocks of the tree follow
+#define CFB_SUPER_POS (0)
+
+// identifies an index file, and the version of its layout
+#define CFB_SUPER_MAGIC (0x54424643)
+#define CFB_SUPER_VERSION (11)
+
 typedef struct _fb_val fb_val;
 typedef struct _fb_tuple fb_tuple;
 typedef struct _fb_slot_h fb_slot_h;
@@ -24,20 +133,71 @@ typedef struct _fb_inner_h fb_inner_h;
 typedef struct _fb_leaf_h fb_leaf_h;
 typedef struct _fb_cache_h fb_cache_h;
 typedef struct _fb_block_h fb_block_h;
+typedef struct _fb_super fb_super;
 typedef struct _fb_tree fb_tree;
+typedef struct _fb_pool fb_pool;
+typedef struct _fb_frame fb_frame;
+typedef struct _fb_latches fb_latches;
+typedef struct _fb_log fb_log;
+typedef struct _fb_stats fb_stats;
+typedef struct _fb_version fb_version;
+typedef struct _fb_shape fb_shape;
 
-/**
- * An index / leaf value
- */
+#if CFB_KEY_BITS == 64
+typedef uint64_t fb_key;
+#define CFB_KEY_FMT PRIu64
+#elif CFB_KEY_BITS == 32
 typedef uint32_t fb_key;
+#define CFB_KEY_FMT PRIu32
+#else
+#error "CFB_KEY_BITS must be 32 or 64"
+#endif
+
+#if CFB_KEY_DELTA_BITS == 16
+typedef uint16_t fb_delta;
+#elif CFB_KEY_DELTA_BITS == 8
+typedef uint8_t fb_delta;
+#elif CFB_KEY_DELTA_BITS != 0
+#error "CFB_KEY_DELTA_BITS must be 0, 8 or 16"
+#endif
+
+// the farthest a key of a node may lie from its base
+#define CFB_KEY_DELTA_MAX (((fb_key)1 << CFB_KEY_DELTA_BITS) - 1)
+
+#if CFB_KEY_DELTA_BITS
+// the smallest bfactor leaving room for 4 whole keys in a node
+#define CFB_KEY_DELTA_BFACTOR_MIN (1 + 3 * CFB_KEY_BITS / CFB_KEY_DELTA_BITS)
+#endif
+
+#if CFB_VALUE_BITS == 64
+typedef uint64_t fb_value;
+#define CFB_VALUE_FMT PRIu64
+#elif CFB_VALUE_BITS == 32
+typedef uint32_t fb_value;
+#define CFB_VALUE_FMT PRIu32
+#else
+#error "CFB_VALUE_BITS must be 32 or 64"
+#endif
+
+#if CFB_POS_BITS == 64
+typedef uint64_t fb_pos;
+#define CFB_POS_FMT PRIu64
+#elif CFB_POS_BITS == 32
 typedef uint32_t fb_pos;
+#define CFB_POS_FMT PRIu32
+#else
+#error "CFB_POS_BITS must be 32 or 64"
+#endif
 
+/**
+ * An index / leaf value
+ */
 struct _fb_val {
 	uint8_t type;
 	union {
 		fb_pos node_pos;
 		fb_pos block_pos;
-		uint32_t value;
+		fb_value value;
 	};
 }__attribute__((packed));
 
@@ -48,7 +208,7 @@ struct _fb_val {
 
 struct _fb_tuple
 {
-	uint32_t id;
+	fb_key id;
 	char name[20];
 	uint32_t items[2];
 
@@ -62,9 +222,32 @@ struct _fb_slot_h
 {
 	uint8_t type;
 	uint8_t cont;
-	fb_pos parent;
+
+	union {
+		// the parent node
+		fb_pos parent;
+
+		// for a cache slot, the clock hand over its entries
+		uint8_t hand;
+	};
 	uint8_t body[0];
-} __attribute__((packed));
+} CFB_HEAD_PACKED;
+
+/**
+ * An entry of the directory of a cache slot,
+ * its tuple lies at off from the start of the slot body
+ */
+struct _fb_cache_h
+{
+	fb_key key;
+	uint16_t off;
+	uint16_t size;
+
+	// the reference bit or the read count of the entry,
+	// depending on the replacement policy
+	uint8_t ref;
+}
+__attribute__((packed));
 
 /**
  * A block of slots
@@ -73,16 +256,152 @@ struct _fb_block_h
 {
 	uint8_t type;
 	uint8_t cont;
+
+	// the next block of the free list, the blocks of the tree
+	// do not know their parent, it is on the path down to them
 	fb_pos parent;
 	fb_pos root;
 	fb_pos height;
 
-	char body[0];
+	// maps of as many words as the slots of the tree need follow:
+	// a bit for each slot holding a node, a bit for each cache slot
+	// holding entries, and two bits for each key missed in the cache
+	// of a leaf block, cleared once half of them are set;
+	// the list of slots comes after them
+}
+CFB_HEAD_PACKED __attribute__((aligned(8)));
+
+/**
+ * The state of a tree kept in the first block of its index file,
+ * so that the tree can be opened again without rebuilding it
+ */
+struct _fb_super
+{
+	uint32_t magic;
+	uint32_t version;
+
+	// the geometry the tree was created with
+	uint64_t block_size;
+	uint64_t slot_size;
+	uint64_t bfactor;
+
+	// the widths the tree was built with
+	uint8_t key_bits;
+	uint8_t value_bits;
+	uint8_t pos_bits;
+	uint8_t layout_aligned;
+	uint8_t key_delta_bits;
+
+	uint64_t content;
+	uint64_t blocks_alloc;
+	uint64_t blocks_free;
+	fb_pos root;
+	fb_pos free_head;
+
+	// the last checkpoint, a log must start from it to be replayed
+	uint64_t epoch;
 
-	// list of slots follows
+	// the highest key inserted, so that appends are told apart
+	// from the first insert after the tree is opened
+	uint64_t key_high;
+
+	// whether the tree was destroyed after its last change
+	uint8_t clean;
 }
 __attribute__((packed));
 
+/**
+ * What the block cache of a tree did
+ */
+struct _fb_stats
+{
+	// cache lookups, and those that found their key or not
+	uint64_t probes;
+	uint64_t hits;
+	uint64_t misses;
+
+	// tuples added to the cache, forced out for others,
+	// and updated in place of an older tuple
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t replacements;
+
+	// tuples read on a miss and kept out by the admission policy
+	uint64_t rejections;
+
+	// cached tuples moved out of a slot taken by a node, counted
+	// as inserts again, and those lost for want of room elsewhere
+	uint64_t migrations;
+	uint64_t lost;
+
+	// blocks loaded, whether mapped one by one, pinned in the pool
+	// or found in the long-lived mapping
+	uint64_t loads;
+
+	// cache lookups by the number of cache slots they looked into
+	uint64_t probe_slots[CFB_CACHE_WAYS + 1];
+}
+__attribute__((aligned(64)));
+
+/**
+ * The writes of the tuples of the keys of a stripe over their older
+ * versions, done in the order they began
+ */
+struct _fb_version
+{
+	// writes begun, each taking the next ticket with the leaf block
+	// of its key latched, and those ended, the last one raising it
+	// to its ticket plus one
+	uint64_t began;
+	uint64_t ended;
+};
+
+/**
+ * The shape of a tree, as measured by fb_tree_stats
+ */
+struct _fb_shape
+{
+	// levels of blocks from the root to the leaves
+	size_t height;
+
+	// blocks of the tree, those that are leaves,
+	// and those allocated in the file but free
+	size_t blocks;
+	size_t leaf_blocks;
+	size_t free_blocks;
+
+	// slots holding nodes or cache
+	size_t node_slots;
+	size_t cache_slots;
+
+	// nodes by the fraction of their keys in use
+	size_t node_fill[CFB_FILL_BUCKETS];
+	double node_fill_avg;
+
+	// blocks by the fraction of their slots holding nodes
+	size_t block_fill[CFB_FILL_BUCKETS];
+
+	// bytes of the cache slots, those taken by entries, and the entries
+	size_t cache_capacity;
+	size_t cache_used;
+	size_t cache_entries;
+
+	// keys in the tree, the smallest and the largest
+	size_t keys;
+	fb_key key_min;
+	fb_key key_max;
+
+	// keys per leaf block
+	size_t leaf_keys_min;
+	size_t leaf_keys_max;
+	double leaf_keys_mean;
+	double leaf_keys_stddev;
+
+	// keys of a leaf block per value of the range of keys it covers,
+	// far apart when some ranges are much more crowded than others
+	double density_min;
+	double density_max;
+};
 
 typedef struct _fb_block_data fb_block_data;
 struct _fb_block_data
@@ -91,6 +410,7 @@ struct _fb_block_data
 	fb_pos pos;
 	char *mptr;
 	size_t off;
+	fb_frame *frame;
 };
 
 /**
@@ -115,8 +435,36 @@ struct _fb_tree
 	// does not include cache slots
 	size_t block_nodes;
 
-	// max number of tuples in a cache
-	size_t cache_tuples;
+	// words of the slot maps of a block header,
+	// and of its map of the keys missed in its cache
+	size_t slot_words;
+	size_t seen_words;
+
+	// offset of the first slot in a block, past its header and maps
+	size_t slots_off;
+
+	// bytes of a cache slot for tuples and their directory
+	size_t cache_size;
+
+	// how a full cache slot picks the entry to force out
+	uint8_t cache_policy;
+
+	// which tuples read on a miss get into the cache
+	uint8_t admit_policy;
+
+	// where a full node splits
+	uint8_t split_policy;
+
+	// the highest key inserted, telling appends apart
+	fb_key key_high;
+
+	// the counters of the cache, a shard for each few threads
+	fb_stats *stats;
+
+	// the versions of the tuples, a stripe for each few keys, so that
+	// a tuple read on a miss is not cached once a newer one began to
+	// be written, nor while one was being written when it was read
+	fb_version *versions;
 
 	// max number of children for each node
 	size_t bfactor;
@@ -137,8 +485,157 @@ struct _fb_tree
 
 	// the root block
 	fb_pos root;
-}
-__attribute__((packed));
+
+	// first block of the list of freed blocks,
+	// threaded through the parent field of their headers
+	fb_pos free_head;
+
+	// number of blocks in the free list
+	size_t blocks_free;
+
+	// base of the long-lived mapping of the index file
+	// NULL when blocks are mapped one at a time
+	char *map_base;
+
+	// bytes of address space reserved for the mapping
+	size_t map_reserve;
+
+	// bytes of the index file currently mapped
+	size_t map_size;
+
+	// pool of frames holding the blocks in use
+	// NULL when blocks are mapped from the file
+	fb_pool *pool;
+
+	// latches of the blocks for concurrent use
+	// NULL when the tree is used by a single thread
+	fb_latches *latches;
+
+	// the last checkpoint written to the superblock
+	uint64_t epoch;
+
+	// whether the index file was not closed cleanly,
+	// until its log is replayed
+	bool recover;
+
+	// write-ahead log of the changes since the last checkpoint
+	// NULL when changes are durable only once the tree is destroyed
+	fb_log *log;
+};
+
+/**
+ * A node on the path of a cursor through its leaf block
+ */
+typedef struct _fb_cursor_level fb_cursor_level;
+struct _fb_cursor_level
+{
+	// the node, in the leaf block
+	fb_pos node_pos;
+
+	// the child being visited, or the next key on a leaf
+	size_t index;
+};
+
+/**
+ * An ordered scan over the leaves of the tree, keeping only
+ * the leaf block it reads loaded, and descending again
+ * from the root to reach the next one
+ */
+typedef struct _fb_cursor fb_cursor;
+struct _fb_cursor
+{
+	fb_tree *tree;
+
+	// the last key to return
+	fb_key hi;
+
+	// whether the scan reached its end
+	bool done;
+
+	// the current leaf block, loaded and latched while held
+	fb_block_data block;
+	bool held;
+
+	// the first key past the current leaf block, if it is not the last
+	fb_key bound;
+	bool bounded;
+
+	// the nodes from the root node of the leaf block to the current leaf
+	fb_cursor_level *levels;
+	size_t depth;
+};
+
+/**
+ * A consumer of the entries of a scan
+ * @param[in] keys The keys of the batch, in increasing order
+ * @param[in] values The heap offsets of the keys
+ * @param[in] count The number of entries in the batch
+ * @param[in] arg The argument given to fb_scan
+ * @return False to stop the scan
+ */
+typedef bool (*fb_scan_fn)(
+		const fb_key *keys,
+		const fb_value *values,
+		size_t count,
+		void *arg);
+
+/**
+ * A consumer of the data logged with fb_log_data, replayed after a crash
+ * @param[in] data The data as it was logged
+ * @param[in] size The size of the data
+ * @param[in] arg The argument given to fb_log_tree
+ */
+typedef void (*fb_replay_fn)(
+		const void *data,
+		size_t size,
+		void *arg);
+
+/**
+ * A reader of the tuple of a key missing from the cache
+ * @param[in] value The heap offset of the tuple
+ * @param[out] tuple Where to read the tuple
+ * @param[in,out] size The room in tuple, then the size of the tuple
+ * @param[in] arg The argument given to fb_retrieve_cached
+ * @return Whether to cache the tuple read
+ */
+typedef bool (*fb_fetch_fn)(
+		fb_value value,
+		void *tuple,
+		size_t *size,
+		void *arg);
+
+/**
+ * A writer of the tuple of a key being upserted, called with its leaf
+ * block latched; a tuple going over its older version is only logged,
+ * and written by the fb_write_fn of the upsert
+ * @param[in] old The heap offset of the tuple of the key,
+ *            NULL if the key is not in the tree yet
+ * @param[in] tuple The tuple to write
+ * @param[in] size The size of the tuple
+ * @param[in] arg The argument given to fb_upsert
+ * @return The heap offset where the tuple was written,
+ *         old to write it over its older version
+ */
+typedef fb_value (*fb_store_fn)(
+		const fb_value *old,
+		const void *tuple,
+		size_t size,
+		void *arg);
+
+/**
+ * A writer of a tuple over its older version, called once the leaf
+ * block of its key is released and what was logged is durable,
+ * in the order the upserts of the key were made
+ * @param[in] value The heap offset of the tuple
+ * @param[in] tuple The tuple to write
+ * @param[in] size The size of the tuple
+ * @param[in] arg The argument given to fb_upsert
+ */
+typedef void (*fb_write_fn)(
+		fb_value value,
+		const void *tuple,
+		size_t size,
+		void *arg);
 
 /**
  * Initialize a tree, allocating its resources
@@ -156,7 +653,105 @@ void fb_init_tree(
 		size_t bfactor);
 
 /**
- * Destroy a tree, releasing all its resources
+ * Open a tree stored by a previous fb_destr_tree, reading its
+ * state from the superblock instead of rebuilding it;
+ * a tree not destroyed cleanly must replay its log with
+ * fb_log_tree before any other call
+ * @param[out] tree The tree being opened
+ * @param[in] file The file where the tree is stored
+ * @param[in] block_size The size of a block, as the tree was created with
+ * @param[in] slot_size The size of a slot, as the tree was created with
+ * @param[in] bfactor The branching factor, as the tree was created with
+ * @param[in] logged Whether fb_log_tree follows, a tree not destroyed
+ *            cleanly is refused otherwise as it has nothing to replay
+ */
+void fb_open_tree(
+		fb_tree *tree,
+		const char *file,
+		size_t block_size,
+		size_t slot_size,
+		size_t bfactor,
+		bool logged);
+
+/**
+ * Keep the whole index file mapped for the lifetime of the tree,
+ * so that accessing a block needs no system call
+ * @param[in] tree The tree to map, already initialized
+ * @param[in] reserve The address space to reserve for the index file,
+ *            0 for CFB_MAP_RESERVE
+ */
+void fb_map_tree(
+		fb_tree *tree,
+		size_t reserve);
+
+/**
+ * Serve blocks from a buffer pool with a bounded memory budget,
+ * instead of mapping them from the index file
+ * @param[in] tree The tree to attach the pool to, already initialized
+ * @param[in] budget The memory the pool may use for blocks, in bytes
+ */
+void fb_pool_tree(
+		fb_tree *tree,
+		size_t budget);
+
+/**
+ * Allow concurrent lookups, inserts and deletes from several threads,
+ * latching blocks on the way down the tree
+ * @param[in] tree The tree to share, already initialized
+ */
+void fb_latch_tree(
+		fb_tree *tree);
+
+/**
+ * Log the changes to the tree ahead of the blocks they touch, so that
+ * they survive a crash, replaying the log first if the tree needs it
+ * @param[in] tree The tree to log, initialized or opened,
+ *            without a buffer pool if it needs replaying
+ * @param[in] file The file where to store the log
+ * @param[in] latency The longest a change waits to be written,
+ *            in microseconds, for other changes to share its sync
+ * @param[in] replay The consumer of the data logged with fb_log_data,
+ *            may be NULL
+ * @param[in] arg The argument to pass to replay
+ */
+void fb_log_tree(
+		fb_tree *tree,
+		const char *file,
+		size_t latency,
+		fb_replay_fn replay,
+		void *arg);
+
+/**
+ * Log data of the user of the tree, such as a tuple its next
+ * insert refers to, to be handed back on replay
+ * @param[in] tree The tree to log in, nothing is done without a log
+ * @param[in] data The data to log
+ * @param[in] size The size of the data
+ */
+void fb_log_data(
+		fb_tree *tree,
+		const void *data,
+		size_t size);
+
+/**
+ * Wait for the changes made so far to be durable,
+ * sharing one sync with the other threads committing
+ * @param[in] tree The tree to commit, nothing is done without a log
+ */
+void fb_commit(
+		fb_tree *tree);
+
+/**
+ * Write the blocks of the tree and start its log over,
+ * no other operation may run on the tree meanwhile
+ * @param[in] tree The tree to checkpoint, nothing is done without a log
+ */
+void fb_checkpoint(
+		fb_tree *tree);
+
+/**
+ * Destroy a tree, releasing all its resources,
+ * its index file can be opened again with fb_open_tree
  * @param[in] tree The tree to be destroyed
  */
 void fb_destr_tree(
@@ -183,6 +778,49 @@ void _fb_retrieve(
 		fb_pos *block_pos,
 		fb_pos *node_pos);
 
+/**
+ * Search for the file position of a tuple, recording the blocks
+ * on the way down, as _fb_insert needs them to split blocks
+ * @param[out] path The blocks from the root down to the leaf block,
+ *             room for CFB_MAX_DEPTH of them
+ * @param[out] depth The number of blocks of the path
+ */
+void _fb_retrieve_path(
+		fb_tree *tree,
+		fb_key key,
+		bool *exact,
+		fb_val *result,
+		fb_pos *path,
+		size_t *depth,
+		fb_pos *node_pos);
+
+/**
+ * Search for the file positions of many tuples at once, sharing
+ * the walk down the tree between the keys of the same subtree
+ * @param[in] tree The tree to search
+ * @param[in] keys The keys being searched for, in any order
+ * @param[in] count The number of keys
+ * @param[out] exact Whether each key is in the tree
+ * @param[out] results The position of the tuple of each key
+ */
+void fb_retrieve_batch(
+		fb_tree *tree,
+		const fb_key *keys,
+		size_t count,
+		bool *exact,
+		fb_val *results);
+
+/**
+ * @param[out] block_pos The leaf block of each key, may be NULL
+ */
+void _fb_retrieve_batch(
+		fb_tree *tree,
+		const fb_key *keys,
+		size_t count,
+		bool *exact,
+		fb_val *results,
+		fb_pos *block_pos);
+
 /**
  * Insert a new value in the tree
  * @param[in] tree The tree to which we are adding the value
@@ -194,25 +832,185 @@ void fb_insert(
 		fb_key key,
 		fb_val value);
 
+/**
+ * Insert at the place a lookup found for the key, without looking again
+ * @param[in] path The blocks down to the leaf of the key, as recorded
+ *            by _fb_retrieve_path, those that may split latched
+ * @param[in] depth The number of blocks of the path
+ */
 void _fb_insert(
 		fb_tree *tree,
 		fb_key key,
 		fb_val value,
 		bool exact,
-		fb_pos block_pos,
+		const fb_pos *path,
+		size_t depth,
 		fb_pos node_pos);
 /**
- * Try to add an entry to a block cache
+ * Remove a key from the tree, merging the nodes and blocks
+ * left underfull and recycling the freed ones
+ * @param[in] tree The tree to remove from
+ * @param[in] key The key to remove
+ * @param[out] value The value the key had, may be NULL
+ * @return True if the key was in the tree
+ */
+bool fb_delete(
+		fb_tree *tree,
+		fb_key key,
+		fb_val *value);
+
+/**
+ * Build a freshly initialized tree bottom-up from sorted entries,
+ * writing its blocks sequentially from the leaves to the root;
+ * it takes no latches, other threads must wait for it to end
+ * @param[in] tree The tree to fill, with no content yet
+ * @param[in] keys The keys, sorted and unique
+ * @param[in] values The heap offsets of the keys
+ * @param[in] count The number of entries
+ * @param[in] fill The fraction of each node to fill, in (0, 1],
+ *            leaving room for later inserts; with packed keys, entries
+ *            too far apart for a node are inserted one by one instead
+ */
+void fb_bulk_load(
+		fb_tree *tree,
+		const fb_key *keys,
+		const fb_value *values,
+		size_t count,
+		float fill);
+
+/**
+ * Position a cursor on the first key not below lo; the block
+ * of the current leaf stays latched, so the thread holding
+ * the cursor must not modify the tree until it is closed
+ * @param[in] tree The tree to scan
+ * @param[out] cursor The cursor to open
+ * @param[in] lo The first key of the range
+ * @param[in] hi The last key of the range, included
+ */
+void fb_cursor_open(
+		fb_tree *tree,
+		fb_cursor *cursor,
+		fb_key lo,
+		fb_key hi);
+
+/**
+ * Read the next entries of a scan
+ * @param[in] cursor The cursor to advance
+ * @param[out] keys The keys read, in increasing order
+ * @param[out] values The heap offsets of the keys read
+ * @param[in] batch The max number of entries to read
+ * @return The number of entries read, 0 at the end of the range
+ */
+size_t fb_cursor_next(
+		fb_cursor *cursor,
+		fb_key *keys,
+		fb_value *values,
+		size_t batch);
+
+/**
+ * Release the block held by a cursor
+ * @param[in] cursor The cursor to close
+ */
+void fb_cursor_close(
+		fb_cursor *cursor);
+
+/**
+ * Stream the entries of a key range in batches of CFB_SCAN_BATCH
+ * @param[in] tree The tree to scan
+ * @param[in] lo The first key of the range
+ * @param[in] hi The last key of the range, included
+ * @param[in] callback The consumer of the batches
+ * @param[in] arg Passed to the callback
+ * @return The number of entries handed to the callback
+ */
+size_t fb_scan(
+		fb_tree *tree,
+		fb_key lo,
+		fb_key hi,
+		fb_scan_fn callback,
+		void *arg);
+
+/**
+ * Sum the counters of the cache over all threads
+ * @param[in] tree The tree to use
+ * @param[out] stats The counters since the tree was opened or reset
+ */
+void fb_get_stats(
+		fb_tree *tree,
+		fb_stats *stats);
+
+/**
+ * Start the counters of the cache over
+ * @param[in] tree The tree to use
+ */
+void fb_reset_stats(
+		fb_tree *tree);
+
+/**
+ * Print how many cache slots the cache lookups looked into
+ * @param[in] tree The tree to use
+ */
+void fb_print_probes(
+		fb_tree *tree);
+
+/**
+ * Measure the shape of a tree in one pass over its blocks,
+ * only roughly while other threads change the tree
+ * @param[in] tree The tree to measure
+ * @param[out] shape The measures
+ * @param[in] json Where to also write the measures as JSON, or NULL
+ */
+void fb_tree_stats(
+		fb_tree *tree,
+		fb_shape *shape,
+		FILE *json);
+
+/**
+ * Choose how the full cache slots of a tree force entries out,
+ * CFB_CACHE_CLOCK unless set
+ * @param[in] tree The tree to use
+ * @param[in] policy CFB_CACHE_HASHED, CFB_CACHE_CLOCK or CFB_CACHE_LFU
+ */
+void fb_cache_policy(
+		fb_tree *tree,
+		uint8_t policy);
+
+/**
+ * Choose which tuples read on a miss get into the cache,
+ * CFB_ADMIT_ALL unless set
+ * @param[in] tree The tree to use
+ * @param[in] policy CFB_ADMIT_ALL or CFB_ADMIT_SECOND
+ */
+void fb_admit_policy(
+		fb_tree *tree,
+		uint8_t policy);
+
+/**
+ * Choose where the full nodes of a tree split,
+ * CFB_SPLIT_APPEND unless set
+ * @param[in] tree The tree to use
+ * @param[in] policy CFB_SPLIT_HALF or CFB_SPLIT_APPEND
+ */
+void fb_split_policy(
+		fb_tree *tree,
+		uint8_t policy);
+
+/**
+ * Try to add an entry to a block cache, tuples of any size
+ * up to a cache slot share the free slots of the block;
+ * the admission policy of the tree may keep it out
  * @param[in] tree The tree to use
  * @param[in] block_pos The block whose cache to access
  * @param[in] key The key to try to insert
  * @param[in] tuple The value corresponding to the key
+ * @param[in] size The size of the tuple
  */
 void fb_cache_add(
 		fb_tree *tree,
 		fb_pos block_pos,
 		fb_key key,
-		fb_tuple *tuple);
+		const void *tuple,
+		size_t size);
 
 /**
  * Check whether an entry is cached
@@ -220,13 +1018,113 @@ void fb_cache_add(
  * @param[in] block_pos The block whose cache to access
  * @param[in] key The key to probe
  * @param[out] tuple The value corresponding to the key, if found
+ * @param[in,out] size The room in tuple, then the size of the tuple
+ *                found; a larger tuple is not returned
  * @return True if the value was found and tuple was set
  */
 bool fb_cache_probe(
 		fb_tree *tree,
 		fb_pos block_pos,
 		fb_key key,
-		fb_tuple *tuple);
+		void *tuple,
+		size_t *size);
+
+/**
+ * Try to add entries to a block cache, loading the block once;
+ * the admission policy of the tree may keep them out, and so does
+ * a change of the tuple of a key since it was read
+ * @param[in] tree The tree to use
+ * @param[in] block_pos The block whose cache to access
+ * @param[in] keys The keys to try to insert
+ * @param[in] values The heap offsets the tuples were read from,
+ *            NULL to cache them whatever the keys now hold
+ * @param[in] versions The versions fb_cache_probe_batch gave for the keys
+ *            before their tuples were read, NULL along with values
+ * @param[in] tuples The values corresponding to the keys, stride bytes apart
+ * @param[in] stride The distance between two tuples
+ * @param[in] sizes The size of each tuple, NULL if all have stride bytes
+ * @param[in] count The number of entries
+ */
+void fb_cache_add_batch(
+		fb_tree *tree,
+		fb_pos block_pos,
+		const fb_key *keys,
+		const fb_value *values,
+		const uint64_t *versions,
+		const void *tuples,
+		size_t stride,
+		const size_t *sizes,
+		size_t count);
+
+/**
+ * Check whether entries are cached, loading the block once
+ * @param[in] tree The tree to use
+ * @param[in] block_pos The block whose cache to access
+ * @param[in] keys The keys to probe
+ * @param[out] tuples The values corresponding to the keys found,
+ *             stride bytes apart
+ * @param[in] stride The room for each tuple
+ * @param[out] sizes The size of each tuple found, may be NULL
+ * @param[out] hits Whether each key was found
+ * @param[out] versions The version of the tuple of each key, to hand
+ *             to fb_cache_add_batch along with the tuples read for
+ *             the keys missed, may be NULL
+ * @param[in] count The number of keys
+ * @return The number of keys found
+ */
+size_t fb_cache_probe_batch(
+		fb_tree *tree,
+		fb_pos block_pos,
+		const fb_key *keys,
+		void *tuples,
+		size_t stride,
+		size_t *sizes,
+		bool *hits,
+		uint64_t *versions,
+		size_t count);
+
+/**
+ * Search for the tuple of a key in the cache of its leaf block, walking
+ * down the tree once; on a miss the tuple is fetched and may be cached
+ * @param[in] tree The tree to search
+ * @param[in] key The key being searched for
+ * @param[out] tuple The tuple of the key, if found
+ * @param[in,out] size The room in tuple, then the size of the tuple
+ * @param[in] fetch Reads the tuple of a key missing from the cache
+ * @param[in] arg The argument given to fetch
+ * @return Whether the key is in the tree
+ */
+bool fb_retrieve_cached(
+		fb_tree *tree,
+		fb_key key,
+		void *tuple,
+		size_t *size,
+		fb_fetch_fn fetch,
+		void *arg);
+
+/**
+ * Insert a key or update its tuple, walking down the tree once;
+ * the cache entry of a key already in the tree is updated too,
+ * and a tuple going over its older version is written once the
+ * leaf block is released, not holding it through a log sync
+ * @param[in] tree The tree to change
+ * @param[in] key The key to insert or update
+ * @param[in] tuple The new tuple of the key
+ * @param[in] size The size of the tuple
+ * @param[in] store Writes the tuple elsewhere, or logs it to go
+ *            over its older version
+ * @param[in] write Writes the tuple over its older version
+ * @param[in] arg The argument given to store and write
+ * @return Whether the key was already in the tree
+ */
+bool fb_upsert(
+		fb_tree *tree,
+		fb_key key,
+		const void *tuple,
+		size_t size,
+		fb_store_fn store,
+		fb_write_fn write,
+		void *arg);
 
 /**
  * Try to replace an existing cache entry on tree insertion
@@ -234,12 +1132,14 @@ bool fb_cache_probe(
  * @param[in] block_pos The block whose cache to access
  * @param[in] key The key to try to replace, if cached
  * @param[in] tuple The new value to assign to the key
+ * @param[in] size The size of the new tuple
  */
 void fb_cache_replace(
 		fb_tree *tree,
 		fb_pos block_pos,
 		fb_key key,
-		fb_tuple *tuple);
+		const void *tuple,
+		size_t size);
 
 #endif
 
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,18 +18,163 @@ size_t content = 0;
 
 #define DB_FILE "db"
 #define INDEX_FILE "index"
+#define LOG_FILE "log"
+
+/**
+ * A tuple written to the heap, as logged ahead of its insert
+ */
+typedef struct _heap_record heap_record;
+struct _heap_record
+{
+	fb_value off;
+	fb_tuple tuple;
+}
+__attribute__((packed));
 
 void init(size_t block_size, size_t slot_size, size_t bfactor)
 {
 	dbfd = open(DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	assert(dbfd != -1);
+	content = 0;
 
 	fb_init_tree(&tree, INDEX_FILE, block_size, slot_size, bfactor);
 
 }
 
+void db_open(size_t block_size, size_t slot_size, size_t bfactor, bool logged)
+{
+	dbfd = open(DB_FILE, O_RDWR);
+	assert(dbfd != -1);
+
+	// the heap only grows, its tuples are packed from the start
+	struct stat st;
+	if (fstat(dbfd, &st))
+	{
+		fprintf(stderr, "ERROR: cannot stat heap file\n");
+		exit(EXIT_FAILURE);
+	}
+	content = st.st_size / sizeof(fb_tuple);
+
+	fb_open_tree(&tree, INDEX_FILE, block_size, slot_size, bfactor, logged);
+}
+
+/**
+ * Write again a tuple of the heap logged before a crash
+ */
+static void replay_tuple(const void *data, size_t size, void *arg)
+{
+	(void)arg;
+	assert(size == sizeof(heap_record));
+	const heap_record *record = data;
+	if (pwrite(dbfd, &record->tuple, sizeof(fb_tuple), record->off) != sizeof(fb_tuple))
+	{
+		fprintf(stderr, "ERROR: cannot write replayed tuple to heap\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void db_log(size_t latency)
+{
+	fb_log_tree(&tree, LOG_FILE, latency, replay_tuple, NULL);
+
+	// replayed tuples may lie past the heap written before the crash
+	struct stat st;
+	if (fstat(dbfd, &st))
+	{
+		fprintf(stderr, "ERROR: cannot stat heap file\n");
+		exit(EXIT_FAILURE);
+	}
+	content = st.st_size / sizeof(fb_tuple);
+}
+
+void db_commit()
+{
+	fb_commit(&tree);
+}
+
+void db_checkpoint()
+{
+	// the log of the tuples goes away with the checkpoint
+	fdatasync(dbfd);
+	fb_checkpoint(&tree);
+}
+
+void init_mapped(size_t block_size, size_t slot_size, size_t bfactor)
+{
+	init(block_size, slot_size, bfactor);
+	fb_map_tree(&tree, 0);
+}
+
+void init_pooled(size_t block_size, size_t slot_size, size_t bfactor, size_t budget)
+{
+	init(block_size, slot_size, bfactor);
+	fb_pool_tree(&tree, budget);
+}
+
+void init_latched(size_t block_size, size_t slot_size, size_t bfactor)
+{
+	init_mapped(block_size, slot_size, bfactor);
+	fb_latch_tree(&tree);
+}
+
+/**
+ * Log a tuple ahead of its write in the heap
+ */
+static void log_tuple(fb_value off, const fb_tuple *tuple)
+{
+	heap_record record;
+	record.off = off;
+	record.tuple = *tuple;
+	fb_log_data(&tree, &record, sizeof(heap_record));
+}
+
+/**
+ * Write a tuple in the heap, once logged; a tuple written over its
+ * older version waits for its record to be durable, which fb_upsert
+ * sees to, else a crash could leave the update on disk with the older
+ * version lost
+ */
+static void write_tuple(fb_value off, const void *tuple, size_t size, void *arg)
+{
+	(void)size;
+	(void)arg;
+	if (pwrite(dbfd, tuple, sizeof(fb_tuple), off) != sizeof(fb_tuple))
+	{
+		fprintf(stderr, "ERROR: cannot write tuple to heap\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Reserve room for a tuple at the end of the heap
+ * @return The offset of the tuple in the heap
+ */
+static fb_value append_tuple(fb_tuple *tuple)
+{
+	fb_value off = __atomic_fetch_add(&content, 1, __ATOMIC_RELAXED) * sizeof(fb_tuple);
+	log_tuple(off, tuple);
+	write_tuple(off, tuple, sizeof(fb_tuple), NULL);
+	return off;
+}
+
+/**
+ * Log a tuple to go over its older version in the heap, or append it
+ */
+static fb_value store_tuple(const fb_value *old, const void *tuple, size_t size, void *arg)
+{
+	(void)size;
+	(void)arg;
+	if (old == NULL)
+	{
+		return append_tuple((fb_tuple *)tuple);
+	}
+	log_tuple(*old, tuple);
+	return *old;
+}
+
 void destr()
 {
+	fdatasync(dbfd);
 	close(dbfd);
 
 	fb_destr_tree(&tree);
@@ -36,34 +182,51 @@ void destr()
 
 int insert_uncached(fb_key key, fb_tuple *tuple)
 {
-	lseek(dbfd, content * sizeof(fb_tuple), SEEK_SET);
-	write(dbfd, tuple, sizeof(fb_tuple));
 	fb_val val;
 	val.type = CFB_VALUE_TYPE_CNTNT;
-	val.value = content * sizeof(fb_tuple);
+	val.value = append_tuple(tuple);
 	fb_insert(&tree, key, val);
-	++content;
+	return 0;
+}
+
+int db_upsert(fb_key key, fb_tuple *tuple)
+{
+	fb_upsert(&tree, key, tuple, sizeof(fb_tuple), store_tuple, write_tuple, NULL);
 	return 0;
 }
 
 int insert_cached(fb_key key, fb_tuple *tuple)
 {
-	bool exact;
-	fb_val result;
-	fb_pos block_pos, node_pos;
-	if (tree.content > 0)
-	{
-		_fb_retrieve(&tree, key, &exact, &result, &block_pos, &node_pos);
-	}
-	
-	lseek(dbfd, content * sizeof(fb_tuple), SEEK_SET);
-	write(dbfd, tuple, sizeof(fb_tuple));
-	fb_val value;
-	value.type = CFB_VALUE_TYPE_CNTNT;
-	value.value = content * sizeof(fb_tuple);
-	_fb_insert(&tree, key, value, exact, block_pos, node_pos);
-	fb_cache_replace(&tree, block_pos, key, tuple);
-	++content;
+	return db_upsert(key, tuple);
+}
+
+int load_sorted(fb_key *keys, fb_tuple *tuples, size_t count, float fill)
+{
+	fb_value *offsets = malloc(count * sizeof(fb_value));
+	assert(offsets != NULL);
+	size_t first = __atomic_fetch_add(&content, count, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < count; ++i)
+	{
+		offsets[i] = (first + i) * sizeof(fb_tuple);
+	}
+
+	// the tuples go to the heap in one sequential write
+	ssize_t size = count * sizeof(fb_tuple);
+	if (pwrite(dbfd, tuples, size, first * sizeof(fb_tuple)) != size)
+	{
+		fprintf(stderr, "ERROR: cannot write tuples to heap\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		heap_record record;
+		record.off = offsets[i];
+		record.tuple = tuples[i];
+		fb_log_data(&tree, &record, sizeof(heap_record));
+	}
+	fb_bulk_load(&tree, keys, offsets, count, fill);
+
+	free(offsets);
 	return 0;
 }
 
@@ -79,36 +242,237 @@ int search_uncached(fb_key key, fb_tuple *tuple)
 	}
 	else
 	{
-		lseek(dbfd, result.value, SEEK_SET);
-		read(dbfd, tuple, sizeof(fb_tuple));
+		pread(dbfd, tuple, sizeof(fb_tuple), result.value);
 		return 0;
 	}
 }
 
+/**
+ * Read a tuple of the heap missing from the cache, caching it
+ */
+static bool fetch_tuple(fb_value off, void *tuple, size_t *size, void *arg)
+{
+	(void)arg;
+	pread(dbfd, tuple, sizeof(fb_tuple), off);
+	*size = sizeof(fb_tuple);
+	return true;
+}
+
 int search_cached(fb_key key, fb_tuple *tuple)
 {
-	bool exact;
-	fb_val result;
-	fb_pos block_pos, node_pos;
-	_fb_retrieve(&tree, key, &exact, &result, &block_pos, &node_pos);
-	if (!exact)
+	size_t size = sizeof(fb_tuple);
+	return fb_retrieve_cached(&tree, key, tuple, &size, fetch_tuple, NULL) ? 0 : -1;
+}
+
+int remove_key(fb_key key)
+{
+	// the heap is append only, the tuple simply becomes unreachable
+	return fb_delete(&tree, key, NULL) ? 0 : -1;
+}
+
+size_t scan_uncached(fb_key lo, fb_key hi, void (*callback)(fb_tuple *tuple, void *arg), void *arg)
+{
+	fb_key keys[CFB_SCAN_BATCH];
+	fb_value offsets[CFB_SCAN_BATCH];
+	fb_tuple tuple;
+	size_t total = 0;
+
+	fb_cursor cursor;
+	fb_cursor_open(&tree, &cursor, lo, hi);
+	size_t count;
+	while ((count = fb_cursor_next(&cursor, keys, offsets, CFB_SCAN_BATCH)) > 0)
 	{
-		return -1;
+		for (size_t i = 0; i < count; ++i)
+		{
+			pread(dbfd, &tuple, sizeof(fb_tuple), offsets[i]);
+			callback(&tuple, arg);
+		}
+		total += count;
 	}
-	else
+	fb_cursor_close(&cursor);
+	return total;
+}
+
+/**
+ * An entry of a batch, sorted by heap offset or by leaf block
+ */
+typedef struct _db_item db_item;
+struct _db_item
+{
+	uint64_t pos;
+	uint32_t index;
+};
+
+static int cmp_item(const void *a, const void *b)
+{
+	uint64_t x = ((const db_item *)a)->pos;
+	uint64_t y = ((const db_item *)b)->pos;
+	return (x > y) - (x < y);
+}
+
+static void *alloc_batch(size_t count, size_t size)
+{
+	// never ask malloc for 0 bytes
+	void *ptr = malloc(count * size + 1);
+	assert(ptr != NULL);
+	return ptr;
+}
+
+/**
+ * Read tuples from the heap in file order, one read per run of
+ * adjacent tuples, after hinting the kernel about all of them
+ */
+static void read_batch(db_item *reads, size_t count, fb_tuple *tuples)
+{
+	qsort(reads, count, sizeof(db_item), cmp_item);
+
+	size_t runs = 0;
+	size_t *run_end = alloc_batch(count, sizeof(size_t));
+	for (size_t r = 0; r < count; ++r)
+	{
+		if (r + 1 == count || (reads[r+1].pos != reads[r].pos
+				&& reads[r+1].pos != reads[r].pos + sizeof(fb_tuple)))
+		{
+			run_end[runs++] = r + 1;
+		}
+	}
+
+	size_t start = 0;
+	for (size_t r = 0; r < runs; ++r)
+	{
+		off_t first = reads[start].pos;
+		off_t last = reads[run_end[r] - 1].pos + sizeof(fb_tuple);
+		posix_fadvise(dbfd, first, last - first, POSIX_FADV_WILLNEED);
+		start = run_end[r];
+	}
+
+	fb_tuple *buffer = alloc_batch(count, sizeof(fb_tuple));
+	start = 0;
+	for (size_t r = 0; r < runs; ++r)
 	{
-		if (fb_cache_probe(&tree, block_pos, key, tuple))
+		off_t first = reads[start].pos;
+		off_t last = reads[run_end[r] - 1].pos + sizeof(fb_tuple);
+		pread(dbfd, buffer, last - first, first);
+		for (size_t i = start; i < run_end[r]; ++i)
 		{
-			//printf("cached!\n");
-			return 0;
+			tuples[reads[i].index] = buffer[(reads[i].pos - first) / sizeof(fb_tuple)];
 		}
-		else
+		start = run_end[r];
+	}
+
+	free(buffer);
+	free(run_end);
+}
+
+size_t search_uncached_batch(fb_key *keys, size_t count, fb_tuple *tuples, bool *found)
+{
+	fb_val *results = alloc_batch(count, sizeof(fb_val));
+	db_item *reads = alloc_batch(count, sizeof(db_item));
+	fb_retrieve_batch(&tree, keys, count, found, results);
+
+	size_t hits = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (found[i])
 		{
-			lseek(dbfd, result.value, SEEK_SET);
-			read(dbfd, tuple, sizeof(fb_tuple));
-			fb_cache_add(&tree, block_pos, key, tuple);
-			return 0;
+			reads[hits].pos = results[i].value;
+			reads[hits].index = i;
+			++hits;
 		}
 	}
+	read_batch(reads, hits, tuples);
+
+	free(reads);
+	free(results);
+	return hits;
 }
 
+size_t search_cached_batch(fb_key *keys, size_t count, fb_tuple *tuples, bool *found)
+{
+	fb_val *results = alloc_batch(count, sizeof(fb_val));
+	fb_pos *blocks = alloc_batch(count, sizeof(fb_pos));
+	bool *cached = alloc_batch(count, sizeof(bool));
+	db_item *order = alloc_batch(count, sizeof(db_item));
+	db_item *reads = alloc_batch(count, sizeof(db_item));
+	fb_key *run_keys = alloc_batch(count, sizeof(fb_key));
+	fb_tuple *run_tuples = alloc_batch(count, sizeof(fb_tuple));
+	uint64_t *versions = alloc_batch(count, sizeof(uint64_t));
+	fb_value *run_values = alloc_batch(count, sizeof(fb_value));
+	uint64_t *run_versions = alloc_batch(count, sizeof(uint64_t));
+	_fb_retrieve_batch(&tree, keys, count, found, results, blocks);
+
+	// the keys found in the tree, grouped by leaf block
+	size_t hits = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (found[i])
+		{
+			order[hits].pos = blocks[i];
+			order[hits].index = i;
+			++hits;
+		}
+	}
+	qsort(order, hits, sizeof(db_item), cmp_item);
+
+	// probe each block once for all its keys
+	size_t misses = 0;
+	for (size_t start = 0, end; start < hits; start = end)
+	{
+		for (end = start; end < hits && order[end].pos == order[start].pos; ++end)
+		{
+			run_keys[end - start] = keys[order[end].index];
+		}
+		fb_cache_probe_batch(&tree, order[start].pos, run_keys, run_tuples, sizeof(fb_tuple),
+				NULL, cached + start, versions + start, end - start);
+		for (size_t i = start; i < end; ++i)
+		{
+			uint32_t index = order[i].index;
+			if (cached[i])
+			{
+				tuples[index] = run_tuples[i - start];
+			}
+			else
+			{
+				reads[misses].pos = results[index].value;
+				reads[misses].index = index;
+				++misses;
+			}
+		}
+	}
+	read_batch(reads, misses, tuples);
+
+	// cache what was read from the heap, each block once, unless
+	// the tuple changed since its block was probed
+	for (size_t start = 0, end; start < hits; start = end)
+	{
+		size_t n = 0;
+		for (end = start; end < hits && order[end].pos == order[start].pos; ++end)
+		{
+			if (!cached[end])
+			{
+				run_keys[n] = keys[order[end].index];
+				run_values[n] = results[order[end].index].value;
+				run_versions[n] = versions[end];
+				run_tuples[n] = tuples[order[end].index];
+				++n;
+			}
+		}
+		if (n > 0)
+		{
+			fb_cache_add_batch(&tree, order[start].pos, run_keys, run_values, run_versions,
+					run_tuples, sizeof(fb_tuple), NULL, n);
+		}
+	}
+
+	free(run_versions);
+	free(run_values);
+	free(versions);
+	free(run_tuples);
+	free(run_keys);
+	free(reads);
+	free(order);
+	free(cached);
+	free(blocks);
+	free(results);
+	return hits;
+}
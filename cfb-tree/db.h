@@ -7,14 +7,31 @@
 #include "cfb_tree.h"
 
 void init(size_t block_size, size_t slot_size, size_t bfactor);
+void init_mapped(size_t block_size, size_t slot_size, size_t bfactor);
+void init_pooled(size_t block_size, size_t slot_size, size_t bfactor, size_t budget);
+void init_latched(size_t block_size, size_t slot_size, size_t bfactor);
+void db_open(size_t block_size, size_t slot_size, size_t bfactor, bool logged);
+void db_log(size_t latency);
+
+void db_commit();
+void db_checkpoint();
 
 void destr();
 
 int insert_cached(fb_key key, fb_tuple *tuple);
 int insert_uncached(fb_key key, fb_tuple *tuple);
+int db_upsert(fb_key key, fb_tuple *tuple);
+int load_sorted(fb_key *keys, fb_tuple *tuples, size_t count, float fill);
 
 int search_cached(fb_key key, fb_tuple *t);
 int search_uncached(fb_key key, fb_tuple *t);
 
+size_t search_cached_batch(fb_key *keys, size_t count, fb_tuple *tuples, bool *found);
+size_t search_uncached_batch(fb_key *keys, size_t count, fb_tuple *tuples, bool *found);
+
+int remove_key(fb_key key);
+
+size_t scan_uncached(fb_key lo, fb_key hi, void (*callback)(fb_tuple *tuple, void *arg), void *arg);
+
 #endif
 
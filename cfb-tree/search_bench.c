@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cfb_search.h"
+
+// node sizes of the figures in the paper
+static const size_t bfactors[] = { 6, 12, 24, 48 };
+
+#define BENCH_NODES (4096)
+#define BENCH_LOOKUPS (4000000)
+
+typedef struct _bench_kernel bench_kernel;
+struct _bench_kernel
+{
+	const char *name;
+	fb_search_fn fn;
+};
+
+static const bench_kernel kernels[] = {
+	{ "linear", fb_search_linear },
+	{ "branchless", fb_search_branchless },
+	{ "sse", fb_search_sse },
+	{ "avx2", fb_search_avx2 },
+};
+
+#if CFB_KEY_DELTA_BITS
+typedef struct _bench_delta_kernel bench_delta_kernel;
+struct _bench_delta_kernel
+{
+	const char *name;
+	fb_search_delta_fn fn;
+};
+
+static const bench_delta_kernel delta_kernels[] = {
+	{ "delta linear", fb_search_delta_linear },
+	{ "delta branchless", fb_search_delta_branchless },
+	{ "delta sse", fb_search_delta_sse },
+	{ "delta avx2", fb_search_delta_avx2 },
+};
+
+// keys of a node in reach of the deltas from a base, the sign bit set
+#define BENCH_BASE ((fb_key)1 << (CFB_KEY_BITS - 1))
+#endif
+
+static int cmp_key(const void *a, const void *b)
+{
+	fb_key x = *(const fb_key *)a;
+	fb_key y = *(const fb_key *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * A random key over the whole width, sign bit included,
+ * or in reach of the deltas of a node past its base
+ */
+static fb_key rand_key(void)
+{
+	fb_key key = 0;
+	for (int bits = 0; bits < CFB_KEY_BITS; bits += 16)
+	{
+		key = (key << 16) ^ (fb_key)(rand() & 0xffff);
+	}
+#if CFB_KEY_DELTA_BITS
+	key = BENCH_BASE + 1 + key % CFB_KEY_DELTA_MAX;
+#endif
+	return key;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+	printf("dispatch picks %s for %d-bit keys\n", fb_search_select(), CFB_KEY_BITS);
+#if CFB_KEY_DELTA_BITS
+	printf("keys packed as %d-bit deltas from a base of the node\n", CFB_KEY_DELTA_BITS);
+#endif
+
+	fb_key *probes = malloc(BENCH_LOOKUPS * sizeof(fb_key));
+	for (size_t l = 0; l < BENCH_LOOKUPS; ++l)
+	{
+		probes[l] = rand_key();
+	}
+
+	for (size_t b = 0; b < sizeof(bfactors) / sizeof(bfactors[0]); ++b)
+	{
+		// a full node holds kfactor keys before splitting
+		size_t cont = bfactors[b] - 1;
+		fb_key *nodes = malloc(BENCH_NODES * cont * sizeof(fb_key));
+		for (size_t n = 0; n < BENCH_NODES; ++n)
+		{
+			for (size_t k = 0; k < cont; ++k)
+			{
+				// half of the lookups are exact matches
+				nodes[n * cont + k] = probes[(n * cont + k) % BENCH_LOOKUPS] - (k & 1);
+			}
+			qsort(nodes + n * cont, cont, sizeof(fb_key), cmp_key);
+		}
+
+		size_t reference = 0;
+		for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+		{
+			struct timespec start, end;
+			size_t checksum = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (size_t l = 0; l < BENCH_LOOKUPS; ++l)
+			{
+				const fb_key *node = nodes + (l % BENCH_NODES) * cont;
+				checksum += kernels[k].fn(node, cont, probes[l]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			if (k == 0)
+			{
+				reference = checksum;
+			}
+			printf("Search node [B: %zu, K: %s, %zu key bytes] ==> %.2f ns%s\n",
+					bfactors[b], kernels[k].name, cont * sizeof(fb_key),
+					elapsed_ns(&start, &end) / BENCH_LOOKUPS,
+					checksum == reference ? "" : " MISMATCH");
+		}
+
+#if CFB_KEY_DELTA_BITS
+		// the same nodes packed, searched the way the tree does
+		fb_delta *deltas = malloc(BENCH_NODES * cont * sizeof(fb_delta));
+		for (size_t n = 0; n < BENCH_NODES * cont; ++n)
+		{
+			deltas[n] = nodes[n] - BENCH_BASE;
+		}
+		for (size_t k = 0; k < sizeof(delta_kernels) / sizeof(delta_kernels[0]); ++k)
+		{
+			struct timespec start, end;
+			size_t checksum = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (size_t l = 0; l < BENCH_LOOKUPS; ++l)
+			{
+				const fb_delta *node = deltas + (l % BENCH_NODES) * cont;
+				fb_key key = probes[l];
+				if (key < BENCH_BASE)
+				{
+					continue;
+				}
+				checksum += key - BENCH_BASE > CFB_KEY_DELTA_MAX ? cont
+						: delta_kernels[k].fn(node, cont, key - BENCH_BASE);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			printf("Search node [B: %zu, K: %s, %zu key bytes] ==> %.2f ns%s\n",
+					bfactors[b], delta_kernels[k].name, sizeof(fb_key) + cont * sizeof(fb_delta),
+					elapsed_ns(&start, &end) / BENCH_LOOKUPS,
+					checksum == reference ? "" : " MISMATCH");
+		}
+		free(deltas);
+#endif
+		free(nodes);
+	}
+
+	free(probes);
+	return EXIT_SUCCESS;
+}
+
@@ -1,9 +1,16 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "db.h"
+#include "cfb_log.h"
+#include "cfb_pool.h"
 #include "cfb_tree.h"
 
 
@@ -42,11 +49,1135 @@ void test_fb_insert(fb_tree *tree, fb_key key, uint32_t val)
 	//printf("fb_insert: key %i | val: %u\n", key, val);
 }*/
 
+void check_scan(fb_tuple *tuple, void *arg)
+{
+	// keys come in order, skipping the removed ones
+	fb_key *next = arg;
+	if (*next % 4 == 0)
+	{
+		++*next;
+	}
+	if (tuple->id != *next)
+	{
+		printf("MISSED\n");
+	}
+	++*next;
+}
+
+/**
+ * Cache rows of many sizes in the leaves of a tree of their own,
+ * a row cached must come back whole
+ * @param[in] policy The replacement policy of the cache
+ * @return The number of rows missed or mangled
+ */
+int test_cache_sizes(long block_size, long slot_size, long bfactor, uint8_t policy)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_cache_policy(&cache_tree, policy);
+	int keys = 2000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+	}
+
+	int missed = 0;
+	int hits = 0;
+	char row[400], back[400];
+	for (int round = 0; round < 2; ++round)
+	{
+		// the second round reads the rows still cached, in another order
+		for (int i = 0; i < keys; ++i)
+		{
+			int k = round ? i * 7 % keys : i;
+			size_t size = 1 + k * 37 % sizeof(row);
+			bool exact;
+			fb_val result;
+			fb_pos block_pos, node_pos;
+			_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+			if (round == 0)
+			{
+				memset(row, k, size);
+				fb_cache_add(&cache_tree, block_pos, k, row, size);
+			}
+			size_t room = sizeof(back);
+			if (fb_cache_probe(&cache_tree, block_pos, k, back, &room))
+			{
+				memset(row, k, size);
+				bool fits = sizeof(fb_cache_h) + size <= cache_tree.cache_size;
+				missed += !fits || room != size || memcmp(row, back, size) != 0;
+				++hits;
+			}
+		}
+	}
+	missed += hits == 0;
+
+	// every lookup counted once, and the counters start over on reset
+	fb_stats stats;
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.probes != 2u * keys || stats.hits != (uint64_t)hits
+			|| stats.hits + stats.misses != stats.probes || stats.inserts == 0;
+	fb_reset_stats(&cache_tree);
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.probes != 0 || stats.inserts != 0;
+
+	// the walk finds every key, and the slots of every block
+	fb_shape shape;
+	FILE *json = tmpfile();
+	fb_tree_stats(&cache_tree, &shape, json);
+	missed += shape.keys != (size_t)keys || shape.key_min != 0 || shape.key_max != (fb_key)keys - 1
+			|| shape.node_slots + shape.cache_slots != shape.blocks * cache_tree.block_slots
+			|| shape.cache_entries == 0 || shape.cache_used > shape.cache_capacity
+			|| json == NULL || ftell(json) == 0;
+	if (json != NULL)
+	{
+		fclose(json);
+	}
+	fb_destr_tree(&cache_tree);
+	return missed;
+}
+
+/**
+ * Cache the rows of the even keys of a tree mapped block by block,
+ * read half of them, then cache the rows of the odd keys: under CLOCK,
+ * the rows read must outlive the others, as their reads reach the file
+ * @return The number of checks missed
+ */
+int test_cache_clock(long block_size, long slot_size, long bfactor)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_cache_policy(&cache_tree, CFB_CACHE_CLOCK);
+	int keys = 2000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+	}
+
+	// the even keys about fill the cache slots, two rows at least to a slot
+	fb_shape shape;
+	fb_tree_stats(&cache_tree, &shape, NULL);
+	size_t rows = keys / 2 / shape.cache_slots + 1;
+	rows = rows < 2 ? 2 : rows;
+	char row[400];
+	size_t size = cache_tree.cache_size / rows - sizeof(fb_cache_h);
+	size = size < sizeof(row) ? size : sizeof(row);
+	memset(row, 0, sizeof(row));
+
+	// rows cached before the odd keys come, then after, untouched first
+	int before[2] = {0, 0};
+	int after[2] = {0, 0};
+	for (int pass = 0; pass < 4; ++pass)
+	{
+		if (pass == 2)
+		{
+			fb_tree_stats(&cache_tree, &shape, NULL);
+			before[0] = shape.cache_entries - before[1];
+		}
+		for (int k = pass == 2 ? 1 : 0; k < keys; k += 2)
+		{
+			bool exact;
+			fb_val result;
+			fb_pos block_pos, node_pos;
+			_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+			size_t room = sizeof(row);
+			if (pass == 0 || pass == 2)
+			{
+				fb_cache_add(&cache_tree, block_pos, k, row, size);
+			}
+			else if (pass == 1 && k % 4 == 0)
+			{
+				before[1] += fb_cache_probe(&cache_tree, block_pos, k, row, &room);
+			}
+			else if (pass == 3)
+			{
+				after[k % 4 == 0] += fb_cache_probe(&cache_tree, block_pos, k, row, &room);
+			}
+		}
+	}
+	fb_destr_tree(&cache_tree);
+
+	// the touched rows lose at most half the share the others lose
+	return 2 * (before[1] - after[1]) * before[0] > (before[0] - after[0]) * before[1];
+}
+
+/**
+ * Note the cache entries of a mapped block
+ * @param[out] counts The read count of each key, -1 if not cached
+ * @param[out] slots The slot caching each key
+ */
+void lfu_entries(fb_tree *tree, fb_pos block_pos, int *counts, size_t *slots, int keys)
+{
+	fb_block_h *block = (fb_block_h *)(tree->map_base + (size_t)block_pos * tree->block_size);
+	for (int k = 0; k < keys; ++k)
+	{
+		counts[k] = -1;
+	}
+	for (size_t i = 0; i < tree->block_slots; ++i)
+	{
+		fb_slot_h *slot = (fb_slot_h *)((char *)block + tree->slots_off + i * tree->slot_size);
+		if (slot->type == CFB_SLOT_TYPE_CACHE)
+		{
+			fb_cache_h *dir = (fb_cache_h *)slot->body;
+			for (size_t j = 0; j < slot->cont; ++j)
+			{
+				counts[dir[j].key] = dir[j].ref;
+				slots[dir[j].key] = i;
+			}
+		}
+	}
+}
+
+/**
+ * Cache the rows of the even keys of a mapped tree under LFU, read
+ * each a few times, then cache the rows of the odd keys: a row forced
+ * out must be one of the least read of its slot, and the others of its
+ * slot must age by its count, wherever they lie in the slot
+ * @return The number of checks missed
+ */
+int test_cache_lfu(long block_size, long slot_size, long bfactor)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_map_tree(&cache_tree, 0);
+	fb_cache_policy(&cache_tree, CFB_CACHE_LFU);
+	int keys = 2000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+	}
+
+	// the even keys about fill the cache slots, two rows at least to a slot
+	fb_shape shape;
+	fb_tree_stats(&cache_tree, &shape, NULL);
+	size_t rows = keys / 2 / shape.cache_slots + 1;
+	rows = rows < 2 ? 2 : rows;
+	char row[400];
+	size_t size = cache_tree.cache_size / rows - sizeof(fb_cache_h);
+	size = size < sizeof(row) ? size : sizeof(row);
+	memset(row, 0, sizeof(row));
+
+	int missed = 0;
+	int *before = malloc(keys * sizeof(int));
+	int *after = malloc(keys * sizeof(int));
+	size_t *slots = malloc(keys * sizeof(size_t));
+	size_t *placed = malloc(keys * sizeof(size_t));
+	for (int k = 0; k < keys; k += 2)
+	{
+		bool exact;
+		fb_val result;
+		fb_pos block_pos, node_pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+		fb_cache_add(&cache_tree, block_pos, k, row, size);
+		for (int r = 0; r < 1 + k / 2 % 4; ++r)
+		{
+			size_t room = sizeof(row);
+			fb_cache_probe(&cache_tree, block_pos, k, row, &room);
+		}
+	}
+	for (int k = 1; k < keys; k += 2)
+	{
+		bool exact;
+		fb_val result;
+		fb_pos block_pos, node_pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+		lfu_entries(&cache_tree, block_pos, before, slots, keys);
+		fb_cache_add(&cache_tree, block_pos, k, row, size);
+		lfu_entries(&cache_tree, block_pos, after, placed, keys);
+		// rows of one size, a new row forces one row out at most
+		int victim = -1;
+		for (int j = 0; j < keys; ++j)
+		{
+			if (before[j] >= 0 && after[j] < 0)
+			{
+				missed += victim >= 0;
+				victim = j;
+			}
+		}
+		if (victim < 0)
+		{
+			continue;
+		}
+
+		// the rows left in the slot of the victim age by its count,
+		// the rows of the other slots stay as they were
+		for (int j = 0; j < keys; ++j)
+		{
+			if (j == victim || before[j] < 0)
+			{
+				continue;
+			}
+			missed += after[j] < 0 || placed[j] != slots[j];
+			if (slots[j] != slots[victim])
+			{
+				missed += after[j] != before[j];
+				continue;
+			}
+			missed += before[j] < before[victim] || after[j] != before[j] - before[victim];
+		}
+	}
+	free(placed);
+	free(slots);
+	free(after);
+	free(before);
+	fb_destr_tree(&cache_tree);
+	return missed;
+}
+
+/**
+ * Read the row of a key missing from the cache, its heap offset
+ */
+bool fetch_row(fb_value value, void *tuple, size_t *size, void *arg)
+{
+	(void)arg;
+	memcpy(tuple, &value, sizeof(fb_value));
+	*size = sizeof(fb_value);
+	return true;
+}
+
+#define RACE_KEYS (64)
+
+/**
+ * The rows of test_cache_race, each key at its own offset
+ */
+fb_value race_heap[RACE_KEYS];
+
+/**
+ * Keep a row at the offset of its older version
+ */
+fb_value store_race(const fb_value *old, const void *tuple, size_t size, void *arg)
+{
+	(void)tuple;
+	(void)size;
+	(void)arg;
+	return *old;
+}
+
+/**
+ * Write a row over its older version
+ */
+void write_race(fb_value value, const void *tuple, size_t size, void *arg)
+{
+	(void)size;
+	(void)arg;
+	memcpy(race_heap + value, tuple, sizeof(fb_value));
+}
+
+/**
+ * Read a row, then upsert it before the reader caches the row read,
+ * as a writer could while the leaf block is not latched
+ * @param[in] arg The tree to upsert the row in, NULL to only read it
+ */
+bool fetch_race(fb_value value, void *tuple, size_t *size, void *arg)
+{
+	memcpy(tuple, race_heap + value, sizeof(fb_value));
+	*size = sizeof(fb_value);
+	if (arg != NULL)
+	{
+		fb_value row = race_heap[value] + RACE_KEYS;
+		fb_upsert(arg, value, &row, sizeof(row), store_race, write_race, NULL);
+	}
+	return true;
+}
+
+/**
+ * Update rows of a shared tree between a miss and the caching of the
+ * row it read, alone and in batches: the older rows must stay out
+ * @return The number of checks missed
+ */
+int test_cache_race(long block_size, long slot_size, long bfactor)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_map_tree(&cache_tree, 0);
+	fb_latch_tree(&cache_tree);
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < RACE_KEYS; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+		race_heap[k] = k;
+	}
+
+	int missed = 0;
+	fb_value row;
+	size_t size;
+	for (int k = 0; k < RACE_KEYS / 2; ++k)
+	{
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_race, &cache_tree) || row != (fb_value)k;
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_race, NULL) || row != (fb_value)k + RACE_KEYS;
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_race, NULL) || row != (fb_value)k + RACE_KEYS;
+	}
+
+	// the second half goes through the batches
+	fb_key keys[RACE_KEYS / 2];
+	fb_value values[RACE_KEYS / 2];
+	fb_value rows[RACE_KEYS / 2];
+	uint64_t versions[RACE_KEYS / 2];
+	bool hits[RACE_KEYS / 2];
+	bool exact;
+	fb_val result;
+	fb_pos block_pos, node_pos;
+	_fb_retrieve(&cache_tree, RACE_KEYS / 2, &exact, &result, &block_pos, &node_pos);
+	size_t count = 0;
+	for (int k = RACE_KEYS / 2; k < RACE_KEYS; ++k)
+	{
+		fb_pos pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &pos, &node_pos);
+		if (pos == block_pos)
+		{
+			keys[count] = k;
+			values[count] = result.value;
+			++count;
+		}
+	}
+	fb_cache_probe_batch(&cache_tree, block_pos, keys, rows, sizeof(fb_value), NULL, hits, versions, count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		missed += hits[i];
+		rows[i] = race_heap[values[i]];
+		fb_value newer = rows[i] + RACE_KEYS;
+		fb_upsert(&cache_tree, keys[i], &newer, sizeof(newer), store_race, write_race, NULL);
+	}
+	fb_cache_add_batch(&cache_tree, block_pos, keys, values, versions, rows, sizeof(fb_value), NULL, count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		size = sizeof(row);
+		missed += fb_cache_probe(&cache_tree, block_pos, keys[i], &row, &size);
+	}
+	missed += count == 0;
+	fb_destr_tree(&cache_tree);
+	return missed;
+}
+
+/**
+ * The log sequence number the row being upserted is durable at
+ */
+uint64_t pending_lsn;
+
+/**
+ * Log a row to go over its older version
+ * @param[in] arg The tree logging the row
+ */
+fb_value store_pending(const fb_value *old, const void *tuple, size_t size, void *arg)
+{
+	fb_tree *tree = arg;
+	fb_log_data(tree, tuple, size);
+	pending_lsn = fb_log_mark(tree->log);
+	return *old;
+}
+
+/**
+ * Read a row while it is being upserted, then write it once durable
+ * @param[in] arg The tree the row is upserted in
+ */
+void write_pending(fb_value value, const void *tuple, size_t size, void *arg)
+{
+	fb_tree *tree = arg;
+	fb_value row;
+	size_t room = sizeof(row);
+	if (__atomic_load_n(&tree->log->durable, __ATOMIC_ACQUIRE) >= pending_lsn
+			&& fb_retrieve_cached(tree, value, &row, &room, fetch_race, NULL)
+			&& row == race_heap[value])
+	{
+		write_race(value, tuple, size, NULL);
+	}
+}
+
+/**
+ * Upsert rows of a logged, shared tree: each row must be durable and
+ * its leaf block released when written, and the older row read by a
+ * miss meanwhile must stay out of the cache
+ * @return The number of checks missed
+ */
+int test_upsert_pending(long block_size, long slot_size, long bfactor)
+{
+	unlink("index.cache.log");
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_map_tree(&cache_tree, 0);
+	fb_latch_tree(&cache_tree);
+	fb_log_tree(&cache_tree, "index.cache.log", 1000, NULL, NULL);
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < RACE_KEYS; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+		race_heap[k] = k;
+	}
+
+	int missed = 0;
+	for (int k = 0; k < RACE_KEYS; ++k)
+	{
+		fb_value row = k + RACE_KEYS;
+		missed += !fb_upsert(&cache_tree, k, &row, sizeof(row), store_pending, write_pending, &cache_tree);
+		missed += race_heap[k] != row;
+
+		bool exact;
+		fb_val result;
+		fb_pos block_pos, node_pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+		size_t size = sizeof(row);
+		missed += fb_cache_probe(&cache_tree, block_pos, k, &row, &size);
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_race, NULL) || row != (fb_value)k + RACE_KEYS;
+	}
+	fb_destr_tree(&cache_tree);
+	unlink("index.cache.log");
+	return missed;
+}
+
+/**
+ * Sweep once over the keys of a tree, then read a few keys again:
+ * the sweep must leave most of its rows out of the cache,
+ * and the keys read again must get in
+ * @return The number of checks missed
+ */
+int test_cache_admission(long block_size, long slot_size, long bfactor)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_admit_policy(&cache_tree, CFB_ADMIT_SECOND);
+	int keys = 2000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+	}
+
+	int missed = 0;
+	fb_value row;
+	size_t size;
+	for (int k = 0; k < keys; ++k)
+	{
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+	}
+	fb_stats stats;
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.rejections < stats.inserts;
+
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int k = 0; k < 10; ++k)
+		{
+			size = sizeof(row);
+			missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+		}
+	}
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.hits == 0;
+	fb_destr_tree(&cache_tree);
+	return missed;
+}
+
+/**
+ * Read cached rows of a logged tree after a checkpoint:
+ * the reference bits a hit sets must not grow the log
+ * @return The number of checks missed
+ */
+int test_cache_probe_log(long block_size, long slot_size, long bfactor)
+{
+	unlink("index.cache.log");
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_log_tree(&cache_tree, "index.cache.log", 1000, NULL, NULL);
+	int keys = 500;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+		bool exact;
+		fb_val result;
+		fb_pos block_pos, node_pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+		fb_value row = k;
+		fb_cache_add(&cache_tree, block_pos, k, &row, sizeof(row));
+	}
+	fb_checkpoint(&cache_tree);
+
+	int missed = 0;
+	int hits = 0;
+	struct stat before, after;
+	missed += stat("index.cache.log", &before) != 0;
+	for (int k = 0; k < keys; ++k)
+	{
+		bool exact;
+		fb_val result;
+		fb_pos block_pos, node_pos;
+		_fb_retrieve(&cache_tree, k, &exact, &result, &block_pos, &node_pos);
+		fb_value row;
+		size_t size = sizeof(row);
+		if (fb_cache_probe(&cache_tree, block_pos, k, &row, &size))
+		{
+			// a miss would cache the row, only hits are read again
+			missed += row != (fb_value)k;
+			size = sizeof(row);
+			missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+			++hits;
+		}
+	}
+	fb_commit(&cache_tree);
+	missed += stat("index.cache.log", &after) != 0 || after.st_size != before.st_size;
+	missed += hits == 0;
+	fb_destr_tree(&cache_tree);
+	unlink("index.cache.log");
+	return missed;
+}
+
+/**
+ * Read rows of a tree whose blocks are mapped one by one, each missing
+ * then hitting the cache, then upsert some of them: every call must
+ * load each block of its walk once, the leaf included, whether it
+ * probes, caches or replaces the row
+ * @return The number of checks missed
+ */
+int test_cache_loads(long block_size, long slot_size, long bfactor)
+{
+	fb_tree cache_tree;
+	fb_init_tree(&cache_tree, "index.cache", block_size, slot_size, bfactor);
+	int keys = 2000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&cache_tree, k, val);
+	}
+	fb_shape shape;
+	fb_tree_stats(&cache_tree, &shape, NULL);
+	fb_reset_stats(&cache_tree);
+
+	int missed = 0;
+	fb_value row;
+	size_t size;
+	for (int round = 0; round < 2; ++round)
+	{
+		for (int k = 0; k < keys; ++k)
+		{
+			size = sizeof(row);
+			missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+		}
+	}
+	fb_stats stats;
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.hits == 0 || stats.inserts == 0;
+	missed += stats.loads != 2 * keys * shape.height;
+
+	// an upsert replaces the row and its cached copy in the leaf
+	// loaded by its walk down
+	fb_reset_stats(&cache_tree);
+	for (int k = 0; k < RACE_KEYS; ++k)
+	{
+		row = k + RACE_KEYS;
+		missed += !fb_upsert(&cache_tree, k, &row, sizeof(row), store_race, write_race, NULL);
+		missed += race_heap[k] != row;
+	}
+	fb_get_stats(&cache_tree, &stats);
+	missed += stats.replacements != RACE_KEYS;
+	missed += stats.loads != RACE_KEYS * shape.height;
+	for (int k = 0; k < RACE_KEYS; ++k)
+	{
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&cache_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k + RACE_KEYS;
+	}
+	fb_destr_tree(&cache_tree);
+	return missed;
+}
+
+/**
+ * Insert ascending keys with either split policy, appends
+ * splitting at the last key must leave fewer blocks behind,
+ * also once the tree is opened again halfway
+ * @return The number of keys missed, plus one if no block was saved
+ */
+int test_split_policy(long block_size, long slot_size, long bfactor)
+{
+	int keys = 4000;
+	size_t blocks[2];
+	int missed = 0;
+	for (uint8_t policy = CFB_SPLIT_HALF; policy <= CFB_SPLIT_APPEND; ++policy)
+	{
+		fb_tree split_tree;
+		fb_init_tree(&split_tree, "index.cache", block_size, slot_size, bfactor);
+		fb_split_policy(&split_tree, policy);
+		fb_val val;
+		val.type = CFB_VALUE_TYPE_CNTNT;
+		for (int k = 0; k < keys; ++k)
+		{
+			if (k == keys / 2)
+			{
+				fb_destr_tree(&split_tree);
+				fb_open_tree(&split_tree, "index.cache", block_size, slot_size, bfactor, false);
+				fb_split_policy(&split_tree, policy);
+				missed += split_tree.key_high != (fb_key)k - 1;
+			}
+			val.value = k;
+			fb_insert(&split_tree, k, val);
+		}
+		for (int k = 0; k < keys; ++k)
+		{
+			bool exact;
+			fb_val result;
+			fb_retrieve(&split_tree, k, &exact, &result);
+			missed += !exact || result.value != (fb_value)k;
+		}
+		fb_shape shape;
+		fb_tree_stats(&split_tree, &shape, NULL);
+		blocks[policy] = shape.blocks;
+		fb_destr_tree(&split_tree);
+	}
+	return missed + (blocks[CFB_SPLIT_APPEND] >= blocks[CFB_SPLIT_HALF]);
+}
+
+/**
+ * Open a stored tree, insert until its blocks split and die without
+ * fb_destr_tree, opening it again without a log must be refused
+ * @return One if the crashed tree was opened, zero otherwise
+ */
+int test_unclean_open(long block_size, long slot_size, long bfactor)
+{
+	int keys = 4000;
+	fb_tree unclean_tree;
+	fb_init_tree(&unclean_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = k;
+		fb_insert(&unclean_tree, k, val);
+	}
+	fb_destr_tree(&unclean_tree);
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		fb_open_tree(&unclean_tree, "index.cache", block_size, slot_size, bfactor, false);
+		for (int k = keys; k < 2 * keys; ++k)
+		{
+			val.value = k;
+			fb_insert(&unclean_tree, k, val);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, NULL, 0);
+
+	// the refusal exits, so the reopen runs in a child of its own
+	int status;
+	pid = fork();
+	if (pid == 0)
+	{
+		freopen("/dev/null", "w", stderr);
+		fb_open_tree(&unclean_tree, "index.cache", block_size, slot_size, bfactor, false);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, &status, 0);
+	unlink("index.cache");
+	return !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_FAILURE;
+}
+
+/**
+ * Fill a tree of large blocks holding more slots than one word of
+ * their maps covers, cache rows in them, then open the tree again
+ * @return The number of checks missed
+ */
+int test_block_slots(void)
+{
+	// packed keys keep room for at least 4 whole keys in a node
+	long bfactor = CFB_KEY_DELTA_BITS ? 8 : 6;
+	fb_tree slots_tree;
+	fb_init_tree(&slots_tree, "index.cache", 65536, 128, bfactor);
+	int missed = slots_tree.block_slots <= 256;
+	fb_admit_policy(&slots_tree, CFB_ADMIT_ALL);
+	int keys = 20000;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int k = 0; k < keys; ++k)
+	{
+		val.value = (k * 7919) % keys;
+		fb_insert(&slots_tree, val.value, val);
+	}
+	fb_value row;
+	size_t size;
+	for (int k = 0; k < keys; ++k)
+	{
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&slots_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+	}
+	for (int k = 0; k < keys; ++k)
+	{
+		size = sizeof(row);
+		missed += !fb_retrieve_cached(&slots_tree, k, &row, &size, fetch_row, NULL) || row != (fb_value)k;
+	}
+	fb_stats stats;
+	fb_get_stats(&slots_tree, &stats);
+	missed += stats.hits == 0;
+	fb_destr_tree(&slots_tree);
+
+	fb_open_tree(&slots_tree, "index.cache", 65536, 128, bfactor, false);
+	for (int k = 0; k < keys; ++k)
+	{
+		bool exact;
+		fb_val result;
+		fb_retrieve(&slots_tree, k, &exact, &result);
+		missed += !exact || result.value != (fb_value)k;
+	}
+	fb_destr_tree(&slots_tree);
+	return missed;
+}
+
+#define TEST_THREADS (4)
+
+typedef struct _test_worker test_worker;
+struct _test_worker
+{
+	pthread_t thread;
+	int id;
+	int base;
+	int count;
+	int missed;
+};
+
+/**
+ * Insert keys of its own above base, look up the keys of every worker
+ * and remove back half of its own, while the other workers do the same
+ */
+void *run_worker(void *arg)
+{
+	test_worker *worker = arg;
+	fb_tuple tuple;
+	fb_tuple res;
+	memset(&tuple, 0, sizeof(fb_tuple));
+	for (int i = 0; i < worker->count; ++i)
+	{
+		fb_key key = worker->base + i * TEST_THREADS + worker->id;
+		tuple.id = key;
+		if (i % 2 ? insert_cached(key, &tuple) : insert_uncached(key, &tuple))
+		{
+			++worker->missed;
+		}
+		if (search_cached(key, &res) || res.id != key)
+		{
+			++worker->missed;
+		}
+		// keys of the other workers, present or not yet
+		fb_key other = worker->base + (i * 7) % (worker->count * TEST_THREADS);
+		if (!search_uncached(other, &res) && res.id != other)
+		{
+			++worker->missed;
+		}
+		if (i % 2 && remove_key(worker->base + (i - 1) * TEST_THREADS + worker->id))
+		{
+			++worker->missed;
+		}
+	}
+	return NULL;
+}
+
+// keys of the packed test come in clusters this far apart,
+// out of the reach of the deltas of one node
+#define TEST_PACKED_CLUSTERS (64)
+#define TEST_PACKED_SPREAD ((fb_key)1 << 20)
+
+/**
+ * @return The n-th key of the packed test, spreading
+ *         consecutive ones over the clusters
+ */
+static fb_key packed_key(int n)
+{
+	return (n % TEST_PACKED_CLUSTERS) * TEST_PACKED_SPREAD + n / TEST_PACKED_CLUSTERS;
+}
+
+typedef struct _test_packed_worker test_packed_worker;
+struct _test_packed_worker
+{
+	pthread_t thread;
+	int id;
+	fb_tree *tree;
+	int count;
+	int missed;
+};
+
+/**
+ * Insert keys of its own, spread over all clusters, while
+ * the other workers do the same in the same nodes
+ */
+void *run_packed_worker(void *arg)
+{
+	test_packed_worker *worker = arg;
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int i = 0; i < worker->count; ++i)
+	{
+		int n = i * TEST_THREADS + worker->id;
+		val.value = n;
+		fb_insert(worker->tree, packed_key(n), val);
+		bool exact;
+		fb_val result;
+		fb_retrieve(worker->tree, packed_key(n), &exact, &result);
+		worker->missed += !exact || result.value != (fb_value)n;
+	}
+	return NULL;
+}
+
+/**
+ * Count the entries of a scan, checking they come in order
+ */
+bool count_packed(const fb_key *keys, const fb_value *values, size_t count, void *arg)
+{
+	(void)values;
+	fb_key *last = arg;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (last[1] > 0 && keys[i] <= last[0])
+		{
+			printf("MISSED\n");
+		}
+		last[0] = keys[i];
+		++last[1];
+	}
+	return true;
+}
+
+/**
+ * Check the keys of the packed test left in a tree, every one of them
+ * or the odd ones, by lookups and by a scan over all of them
+ * @return The number of keys missed
+ */
+static int check_packed(fb_tree *tree, int keys, bool odd)
+{
+	int missed = 0;
+	for (int n = 0; n < keys; ++n)
+	{
+		bool exact;
+		fb_val result;
+		fb_retrieve(tree, packed_key(n), &exact, &result);
+		bool kept = !odd || n % 2;
+		missed += exact != kept || (kept && result.value != (fb_value)n);
+	}
+	fb_key last[2] = { 0, 0 };
+	fb_scan(tree, 0, (fb_key)-1, count_packed, last);
+	missed += last[1] != (fb_key)(odd ? keys / 2 : keys);
+	return missed;
+}
+
+/**
+ * Fill a tree with keys too far apart for the deltas of one node, by
+ * workers sharing it, then remove half of them; bulk load them too,
+ * and keys close enough to be packed as they come; then append keys
+ * apart and measure how full their nodes are
+ * @return The number of keys missed, plus one if the nodes look underfull
+ */
+int test_packed_keys(long block_size, long slot_size, long bfactor)
+{
+	int keys = TEST_PACKED_CLUSTERS * 320;
+	int missed = 0;
+	fb_tree packed_tree;
+	fb_init_tree(&packed_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_map_tree(&packed_tree, 0);
+	fb_latch_tree(&packed_tree);
+	test_packed_worker workers[TEST_THREADS];
+	for (int t = 0; t < TEST_THREADS; ++t)
+	{
+		workers[t].id = t;
+		workers[t].tree = &packed_tree;
+		workers[t].count = keys / TEST_THREADS;
+		workers[t].missed = 0;
+		pthread_create(&workers[t].thread, NULL, run_packed_worker, workers + t);
+	}
+	for (int t = 0; t < TEST_THREADS; ++t)
+	{
+		pthread_join(workers[t].thread, NULL);
+		missed += workers[t].missed;
+	}
+	missed += check_packed(&packed_tree, keys, false);
+	for (int n = 0; n < keys; n += 2)
+	{
+		missed += !fb_delete(&packed_tree, packed_key(n), NULL);
+	}
+	missed += check_packed(&packed_tree, keys, true);
+	fb_destr_tree(&packed_tree);
+
+	// sorted keys of the clusters, then consecutive ones
+	fb_key *sorted = malloc(keys * sizeof(fb_key));
+	fb_value *values = malloc(keys * sizeof(fb_value));
+	for (int far = 1; far >= 0; --far)
+	{
+		for (int n = 0; n < keys; ++n)
+		{
+			int c = n / (keys / TEST_PACKED_CLUSTERS);
+			int i = n % (keys / TEST_PACKED_CLUSTERS);
+			sorted[n] = far ? packed_key(i * TEST_PACKED_CLUSTERS + c) : (fb_key)n;
+			values[n] = far ? (fb_value)(i * TEST_PACKED_CLUSTERS + c) : (fb_value)n;
+		}
+		fb_init_tree(&packed_tree, "index.cache", block_size, slot_size, bfactor);
+		fb_bulk_load(&packed_tree, sorted, values, keys, 0.7);
+		fb_destr_tree(&packed_tree);
+		fb_open_tree(&packed_tree, "index.cache", block_size, slot_size, bfactor, false);
+		if (far)
+		{
+			missed += check_packed(&packed_tree, keys, false);
+		}
+		for (int n = 0; !far && n < keys; ++n)
+		{
+			bool exact;
+			fb_val result;
+			fb_retrieve(&packed_tree, n, &exact, &result);
+			missed += !exact || result.value != (fb_value)n;
+		}
+		fb_destr_tree(&packed_tree);
+	}
+	free(values);
+	free(sorted);
+
+	// keys apart appended fill wide nodes up to their own capacity,
+	// measured against the keys of a packed node they would look half empty
+	fb_init_tree(&packed_tree, "index.cache", block_size, slot_size, bfactor);
+	fb_val val;
+	val.type = CFB_VALUE_TYPE_CNTNT;
+	for (int n = 0; n < keys; ++n)
+	{
+		val.value = n;
+		fb_insert(&packed_tree, (fb_key)n * (CFB_KEY_DELTA_MAX + 1) * 2, val);
+	}
+	fb_shape shape;
+	fb_tree_stats(&packed_tree, &shape, NULL);
+	missed += shape.node_fill_avg < 0.6;
+	fb_destr_tree(&packed_tree);
+	return missed;
+}
+
+#define TEST_POOL_BLOCKS (256)
+
+typedef struct _test_pool_worker test_pool_worker;
+struct _test_pool_worker
+{
+	pthread_t thread;
+	int id;
+	fb_pool *pool;
+	int missed;
+};
+
+/**
+ * Pin blocks of a pool shared with the other workers, far more than
+ * it has frames, and stamp the blocks of its own with their position:
+ * a block stamped must come back with its stamp, evicted or not
+ */
+void *run_pool_worker(void *arg)
+{
+	test_pool_worker *worker = arg;
+	bool stamped[TEST_POOL_BLOCKS] = { false };
+	unsigned int seed = worker->id;
+	for (int i = 0; i < 20000; ++i)
+	{
+		fb_pos pos = rand_r(&seed) % TEST_POOL_BLOCKS;
+		uint64_t stamp = pos + 1;
+		bool own = pos % TEST_THREADS == (fb_pos)worker->id;
+		fb_frame *frame = fb_pool_pin(worker->pool, pos, own);
+		uint64_t *head = (uint64_t *)frame->data;
+		uint64_t *tail = (uint64_t *)(frame->data + worker->pool->block_size) - 1;
+		uint64_t first = __atomic_load_n(head, __ATOMIC_RELAXED);
+		uint64_t last = __atomic_load_n(tail, __ATOMIC_RELAXED);
+		worker->missed += (first != 0 && first != stamp) || (last != 0 && last != stamp);
+		if (own)
+		{
+			worker->missed += stamped[pos] && (first != stamp || last != stamp);
+			__atomic_store_n(head, stamp, __ATOMIC_RELAXED);
+			__atomic_store_n(tail, stamp, __ATOMIC_RELAXED);
+			stamped[pos] = true;
+		}
+		fb_pool_unpin(worker->pool, frame);
+	}
+	return NULL;
+}
+
+/**
+ * Let workers share a pool of the fewest frames, so that they
+ * evict each other's blocks while reading and writing them back
+ * @return The number of blocks found without their stamp
+ */
+int test_pool_threads(long block_size)
+{
+	int fd = open("index.pool", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || ftruncate(fd, TEST_POOL_BLOCKS * block_size))
+	{
+		return 1;
+	}
+	fb_pool pool;
+	fb_pool_init(&pool, fd, block_size, CFB_POOL_MIN_FRAMES * block_size);
+	fb_pool_share(&pool);
+
+	int missed = 0;
+	test_pool_worker workers[TEST_THREADS];
+	for (int t = 0; t < TEST_THREADS; ++t)
+	{
+		workers[t].id = t;
+		workers[t].pool = &pool;
+		workers[t].missed = 0;
+		pthread_create(&workers[t].thread, NULL, run_pool_worker, workers + t);
+	}
+	for (int t = 0; t < TEST_THREADS; ++t)
+	{
+		pthread_join(workers[t].thread, NULL);
+		missed += workers[t].missed;
+	}
+	fb_pool_stats stats;
+	fb_pool_get_stats(&pool, &stats);
+	missed += stats.evictions == 0 || stats.writebacks == 0;
+	fb_pool_destr(&pool);
+	close(fd);
+	unlink("index.pool");
+	return missed;
+}
+
+void open_db(const char *mode, long block_size, long slot_size, long bfactor)
+{
+	if (strcmp(mode, "mapped") == 0)
+	{
+		init_mapped(block_size, slot_size, bfactor);
+	}
+	else if (strcmp(mode, "pooled") == 0)
+	{
+		init_pooled(block_size, slot_size, bfactor, 64 * block_size);
+	}
+	else if (strcmp(mode, "latched") == 0)
+	{
+		init_latched(block_size, slot_size, bfactor);
+	}
+	else if (strcmp(mode, "logged") == 0)
+	{
+		init(block_size, slot_size, bfactor);
+		db_log(1000);
+	}
+	else
+	{
+		init(block_size, slot_size, bfactor);
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 5)
+	if (argc != 5 && argc != 6)
 	{
-		fprintf(stderr, "\tUsage: %s index_file block_size slot_size bfactor\n", argv[0]);
+		fprintf(stderr, "\tUsage: %s index_file block_size slot_size bfactor [mapped|pooled|latched|logged]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 	long block_size, slot_size, bfactor;
@@ -54,9 +1185,10 @@ int main(int argc, char *argv[])
 	slot_size = strtol(argv[3], NULL, 10);
 	bfactor = strtol(argv[4], NULL, 10);
 
-	init(block_size, slot_size, bfactor);
-	
-	
+	const char *mode = argc == 6 ? argv[5] : "";
+	open_db(mode, block_size, slot_size, bfactor);
+
+
 	fb_key key;
 	fb_tuple tuple;
 
@@ -99,8 +1231,295 @@ int main(int argc, char *argv[])
 		//printf("<%i, %s, %i, %i>\n", res.id, res.name, res.items[0], res.items[1]);
 	}
 
+	for (int i = 0; i < items; ++i)
+	{
+		if (i % 4 == 0 && remove_key(i))
+		{
+			printf("MISSED\n");
+		}
+	}
+	for (int i = 0; i < items; ++i)
+	{
+		key = i;
+		int ret_val = search_cached(key, &res);
+		if ((i % 4 == 0) != (ret_val != 0))
+		{
+			printf("MISSED\n");
+		}
+	}
+
+	// batches in scattered order, with removed and unknown keys
+	int batch = 500;
+	fb_key *batch_keys = malloc(batch * sizeof(fb_key));
+	fb_tuple *batch_tuples = malloc(batch * sizeof(fb_tuple));
+	bool *batch_found = malloc(batch * sizeof(bool));
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int b = 0; b < batch; ++b)
+		{
+			batch_keys[b] = ((b + round) * 7919) % (items + 1000);
+		}
+		if (round == 0)
+		{
+			search_uncached_batch(batch_keys, batch, batch_tuples, batch_found);
+		}
+		else
+		{
+			search_cached_batch(batch_keys, batch, batch_tuples, batch_found);
+		}
+		for (int b = 0; b < batch; ++b)
+		{
+			bool present = batch_keys[b] < (fb_key)items && batch_keys[b] % 4 != 0;
+			if (batch_found[b] != present || (present && batch_tuples[b].id != batch_keys[b]))
+			{
+				printf("MISSED\n");
+			}
+		}
+	}
+	free(batch_found);
+	free(batch_tuples);
+	free(batch_keys);
+
+	// updates overwrite the tuples in the heap and in the caches
+	struct stat heap_before, heap_after;
+	stat("db", &heap_before);
+	for (int i = 1; i < items; i += 5)
+	{
+		if (i % 4 != 0 && search_cached(i, &res) == 0)
+		{
+			res.items[0] = i + 7;
+			db_upsert(i, &res);
+		}
+	}
+	stat("db", &heap_after);
+	if (heap_after.st_size != heap_before.st_size)
+	{
+		printf("MISSED\n");
+	}
+	for (int i = 1; i < items; i += 5)
+	{
+		if (i % 4 != 0 && (search_cached(i, &res) || res.items[0] != (uint32_t)i + 7
+				|| search_uncached(i, &res) || res.items[0] != (uint32_t)i + 7))
+		{
+			printf("MISSED\n");
+		}
+	}
+
+	key = 0;
+	if (scan_uncached(0, items, check_scan, &key) != (size_t)(items - items / 4))
+	{
+		printf("MISSED\n");
+	}
+	key = 1001;
+	if (scan_uncached(1001, 2000, check_scan, &key) != 750)
+	{
+		printf("MISSED\n");
+	}
+
+#if CFB_KEY_BITS == 64
+	// keys past 32 bits, sign bit included, stay apart from the small ones
+	for (int i = 0; i < items; i += 7)
+	{
+		key = ((fb_key)1 << 63) + ((fb_key)i << 32);
+		tuple.id = key;
+		insert_uncached(key, &tuple);
+	}
+	for (int i = 0; i < items; i += 7)
+	{
+		key = ((fb_key)1 << 63) + ((fb_key)i << 32);
+		if (search_cached(key, &res) || res.id != key || search_uncached(key | 1, &res) == 0)
+		{
+			printf("MISSED\n");
+		}
+	}
+#endif
+
+	if (strcmp(mode, "latched") == 0)
+	{
+		// workers sharing the tree, then check what they left
+		test_worker workers[TEST_THREADS];
+		for (int t = 0; t < TEST_THREADS; ++t)
+		{
+			workers[t].id = t;
+			workers[t].base = 2 * items;
+			workers[t].count = items;
+			workers[t].missed = 0;
+			pthread_create(&workers[t].thread, NULL, run_worker, workers + t);
+		}
+		for (int t = 0; t < TEST_THREADS; ++t)
+		{
+			pthread_join(workers[t].thread, NULL);
+			if (workers[t].missed)
+			{
+				printf("MISSED\n");
+			}
+		}
+		for (int i = 0; i < items * TEST_THREADS; ++i)
+		{
+			// the first of each pair of keys of a worker was removed
+			key = 2 * items + i;
+			int ret_val = search_uncached(key, &res);
+			if ((i / TEST_THREADS % 2 == 0) != (ret_val != 0))
+			{
+				printf("MISSED\n");
+			}
+		}
+	}
+
+	destr();
+
+	// bulk load the even keys, then insert the odd ones in between
+	open_db(mode, block_size, slot_size, bfactor);
+	fb_key *keys = malloc(items / 2 * sizeof(fb_key));
+	fb_tuple *tuples = malloc(items / 2 * sizeof(fb_tuple));
+	for (int i = 0; i < items / 2; ++i)
+	{
+		keys[i] = 2 * i;
+		tuples[i].id = 2 * i;
+		memcpy(tuples[i].name, "abcdefghijklmnopqrs\0", 20);
+		tuples[i].items[0] = 2 * i + 1;
+		tuples[i].items[1] = 2 * i - 1;
+	}
+	load_sorted(keys, tuples, items / 2, 0.7);
+	free(tuples);
+	free(keys);
+	for (int i = 1; i < items; i += 2)
+	{
+		key = i;
+		tuple.id = i;
+		insert_uncached(key, &tuple);
+	}
+	for (int i = 0; i < items; ++i)
+	{
+		key = i;
+		if (search_uncached(key, &res) || res.id != (fb_key)i)
+		{
+			printf("MISSED\n");
+		}
+	}
+
 	destr();
 
+	// the stored tree comes back as it was left
+	db_open(block_size, slot_size, bfactor, false);
+	for (int i = 0; i < items; ++i)
+	{
+		key = i;
+		if (search_uncached(key, &res) || res.id != (fb_key)i)
+		{
+			printf("MISSED\n");
+		}
+	}
+	key = items;
+	tuple.id = items;
+	insert_uncached(key, &tuple);
+	if (search_uncached(key, &res) || res.id != (fb_key)items)
+	{
+		printf("MISSED\n");
+	}
+
+	destr();
+
+	if (strcmp(mode, "logged") == 0)
+	{
+		// committed changes survive a writer dying without destr
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			db_open(block_size, slot_size, bfactor, true);
+			db_log(1000);
+			for (int i = items + 1; i < 2 * items; ++i)
+			{
+				key = i;
+				tuple.id = i;
+				insert_cached(key, &tuple);
+			}
+			for (int i = 0; i < items; i += 3)
+			{
+				remove_key(i);
+			}
+			db_commit();
+			_exit(EXIT_SUCCESS);
+		}
+		waitpid(pid, NULL, 0);
+
+		db_open(block_size, slot_size, bfactor, true);
+		db_log(1000);
+		for (int i = 0; i < 2 * items; ++i)
+		{
+			key = i;
+			bool kept = i >= items || i % 3 != 0;
+			if ((search_cached(key, &res) == 0) != kept || (kept && res.id != (fb_key)i))
+			{
+				printf("MISSED\n");
+			}
+		}
+		destr();
+	}
+
+	for (uint8_t policy = CFB_CACHE_HASHED; policy <= CFB_CACHE_LFU; ++policy)
+	{
+		if (test_cache_sizes(block_size, slot_size, bfactor, policy))
+		{
+			printf("MISSED\n");
+		}
+	}
+	if (test_cache_clock(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_cache_lfu(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_cache_race(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_upsert_pending(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_cache_admission(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_cache_probe_log(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_cache_loads(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_split_policy(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_unclean_open(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+	if (test_block_slots())
+	{
+		printf("MISSED\n");
+	}
+	if (test_packed_keys(block_size, slot_size, bfactor))
+	{
+		printf("MISSED\n");
+	}
+#if CFB_KEY_DELTA_BITS == 16 && CFB_KEY_BITS == 32 && !CFB_LAYOUT_ALIGNED
+	// deltas leave room in a slot for a bfactor whole keys do not fit
+	if (test_packed_keys(4096, 128, 17))
+	{
+		printf("MISSED\n");
+	}
+#endif
+	if (test_pool_threads(block_size))
+	{
+		printf("MISSED\n");
+	}
+
 	return EXIT_SUCCESS;
 }
 